@@ -14,6 +14,7 @@
 #include <linux/types.h>
 
 #define BUS1_FD_MAX			(256)
+#define BUS1_MSG_INLINE_MAX		(64)
 
 #define BUS1_IOCTL_MAGIC		0x96
 #define BUS1_HANDLE_INVALID		((__u64)-1)
@@ -27,6 +28,15 @@ enum {
 enum {
 	BUS1_PEER_RESET_FLAG_FLUSH				= 1ULL <<  0,
 	BUS1_PEER_RESET_FLAG_FLUSH_SEED				= 1ULL <<  1,
+	BUS1_PEER_RESET_FLAG_PREFAULT				= 1ULL <<  2,
+};
+
+enum {
+	BUS1_PEER_FLAG_POOL_HUGEPAGE				= 1ULL <<  0,
+	BUS1_PEER_FLAG_POOL_RING				= 1ULL <<  1,
+	BUS1_PEER_FLAG_RECV_INLINE				= 1ULL <<  2,
+	BUS1_PEER_FLAG_POLLOUT					= 1ULL <<  3,
+	BUS1_PEER_FLAG_NOTIFY_COALESCE				= 1ULL <<  4,
 };
 
 struct bus1_cmd_peer_reset {
@@ -36,6 +46,10 @@ struct bus1_cmd_peer_reset {
 	__u32 max_handles;
 	__u32 max_inflight_bytes;
 	__u32 max_inflight_fds;
+	__u64 recv_timeout_ns;
+	__u64 recv_busy_poll_ns;
+	__u64 pool_size;
+	__u64 send_timeout_ns;
 } __attribute__((__aligned__(8)));
 
 struct bus1_cmd_handle_transfer {
@@ -45,6 +59,22 @@ struct bus1_cmd_handle_transfer {
 	__u64 dst_handle;
 } __attribute__((__aligned__(8)));
 
+struct bus1_cmd_handles_release {
+	__u64 flags;
+	__u64 ptr_handles;
+	__u64 ptr_errors;
+	__u64 n_handles;
+} __attribute__((__aligned__(8)));
+
+struct bus1_cmd_handles_transfer {
+	__u64 flags;
+	__u64 dst_fd;
+	__u64 ptr_src_handles;
+	__u64 ptr_dst_handles;
+	__u64 ptr_errors;
+	__u64 n_handles;
+} __attribute__((__aligned__(8)));
+
 enum {
 	BUS1_NODES_DESTROY_FLAG_RELEASE_HANDLES			= 1ULL <<  0,
 };
@@ -55,11 +85,34 @@ struct bus1_cmd_nodes_destroy {
 	__u64 n_nodes;
 } __attribute__((__aligned__(8)));
 
+struct bus1_cmd_slices_release {
+	__u64 flags;
+	__u64 ptr_offsets;
+	__u64 ptr_errors;
+	__u64 n_offsets;
+} __attribute__((__aligned__(8)));
+
+struct bus1_cmd_slice_install_fds {
+	__u64 flags;
+	__u64 offset;
+	__u64 ptr_indices;
+	__u64 ptr_fds;
+	__u64 n_fds;
+} __attribute__((__aligned__(8)));
+
 enum {
 	BUS1_SEND_FLAG_CONTINUE					= 1ULL <<  0,
 	BUS1_SEND_FLAG_SEED					= 1ULL <<  1,
+	BUS1_SEND_FLAG_SLICE_FDS				= 1ULL <<  2,
+	BUS1_SEND_FLAG_SET					= 1ULL <<  3,
+	BUS1_SEND_FLAG_WAIT					= 1ULL <<  4,
 };
 
+struct bus1_slice_fd {
+	__u64 offset;
+	__u64 index;
+} __attribute__((__aligned__(8)));
+
 struct bus1_cmd_send {
 	__u64 flags;
 	__u64 ptr_destinations;
@@ -73,9 +126,22 @@ struct bus1_cmd_send {
 	__u64 n_fds;
 } __attribute__((__aligned__(8)));
 
+struct bus1_cmd_set_register {
+	__u64 flags;
+	__u64 ptr_destinations;
+	__u64 n_destinations;
+	__u64 ptr_vecs;
+	__u64 n_vecs;
+	__u64 set_id;
+} __attribute__((__aligned__(8)));
+
 enum {
 	BUS1_RECV_FLAG_SEED					= 1ULL <<  0,
 	BUS1_RECV_FLAG_INSTALL_FDS				= 1ULL <<  1,
+	BUS1_RECV_FLAG_WAIT					= 1ULL <<  2,
+	BUS1_RECV_FLAG_DESTINATION				= 1ULL <<  3,
+	BUS1_RECV_FLAG_KEEP_FDS					= 1ULL <<  4,
+	BUS1_RECV_FLAG_RELEASE					= 1ULL <<  5,
 };
 
 enum {
@@ -87,20 +153,32 @@ enum {
 
 enum {
 	BUS1_MSG_FLAG_CONTINUE					= 1ULL <<  0,
+	BUS1_MSG_FLAG_INLINE					= 1ULL <<  1,
+	BUS1_MSG_FLAG_COALESCED					= 1ULL <<  2,
 };
 
+struct bus1_msg {
+	__u64 type;
+	__u64 flags;
+	__u64 destination;
+	__u64 offset;
+	__u64 n_bytes;
+	__u64 n_handles;
+	__u64 n_fds;
+} __attribute__((__aligned__(8)));
+
 struct bus1_cmd_recv {
 	__u64 flags;
 	__u64 max_offset;
-	struct {
-		__u64 type;
-		__u64 flags;
-		__u64 destination;
-		__u64 offset;
-		__u64 n_bytes;
-		__u64 n_handles;
-		__u64 n_fds;
-	} __attribute__((__aligned__(8))) msg;
+	struct bus1_msg msg;
+} __attribute__((__aligned__(8)));
+
+struct bus1_cmd_recv_many {
+	__u64 flags;
+	__u64 max_offset;
+	__u64 ptr_msgs;
+	__u64 n_msgs;
+	__u64 ptr_data;
 } __attribute__((__aligned__(8)));
 
 enum {
@@ -114,14 +192,28 @@ enum {
 					__u64),
 	BUS1_CMD_HANDLE_TRANSFER	= _IOWR(BUS1_IOCTL_MAGIC, 0x11,
 					struct bus1_cmd_handle_transfer),
+	BUS1_CMD_HANDLES_RELEASE	= _IOWR(BUS1_IOCTL_MAGIC, 0x12,
+					struct bus1_cmd_handles_release),
+	BUS1_CMD_HANDLES_TRANSFER	= _IOWR(BUS1_IOCTL_MAGIC, 0x13,
+					struct bus1_cmd_handles_transfer),
 	BUS1_CMD_NODES_DESTROY		= _IOWR(BUS1_IOCTL_MAGIC, 0x20,
 					struct bus1_cmd_nodes_destroy),
 	BUS1_CMD_SLICE_RELEASE		= _IOWR(BUS1_IOCTL_MAGIC, 0x30,
 					__u64),
+	BUS1_CMD_SLICES_RELEASE		= _IOWR(BUS1_IOCTL_MAGIC, 0x31,
+					struct bus1_cmd_slices_release),
+	BUS1_CMD_SLICE_INSTALL_FDS	= _IOWR(BUS1_IOCTL_MAGIC, 0x32,
+					struct bus1_cmd_slice_install_fds),
 	BUS1_CMD_SEND			= _IOWR(BUS1_IOCTL_MAGIC, 0x40,
 					struct bus1_cmd_send),
+	BUS1_CMD_SET_REGISTER		= _IOWR(BUS1_IOCTL_MAGIC, 0x42,
+					struct bus1_cmd_set_register),
+	BUS1_CMD_SET_UNREGISTER		= _IOWR(BUS1_IOCTL_MAGIC, 0x43,
+					__u64),
 	BUS1_CMD_RECV			= _IOWR(BUS1_IOCTL_MAGIC, 0x50,
 					struct bus1_cmd_recv),
+	BUS1_CMD_RECV_MANY		= _IOWR(BUS1_IOCTL_MAGIC, 0x51,
+					struct bus1_cmd_recv_many),
 };
 
 #endif /* _UAPI_LINUX_BUS1_H */
@@ -9,26 +9,88 @@
 
 #include <linux/atomic.h>
 #include <linux/err.h>
+#include <linux/hash.h>
 #include <linux/kernel.h>
 #include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/percpu_counter.h>
 #include <linux/rbtree.h>
 #include <linux/rcupdate.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include "handle.h"
 #include "peer.h"
+#include "trace.h"
 #include "tx.h"
 #include "util.h"
+#include "util/flist.h"
 #include "util/queue.h"
 
+static struct kmem_cache *bus1_handle_cache;
+struct percpu_counter bus1_handle_count;
+
+/**
+ * bus1_handle_modinit() - initialize global resources of handles
+ *
+ * This allocates the slab cache used for handles, as well as the global handle
+ * counter. It is meant to be called on module-init.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_handle_modinit(void)
+{
+	int r;
+
+	r = percpu_counter_init(&bus1_handle_count, 0, GFP_KERNEL);
+	if (r < 0)
+		return r;
+
+	bus1_handle_cache = kmem_cache_create(KBUILD_MODNAME "-handle",
+					      sizeof(struct bus1_handle),
+					      0, 0, NULL);
+	if (!bus1_handle_cache) {
+		percpu_counter_destroy(&bus1_handle_count);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/**
+ * bus1_handle_modexit() - clean up global resources of handles
+ *
+ * This waits for all rcu-delayed handle releases to finish, then destroys the
+ * handle cache. The caller must make sure no handle is referenced anymore.
+ * This is meant to be called on module-exit.
+ */
+void bus1_handle_modexit(void)
+{
+	rcu_barrier();
+	kmem_cache_destroy(bus1_handle_cache);
+	bus1_handle_cache = NULL;
+	WARN_ON(percpu_counter_sum(&bus1_handle_count) != 0);
+	percpu_counter_destroy(&bus1_handle_count);
+}
+
+static void bus1_handle_free_rcu(struct rcu_head *rcu)
+{
+	struct bus1_handle *h = container_of(rcu, struct bus1_handle,
+					     qnode.rcu);
+
+	kmem_cache_free(bus1_handle_cache, h);
+}
+
 static void bus1_handle_init(struct bus1_handle *h, struct bus1_peer *holder)
 {
+	percpu_counter_inc(&bus1_handle_count);
 	kref_init(&h->ref);
 	atomic_set(&h->n_weak, 0);
 	atomic_set(&h->n_user, 0);
 	h->holder = holder;
 	h->anchor = NULL;
 	h->tlink = NULL;
-	RB_CLEAR_NODE(&h->rb_to_peer);
+	INIT_HLIST_NODE(&h->hash_to_peer);
 	h->id = BUS1_HANDLE_INVALID;
 }
 
@@ -43,7 +105,7 @@ static void bus1_handle_deinit(struct bus1_handle *h)
 	}
 
 	bus1_queue_node_deinit(&h->qnode);
-	WARN_ON(!RB_EMPTY_NODE(&h->rb_to_peer));
+	WARN_ON(!hlist_unhashed(&h->hash_to_peer));
 	WARN_ON(h->tlink);
 	WARN_ON(atomic_read(&h->n_user) != 0);
 	WARN_ON(atomic_read(&h->n_weak) != 0);
@@ -61,7 +123,7 @@ struct bus1_handle *bus1_handle_new_anchor(struct bus1_peer *holder)
 {
 	struct bus1_handle *anchor;
 
-	anchor = kmalloc(sizeof(*anchor), GFP_KERNEL);
+	anchor = kmem_cache_alloc(bus1_handle_cache, GFP_KERNEL);
 	if (!anchor)
 		return ERR_PTR(-ENOMEM);
 
@@ -94,7 +156,7 @@ struct bus1_handle *bus1_handle_new_remote(struct bus1_peer *holder,
 	if (WARN_ON(!other))
 		return ERR_PTR(-ENOTRECOVERABLE);
 
-	remote = kmalloc(sizeof(*remote), GFP_KERNEL);
+	remote = kmem_cache_alloc(bus1_handle_cache, GFP_KERNEL);
 	if (!remote)
 		return ERR_PTR(-ENOMEM);
 
@@ -119,7 +181,8 @@ void bus1_handle_free(struct kref *k)
 	struct bus1_handle *h = container_of(k, struct bus1_handle, ref);
 
 	bus1_handle_deinit(h);
-	kfree_rcu(h, qnode.rcu);
+	percpu_counter_dec(&bus1_handle_count);
+	call_rcu(&h->qnode.rcu, bus1_handle_free_rcu);
 }
 
 static struct bus1_peer *bus1_handle_acquire_holder(struct bus1_handle *handle)
@@ -158,14 +221,15 @@ struct bus1_peer *bus1_handle_acquire_owner(struct bus1_handle *handle)
 	return bus1_handle_acquire_holder(handle->anchor);
 }
 
-static void bus1_handle_queue_release(struct bus1_handle *handle)
+static bool bus1_handle_queue_release(struct bus1_handle *handle)
 {
 	struct bus1_handle *anchor = handle->anchor;
 	struct bus1_peer *owner;
+	bool wake = false;
 
 	if (test_bit(BUS1_HANDLE_BIT_RELEASED, &anchor->node.flags) ||
 	    test_bit(BUS1_HANDLE_BIT_DESTROYED, &anchor->node.flags))
-		return;
+		return false;
 
 	owner = anchor->holder;
 	lockdep_assert_held(&owner->data.lock);
@@ -180,6 +244,9 @@ static void bus1_handle_queue_release(struct bus1_handle *handle)
 		 * tag (there cannot be any conflicts since we have a unique
 		 * commit timestamp for this message, thus any group tag would
 		 * work fine).
+		 * If the owner coalesces notifications, back-to-back releases
+		 * share their commit timestamp instead, and thus form a single
+		 * group which the owner receives as one message.
 		 * If the group tag is already set, we know the release
 		 * notification was already used before. Hence, we must
 		 * re-initialize the object.
@@ -193,9 +260,16 @@ static void bus1_handle_queue_release(struct bus1_handle *handle)
 
 		anchor->qnode.group = owner;
 		bus1_handle_ref(anchor);
-		bus1_queue_commit_unstaged(&owner->data.queue, &owner->waitq,
-					   &anchor->qnode);
+		if (READ_ONCE(owner->flags) & BUS1_PEER_FLAG_NOTIFY_COALESCE)
+			wake = bus1_queue_commit_grouped(&owner->data.queue,
+							 &anchor->qnode);
+		else
+			wake = bus1_queue_commit_unstaged(&owner->data.queue,
+							  &anchor->qnode);
+		trace_bus1_queue_add(owner, &anchor->qnode);
 	}
+
+	return wake;
 }
 
 static void bus1_handle_flush_release(struct bus1_handle *handle)
@@ -211,12 +285,35 @@ static void bus1_handle_flush_release(struct bus1_handle *handle)
 	lockdep_assert_held(&owner->data.lock);
 
 	if (bus1_queue_node_is_queued(&anchor->qnode)) {
+		trace_bus1_queue_remove(owner, &anchor->qnode);
 		bus1_queue_remove(&owner->data.queue, &owner->waitq,
 				  &anchor->qnode);
 		bus1_handle_unref(anchor);
 	}
 }
 
+static struct bus1_handle *bus1_handle_find_by_holder(struct bus1_handle *anchor,
+						      struct bus1_peer *peer)
+{
+	struct bus1_handle *h;
+	struct rb_node *n;
+
+	lockdep_assert_held(&anchor->holder->data.lock);
+
+	n = anchor->node.map_handles.rb_node;
+	while (n) {
+		h = container_of(n, struct bus1_handle, remote.rb_to_anchor);
+		if (peer < h->holder)
+			n = n->rb_left;
+		else if (peer > h->holder)
+			n = n->rb_right;
+		else /* if (peer == h->holder) */
+			return bus1_handle_ref(h);
+	}
+
+	return NULL;
+}
+
 /**
  * bus1_handle_ref_by_other() - lookup handle on a peer
  * @peer:		peer to lookup handle for
@@ -234,9 +331,8 @@ static void bus1_handle_flush_release(struct bus1_handle *handle)
 struct bus1_handle *bus1_handle_ref_by_other(struct bus1_peer *peer,
 					     struct bus1_handle *handle)
 {
-	struct bus1_handle *h, *res = NULL;
-	struct bus1_peer *owner = NULL;
-	struct rb_node *n;
+	struct bus1_handle *res;
+	struct bus1_peer *owner;
 
 	if (peer == handle->anchor->holder)
 		return bus1_handle_ref(handle->anchor);
@@ -246,24 +342,77 @@ struct bus1_handle *bus1_handle_ref_by_other(struct bus1_peer *peer,
 		return NULL;
 
 	mutex_lock(&owner->data.lock);
-	n = handle->anchor->node.map_handles.rb_node;
-	while (n) {
-		h = container_of(n, struct bus1_handle, remote.rb_to_anchor);
-		if (peer < h->holder) {
-			n = n->rb_left;
-		} else if (peer > h->holder) {
-			n = n->rb_right;
-		} else /* if (peer == h->holder) */ {
-			res = bus1_handle_ref(h);
-			break;
-		}
-	}
+	res = bus1_handle_find_by_holder(handle->anchor, peer);
 	mutex_unlock(&owner->data.lock);
 
 	bus1_peer_release(owner);
 	return res;
 }
 
+/**
+ * bus1_handle_ref_by_other_n() - lookup multiple handles on a peer
+ * @peer:		peer to lookup handles for
+ * @src:		flist of other handles to match for
+ * @dst:		flist to store the results in
+ * @n:			number of entries in @src and @dst
+ *
+ * This is equivalent to calling bus1_handle_ref_by_other() on each entry of
+ * @src, and storing the result in the respective entry of @dst. However,
+ * handles passed in a single message usually refer to nodes of only a few
+ * owners, often just the sender. Hence, the owner is only acquired and locked
+ * once for each run of consecutive handles with the same owner, rather than
+ * once per handle. For multicasts, this is done once per destination.
+ *
+ * The caller must hold an active reference to @peer.
+ */
+void bus1_handle_ref_by_other_n(struct bus1_peer *peer,
+				struct bus1_flist *src,
+				struct bus1_flist *dst,
+				size_t n)
+{
+	struct bus1_handle *h, *anchor;
+	struct bus1_peer *owner = NULL;
+	size_t i, j;
+
+	for (i = 0, j = 0;
+	     i < n;
+	     src = bus1_flist_next(src, &i), dst = bus1_flist_next(dst, &j)) {
+		h = src->ptr;
+		anchor = h->anchor;
+
+		if (peer == anchor->holder) {
+			dst->ptr = bus1_handle_ref(anchor);
+			continue;
+		}
+
+		/*
+		 * If @owner is already acquired and locked, and also owns this
+		 * node, the node is still attached if n_weak is set, just like
+		 * in bus1_handle_acquire_holder(). The pointer comparison is
+		 * safe, since we pin @owner.
+		 */
+		if (!owner || owner != anchor->holder) {
+			if (owner) {
+				mutex_unlock(&owner->data.lock);
+				bus1_peer_release(owner);
+			}
+			owner = bus1_handle_acquire_owner(h);
+			if (owner)
+				mutex_lock(&owner->data.lock);
+		}
+
+		if (owner && atomic_read_acquire(&anchor->n_weak) > 0)
+			dst->ptr = bus1_handle_find_by_holder(anchor, peer);
+		else
+			dst->ptr = NULL;
+	}
+
+	if (owner) {
+		mutex_unlock(&owner->data.lock);
+		bus1_peer_release(owner);
+	}
+}
+
 static struct bus1_handle *bus1_handle_splice(struct bus1_handle *handle)
 {
 	struct bus1_queue_node *qnode = &handle->qnode;
@@ -427,11 +576,12 @@ struct bus1_handle *bus1_handle_acquire_slow(struct bus1_handle *handle,
 	return handle;
 }
 
-static void bus1_handle_release_locked(struct bus1_handle *h,
+static bool bus1_handle_release_locked(struct bus1_handle *h,
 				       struct bus1_peer *owner,
 				       bool strong)
 {
 	struct bus1_handle *t, *safe, *anchor = h->anchor;
+	bool wake = false;
 
 	if (atomic_dec_return(&h->n_weak) == 0) {
 		if (test_bit(BUS1_HANDLE_BIT_RELEASED, &anchor->node.flags)) {
@@ -484,7 +634,7 @@ static void bus1_handle_release_locked(struct bus1_handle *h,
 		/* queue release after detach but before unref */
 		if (strong && atomic_dec_return(&anchor->node.n_strong) == 0) {
 			if (owner)
-				bus1_handle_queue_release(anchor);
+				wake = bus1_handle_queue_release(anchor);
 		}
 
 		/*
@@ -495,8 +645,10 @@ static void bus1_handle_release_locked(struct bus1_handle *h,
 	} else if (strong && atomic_dec_return(&anchor->node.n_strong) == 0) {
 		/* still weak refs left, only queue release notification */
 		if (owner)
-			bus1_handle_queue_release(anchor);
+			wake = bus1_handle_queue_release(anchor);
 	}
+
+	return wake;
 }
 
 /**
@@ -510,6 +662,7 @@ void bus1_handle_release_slow(struct bus1_handle *handle, bool strong)
 {
 	const bool is_anchor = (handle == handle->anchor);
 	struct bus1_peer *owner, *holder;
+	bool wake;
 
 	/*
 	 * Caller must own an active reference to the holder of @handle.
@@ -527,10 +680,14 @@ void bus1_handle_release_slow(struct bus1_handle *handle, bool strong)
 
 	bus1_mutex_lock2(&holder->data.lock,
 			 owner ? &owner->data.lock : NULL);
-	bus1_handle_release_locked(handle, owner, strong);
+	wake = bus1_handle_release_locked(handle, owner, strong);
 	bus1_mutex_unlock2(&holder->data.lock,
 			   owner ? &owner->data.lock : NULL);
 
+	/* a queued release notification is unicast, wake its owner now */
+	if (wake)
+		bus1_peer_wake(owner);
+
 	if (!is_anchor)
 		bus1_peer_release(owner);
 }
@@ -564,6 +721,7 @@ void bus1_handle_destroy_locked(struct bus1_handle *handle, struct bus1_tx *tx)
 
 	/* flush release and reuse qnode for destruction */
 	if (bus1_queue_node_is_queued(&handle->qnode)) {
+		trace_bus1_queue_remove(owner, &handle->qnode);
 		bus1_queue_remove(&owner->data.queue, &owner->waitq,
 				  &handle->qnode);
 		bus1_handle_unref(handle);
@@ -641,6 +799,120 @@ bool bus1_handle_is_live_at(struct bus1_handle *h, u64 timestamp)
 	return (ts == 0) || (ts & 1) || (timestamp <= ts);
 }
 
+static struct hlist_head *bus1_handle_map_alloc(unsigned int shift)
+{
+	size_t i, n = 1UL << shift;
+	struct hlist_head *map;
+
+	map = kmalloc_array(n, sizeof(*map), GFP_KERNEL | __GFP_NOWARN);
+	if (!map)
+		map = vmalloc(n * sizeof(*map));
+	if (!map)
+		return NULL;
+
+	for (i = 0; i < n; ++i)
+		INIT_HLIST_HEAD(&map[i]);
+
+	return map;
+}
+
+/**
+ * bus1_handle_map_init() - initialize handle map of a peer
+ * @peer:			peer to operate on
+ *
+ * This allocates the initial hash map of the ID-namespace of @peer. The map
+ * grows on demand, see bus1_handle_map_link().
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_handle_map_init(struct bus1_peer *peer)
+{
+	struct hlist_head *map;
+
+	map = bus1_handle_map_alloc(BUS1_HANDLE_MAP_SHIFT_MIN);
+	if (!map)
+		return -ENOMEM;
+
+	peer->local.map_handles = map;
+	peer->local.map_shift = BUS1_HANDLE_MAP_SHIFT_MIN;
+	peer->local.n_map_handles = 0;
+	return 0;
+}
+
+/**
+ * bus1_handle_map_deinit() - deinitialize handle map of a peer
+ * @peer:			peer to operate on
+ *
+ * This releases the hash map of the ID-namespace of @peer. The map must be
+ * empty. If it was never initialized, this is a no-op.
+ */
+void bus1_handle_map_deinit(struct bus1_peer *peer)
+{
+	WARN_ON(peer->local.n_map_handles != 0);
+	kvfree(peer->local.map_handles);
+	peer->local.map_handles = NULL;
+}
+
+static struct hlist_head *bus1_handle_map_bucket(struct bus1_peer *peer,
+						 u64 id)
+{
+	return &peer->local.map_handles[hash_64(id, peer->local.map_shift)];
+}
+
+static void bus1_handle_map_grow(struct bus1_peer *peer)
+{
+	unsigned int i, shift = peer->local.map_shift + 1;
+	struct hlist_head *map, *old = peer->local.map_handles;
+	struct bus1_handle *h;
+	struct hlist_node *safe;
+
+	/*
+	 * Growing the map is merely an optimization. If the allocation fails,
+	 * we simply stay with the current map and retry on the next insertion.
+	 */
+	map = bus1_handle_map_alloc(shift);
+	if (!map)
+		return;
+
+	for (i = 0; i < (1U << peer->local.map_shift); ++i)
+		hlist_for_each_entry_safe(h, safe, &old[i], hash_to_peer)
+			hlist_add_head(&h->hash_to_peer,
+				       &map[hash_64(h->id, shift)]);
+
+	peer->local.map_handles = map;
+	peer->local.map_shift = shift;
+	kvfree(old);
+}
+
+/*
+ * Link @h into the ID-namespace of its holder, using @bucket as calculated
+ * via bus1_handle_map_bucket(). The map is kept at a load-factor of at most 1,
+ * so lookups stay O(1) regardless of the number of handles.
+ */
+static void bus1_handle_map_link(struct bus1_handle *h,
+				 struct hlist_head *bucket)
+{
+	struct bus1_peer *peer = h->holder;
+
+	hlist_add_head(&h->hash_to_peer, bucket);
+
+	if (++peer->local.n_map_handles > (1UL << peer->local.map_shift) &&
+	    peer->local.map_shift < BUS1_HANDLE_MAP_SHIFT_MAX)
+		bus1_handle_map_grow(peer);
+}
+
+static struct bus1_handle *bus1_handle_map_find(struct hlist_head *bucket,
+						u64 id)
+{
+	struct bus1_handle *h;
+
+	hlist_for_each_entry(h, bucket, hash_to_peer)
+		if (h->id == id)
+			return h;
+
+	return NULL;
+}
+
 /**
  * bus1_handle_import() - import handle
  * @peer:			peer to operate on
@@ -661,24 +933,16 @@ struct bus1_handle *bus1_handle_import(struct bus1_peer *peer,
 				       u64 id,
 				       bool *is_newp)
 {
+	struct hlist_head *bucket;
 	struct bus1_handle *h;
-	struct rb_node *n, **slot;
 
 	lockdep_assert_held(&peer->local.lock);
 
-	n = NULL;
-	slot = &peer->local.map_handles.rb_node;
-	while (*slot) {
-		n = *slot;
-		h = container_of(n, struct bus1_handle, rb_to_peer);
-		if (id < h->id) {
-			slot = &n->rb_left;
-		} else if (id > h->id) {
-			slot = &n->rb_right;
-		} else /* if (id == h->id) */ {
-			*is_newp = false;
-			return bus1_handle_ref(h);
-		}
+	bucket = bus1_handle_map_bucket(peer, id);
+	h = bus1_handle_map_find(bucket, id);
+	if (h) {
+		*is_newp = false;
+		return bus1_handle_ref(h);
 	}
 
 	if (id & (BUS1_HANDLE_FLAG_MANAGED | BUS1_HANDLE_FLAG_REMOTE))
@@ -690,8 +954,7 @@ struct bus1_handle *bus1_handle_import(struct bus1_peer *peer,
 
 	h->id = id;
 	bus1_handle_ref(h);
-	rb_link_node(&h->rb_to_peer, n, slot);
-	rb_insert_color(&h->rb_to_peer, &peer->local.map_handles);
+	bus1_handle_map_link(h, bucket);
 
 	*is_newp = true;
 	return h;
@@ -731,8 +994,7 @@ u64 bus1_handle_identify(struct bus1_handle *h)
  */
 void bus1_handle_export(struct bus1_handle *handle)
 {
-	struct bus1_handle *h;
-	struct rb_node *n, **slot;
+	struct hlist_head *bucket;
 
 	/*
 	 * The caller must own a weak reference to @handle when calling this.
@@ -742,56 +1004,24 @@ void bus1_handle_export(struct bus1_handle *handle)
 	WARN_ON(!handle->holder);
 	lockdep_assert_held(&handle->holder->local.lock);
 
-	if (RB_EMPTY_NODE(&handle->rb_to_peer)) {
+	if (hlist_unhashed(&handle->hash_to_peer)) {
 		bus1_handle_identify(handle);
 
-		n = NULL;
-		slot = &handle->holder->local.map_handles.rb_node;
-		while (*slot) {
-			n = *slot;
-			h = container_of(n, struct bus1_handle, rb_to_peer);
-			if (WARN_ON(handle->id == h->id))
-				return;
-			else if (handle->id < h->id)
-				slot = &n->rb_left;
-			else /* if (handle->id > h->id) */
-				slot = &n->rb_right;
-		}
+		bucket = bus1_handle_map_bucket(handle->holder, handle->id);
+		if (WARN_ON(bus1_handle_map_find(bucket, handle->id)))
+			return;
 
 		bus1_handle_ref(handle);
-		rb_link_node(&handle->rb_to_peer, n, slot);
-		rb_insert_color(&handle->rb_to_peer,
-				&handle->holder->local.map_handles);
+		bus1_handle_map_link(handle, bucket);
 	}
 }
 
-static void bus1_handle_forget_internal(struct bus1_handle *h, bool erase_rb)
-{
-	/*
-	 * The passed handle might not have any weak references. Hence, we
-	 * require the caller to pass the holder explicitly as @peer. However,
-	 * if @handle has weak references, we want to WARN if it does not match
-	 * @peer. Since this is unlocked, we use ACCESS_ONCE() here to get a
-	 * consistent value. This is purely for debugging.
-	 */
-	lockdep_assert_held(&h->holder->local.lock);
-
-	if (bus1_handle_is_public(h) || RB_EMPTY_NODE(&h->rb_to_peer))
-		return;
-
-	if (erase_rb)
-		rb_erase(&h->rb_to_peer, &h->holder->local.map_handles);
-	RB_CLEAR_NODE(&h->rb_to_peer);
-	h->id = BUS1_HANDLE_INVALID;
-	bus1_handle_unref(h);
-}
-
 /**
  * bus1_handle_forget() - forget handle
  * @h:				handle to operate on, or NULL
  *
- * If @h is not public, but linked into the ID-lookup tree, this will remove it
- * from the tree and clear the ID of @h. It basically undoes what
+ * If @h is not public, but linked into the ID-lookup map, this will remove it
+ * from the map and clear the ID of @h. It basically undoes what
  * bus1_handle_import() and bus1_handle_export() do.
  *
  * Note that there is no counter in bus1_handle_import() or
@@ -802,21 +1032,16 @@ static void bus1_handle_forget_internal(struct bus1_handle *h, bool erase_rb)
  */
 void bus1_handle_forget(struct bus1_handle *h)
 {
-	if (h)
-		bus1_handle_forget_internal(h, true);
-}
+	if (!h)
+		return;
 
-/**
- * bus1_handle_forget_keep() - forget handle but keep rb-tree order
- * @h:				handle to operate on, or NULL
- *
- * This is like bus1_handle_forget(), but does not modify the ID-namespace
- * rb-tree. That is, the backlink in @h is cleared (h->rb_to_peer), but the
- * rb-tree is not rebalanced. As such, you can use it with
- * rbtree_postorder_for_each_entry_safe() to drop all entries.
- */
-void bus1_handle_forget_keep(struct bus1_handle *h)
-{
-	if (h)
-		bus1_handle_forget_internal(h, false);
+	lockdep_assert_held(&h->holder->local.lock);
+
+	if (bus1_handle_is_public(h) || hlist_unhashed(&h->hash_to_peer))
+		return;
+
+	hlist_del_init(&h->hash_to_peer);
+	--h->holder->local.n_map_handles;
+	h->id = BUS1_HANDLE_INVALID;
+	bus1_handle_unref(h);
 }
@@ -64,10 +64,13 @@
 #include <linux/err.h>
 #include <linux/kernel.h>
 #include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/percpu_counter.h>
 #include <linux/rbtree.h>
 #include "util.h"
 #include "util/queue.h"
 
+struct bus1_flist;
 struct bus1_peer;
 struct bus1_tx;
 
@@ -94,7 +97,7 @@ enum bus1_handle_bits {
  * @holder:				holder of this handle
  * @anchor:				anchor handle
  * @tlink:				singly-linked list for free use
- * @rb_to_peer:				rb-link into peer by ID
+ * @hash_to_peer:			hash-link into peer by ID
  * @id:					current ID
  * @qnode:				queue node for notifications
  * @node.map_handles:			map of attached handles by peer
@@ -109,7 +112,7 @@ struct bus1_handle {
 	struct bus1_peer *holder;
 	struct bus1_handle *anchor;
 	struct bus1_handle *tlink;
-	struct rb_node rb_to_peer;
+	struct hlist_node hash_to_peer;
 	u64 id;
 	struct bus1_queue_node qnode;
 	union {
@@ -124,6 +127,18 @@ struct bus1_handle {
 	};
 };
 
+/* initial and maximum number of buckets of a handle map, as power of 2 */
+#define BUS1_HANDLE_MAP_SHIFT_MIN (4)
+#define BUS1_HANDLE_MAP_SHIFT_MAX (20)
+
+extern struct percpu_counter bus1_handle_count;
+
+int bus1_handle_modinit(void);
+void bus1_handle_modexit(void);
+
+int bus1_handle_map_init(struct bus1_peer *peer);
+void bus1_handle_map_deinit(struct bus1_peer *peer);
+
 struct bus1_handle *bus1_handle_new_anchor(struct bus1_peer *holder);
 struct bus1_handle *bus1_handle_new_remote(struct bus1_peer *holder,
 					   struct bus1_handle *other);
@@ -132,6 +147,10 @@ struct bus1_peer *bus1_handle_acquire_owner(struct bus1_handle *handle);
 
 struct bus1_handle *bus1_handle_ref_by_other(struct bus1_peer *peer,
 					     struct bus1_handle *handle);
+void bus1_handle_ref_by_other_n(struct bus1_peer *peer,
+				struct bus1_flist *src,
+				struct bus1_flist *dst,
+				size_t n);
 
 struct bus1_handle *bus1_handle_acquire_slow(struct bus1_handle *handle,
 					     bool strong);
@@ -148,7 +167,22 @@ struct bus1_handle *bus1_handle_import(struct bus1_peer *peer,
 u64 bus1_handle_identify(struct bus1_handle *h);
 void bus1_handle_export(struct bus1_handle *h);
 void bus1_handle_forget(struct bus1_handle *h);
-void bus1_handle_forget_keep(struct bus1_handle *h);
+
+/**
+ * bus1_handle_map_for_each_entry_safe() - iterate handle map of a peer
+ * @_h:				iterator
+ * @_safe:			temporary storage
+ * @_i:				bucket index
+ * @_peer:			peer to operate on
+ *
+ * This iterates all handles in the ID-namespace of @_peer. It is safe against
+ * removal of the current entry. The caller must hold the local peer lock.
+ */
+#define bus1_handle_map_for_each_entry_safe(_h, _safe, _i, _peer)	\
+	for ((_i) = 0; (_i) < (1U << (_peer)->local.map_shift); ++(_i))	\
+		hlist_for_each_entry_safe((_h), (_safe),		\
+					  &(_peer)->local.map_handles[(_i)], \
+					  hash_to_peer)
 
 /**
  * bus1_handle_is_anchor() - check whether handle is an anchor
@@ -14,15 +14,21 @@
 #include <linux/fs.h>
 #include <linux/init.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/poll.h>
 #include <linux/seq_file.h>
 #include <linux/uio.h>
 #include <uapi/linux/bus1.h>
+#include "handle.h"
 #include "main.h"
+#include "message.h"
 #include "peer.h"
 #include "tests.h"
+#define CREATE_TRACE_POINTS
+#include "trace.h"
 #include "user.h"
+#include "util.h"
 #include "util/active.h"
 #include "util/pool.h"
 #include "util/queue.h"
@@ -58,7 +64,15 @@ static unsigned int bus1_fop_poll(struct file *file,
 	if (bus1_active_is_deactivated(&peer->active)) {
 		mask = POLLHUP;
 	} else {
-		mask = POLLOUT | POLLWRNORM;
+		/*
+		 * Without opt-in, sends are always reported as possible. With
+		 * it, POLLOUT is cleared while a destination is out of room,
+		 * and bus1_peer_unblock_fn() wakes us once it is not anymore.
+		 */
+		mask = 0;
+		if (!(READ_ONCE(peer->flags) & BUS1_PEER_FLAG_POLLOUT) ||
+		    !READ_ONCE(peer->blocked_on))
+			mask |= POLLOUT | POLLWRNORM;
 		if (bus1_queue_is_readable_rcu(&peer->data.queue))
 			mask |= POLLIN | POLLRDNORM;
 	}
@@ -75,6 +89,10 @@ static int bus1_fop_mmap(struct file *file, struct vm_area_struct *vma)
 	if (!bus1_peer_acquire(peer))
 		return -ESHUTDOWN;
 
+	/* let khugepaged collapse the pool, if shmem huge-pages are advised */
+	if (READ_ONCE(peer->flags) & BUS1_PEER_FLAG_POOL_HUGEPAGE)
+		vma->vm_flags |= VM_HUGEPAGE;
+
 	r = bus1_pool_mmap(&peer->data.pool, vma);
 	bus1_peer_release(peer);
 	return r;
@@ -112,13 +130,31 @@ static int __init bus1_modinit(void)
 {
 	int r;
 
-	r = bus1_tests_run();
+	r = bus1_message_modinit();
 	if (r < 0)
 		return r;
 
+	r = bus1_handle_modinit();
+	if (r < 0)
+		goto error_message;
+
+	r = bus1_tests_run();
+	if (r < 0)
+		goto error_handle;
+
 	bus1_debugdir = debugfs_create_dir(KBUILD_MODNAME, NULL);
-	if (!bus1_debugdir)
+	if (!bus1_debugdir) {
 		pr_err("cannot create debugfs root\n");
+	} else if (!IS_ERR(bus1_debugdir)) {
+		bus1_debugfs_create_percpu_counter("n_messages", S_IRUGO,
+						   bus1_debugdir,
+						   &bus1_message_count);
+		bus1_debugfs_create_percpu_counter("n_handles", S_IRUGO,
+						   bus1_debugdir,
+						   &bus1_handle_count);
+		bus1_peer_debugfs_create_summary("peers", S_IRUGO,
+						 bus1_debugdir);
+	}
 
 	r = misc_register(&bus1_misc);
 	if (r < 0)
@@ -128,16 +164,22 @@ static int __init bus1_modinit(void)
 	return 0;
 
 error:
-	debugfs_remove(bus1_debugdir);
+	debugfs_remove_recursive(bus1_debugdir);
 	bus1_user_modexit();
+error_handle:
+	bus1_handle_modexit();
+error_message:
+	bus1_message_modexit();
 	return r;
 }
 
 static void __exit bus1_modexit(void)
 {
 	misc_deregister(&bus1_misc);
-	debugfs_remove(bus1_debugdir);
+	debugfs_remove_recursive(bus1_debugdir);
 	bus1_user_modexit();
+	bus1_handle_modexit();
+	bus1_message_modexit();
 	pr_info("unloaded\n");
 }
 
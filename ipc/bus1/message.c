@@ -13,16 +13,22 @@
 #include <linux/fs.h>
 #include <linux/kernel.h>
 #include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/percpu_counter.h>
+#include <linux/rcupdate.h>
 #include <linux/sched.h>
 #include <linux/security.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
 #include <linux/uio.h>
+#include <linux/vmalloc.h>
 #include <uapi/linux/bus1.h>
 #include "handle.h"
 #include "message.h"
 #include "peer.h"
 #include "security.h"
+#include "trace.h"
 #include "tx.h"
 #include "user.h"
 #include "util.h"
@@ -30,6 +36,64 @@
 #include "util/pool.h"
 #include "util/queue.h"
 
+static struct kmem_cache *bus1_message_cache;
+struct percpu_counter bus1_message_count;
+
+/**
+ * bus1_message_modinit() - initialize global resources of messages
+ *
+ * This allocates the slab cache used for messages with few handles and files,
+ * as well as the global message counter. It is meant to be called on
+ * module-init.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_message_modinit(void)
+{
+	int r;
+
+	r = percpu_counter_init(&bus1_message_count, 0, GFP_KERNEL);
+	if (r < 0)
+		return r;
+
+	bus1_message_cache = kmem_cache_create(KBUILD_MODNAME "-message",
+					       BUS1_MESSAGE_CACHE_SIZE,
+					       0, 0, NULL);
+	if (!bus1_message_cache) {
+		percpu_counter_destroy(&bus1_message_count);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/**
+ * bus1_message_modexit() - clean up global resources of messages
+ *
+ * This waits for all rcu-delayed message releases to finish, then destroys
+ * the message cache. The caller must make sure no message is referenced
+ * anymore. This is meant to be called on module-exit.
+ */
+void bus1_message_modexit(void)
+{
+	rcu_barrier();
+	kmem_cache_destroy(bus1_message_cache);
+	bus1_message_cache = NULL;
+	WARN_ON(percpu_counter_sum(&bus1_message_count) != 0);
+	percpu_counter_destroy(&bus1_message_count);
+}
+
+static void bus1_message_free_rcu(struct rcu_head *rcu)
+{
+	struct bus1_message *m = container_of(rcu, struct bus1_message,
+					      qnode.rcu);
+
+	if (m->cached)
+		kmem_cache_free(bus1_message_cache, m);
+	else
+		kfree(m);
+}
+
 static size_t bus1_factory_size(struct bus1_cmd_send *param)
 {
 	/* make sure @size cannot overflow */
@@ -46,10 +110,78 @@ static size_t bus1_factory_size(struct bus1_cmd_send *param)
 	       param->n_fds * sizeof(struct file *);
 }
 
+/**
+ * bus1_factory_stage() - stage payload of a factory
+ * @f:				factory to operate on
+ *
+ * Multicasts copy the same payload into every destination pool. Rather than
+ * reading user memory once per destination, this copies the payload into a
+ * kernel buffer once, and bus1_factory_fill() fills each pool from there. This
+ * also guarantees all destinations see the same data, even if user-space
+ * modifies the buffer concurrently.
+ *
+ * This is purely an optimization. If the payload is huge, or if the staging
+ * buffer cannot be allocated, the payload is copied once per destination. This
+ * does not require the local peer lock.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_factory_stage(struct bus1_factory *f)
+{
+	struct iov_iter iter;
+
+	if (f->staging || f->param->n_destinations < 2 || f->length_vecs < 1 ||
+	    f->length_vecs > BUS1_FACTORY_STAGING_MAX)
+		return 0;
+
+	f->staging = kmalloc(f->length_vecs, GFP_TEMPORARY | __GFP_NOWARN);
+	if (!f->staging) {
+		f->staging = vmalloc(f->length_vecs);
+		if (!f->staging)
+			return 0;
+	}
+
+	iov_iter_init(&iter, WRITE, f->vecs, f->n_vecs, f->length_vecs);
+	if (copy_from_iter(f->staging, f->length_vecs, &iter) !=
+							f->length_vecs)
+		return -EFAULT;
+
+	return 0;
+}
+
+static struct file *
+bus1_factory_import_slice_fd(struct bus1_peer *peer,
+			     const struct bus1_slice_fd *slice_fd)
+{
+	struct bus1_pool_slice *slice;
+	struct bus1_message *m;
+	struct file *file = NULL;
+
+	/*
+	 * Published slices are only released under the local lock, which we
+	 * hold. Hence, the message stays pinned after we dropped the data
+	 * lock. The files were already checked by bus1_import_fd() when they
+	 * were first sent, so they can be forwarded as they are.
+	 */
+	mutex_lock(&peer->data.lock);
+	slice = bus1_pool_slice_find_published(&peer->data.pool,
+					       slice_fd->offset);
+	mutex_unlock(&peer->data.lock);
+	if (!slice)
+		return ERR_PTR(-ENXIO);
+
+	m = container_of(slice, struct bus1_message, slice);
+	if (m->pin_files && slice_fd->index < m->n_files)
+		file = get_file(m->files[slice_fd->index]);
+
+	return file ?: ERR_PTR(-EBADF);
+}
+
 /**
  * bus1_factory_new() - create new message factory
  * @peer:			peer to operate as
  * @param:			factory parameters
+ * @vecs:			pre-imported vectors, or NULL
  * @stack:			optional stack for factory, or NULL
  * @n_stack:			size of space at @stack
  *
@@ -57,6 +189,10 @@ static size_t bus1_factory_size(struct bus1_cmd_send *param)
  * prepares the factory for a transaction. From this factory, messages can be
  * instantiated. This is used both for unicasts and multicasts.
  *
+ * If @vecs is given, it must contain @param->n_vecs vectors that were already
+ * imported and validated via bus1_import_vecs(). They are used instead of the
+ * vectors at @param->ptr_vecs.
+ *
  * If @stack is given, this tries to place the factory on the specified stack
  * space. The caller must guarantee that the factory does not outlive the stack
  * frame. If this is not wanted, pass 0 as @n_stack.
@@ -67,11 +203,14 @@ static size_t bus1_factory_size(struct bus1_cmd_send *param)
  */
 struct bus1_factory *bus1_factory_new(struct bus1_peer *peer,
 				      struct bus1_cmd_send *param,
+				      const struct iovec *vecs,
 				      void *stack,
 				      size_t n_stack)
 {
 	const struct iovec __user *ptr_vecs;
+	const struct bus1_slice_fd __user *ptr_slice_fds;
 	const u64 __user *ptr_handles;
+	struct bus1_slice_fd slice_fd;
 	const int __user *ptr_fds;
 	struct bus1_factory *f;
 	struct bus1_flist *e;
@@ -99,20 +238,31 @@ struct bus1_factory *bus1_factory_new(struct bus1_peer *peer,
 	f->peer = peer;
 	f->param = param;
 
+	f->has_new = false;
 	f->length_vecs = 0;
 	f->n_vecs = param->n_vecs;
 	f->n_handles = 0;
-	f->n_handles_charge = 0;
 	f->n_files = 0;
+	f->staging = NULL;
+	f->blocked = NULL;
+	f->blocked_seq = 0;
 	f->vecs = (void *)(f + 1) + bus1_flist_inline_size(param->n_handles);
 	f->files = (void *)(f->vecs + param->n_vecs);
 	bus1_flist_init(f->handles, f->param->n_handles);
 
 	/* import vecs */
-	ptr_vecs = (const struct iovec __user *)(unsigned long)param->ptr_vecs;
-	r = bus1_import_vecs(f->vecs, &f->length_vecs, ptr_vecs, f->n_vecs);
-	if (r < 0)
-		goto error;
+	if (vecs) {
+		memcpy(f->vecs, vecs, f->n_vecs * sizeof(*vecs));
+		for (i = 0; i < f->n_vecs; ++i)
+			f->length_vecs += vecs[i].iov_len;
+	} else {
+		ptr_vecs = (const struct iovec __user *)
+						(unsigned long)param->ptr_vecs;
+		r = bus1_import_vecs(f->vecs, &f->length_vecs, ptr_vecs,
+				     f->n_vecs);
+		if (r < 0)
+			goto error;
+	}
 
 	/* import handles */
 	r = bus1_flist_populate(f->handles, f->param->n_handles, GFP_TEMPORARY);
@@ -134,20 +284,32 @@ struct bus1_factory *bus1_factory_new(struct bus1_peer *peer,
 			goto error;
 		}
 
+		f->has_new |= is_new;
 		++f->n_handles;
-		if (is_new)
-			++f->n_handles_charge;
 	}
 
 	/* import files */
 	ptr_fds = (const int __user *)(unsigned long)param->ptr_fds;
+	ptr_slice_fds = (const struct bus1_slice_fd __user *)
+					(unsigned long)param->ptr_fds;
 	while (f->n_files < param->n_fds) {
-		if (get_user(fd, ptr_fds + f->n_files)) {
-			r = -EFAULT;
-			goto error;
-		}
+		if (param->flags & BUS1_SEND_FLAG_SLICE_FDS) {
+			if (copy_from_user(&slice_fd,
+					   ptr_slice_fds + f->n_files,
+					   sizeof(slice_fd))) {
+				r = -EFAULT;
+				goto error;
+			}
+
+			file = bus1_factory_import_slice_fd(peer, &slice_fd);
+		} else {
+			if (get_user(fd, ptr_fds + f->n_files)) {
+				r = -EFAULT;
+				goto error;
+			}
 
-		file = bus1_import_fd(fd);
+			file = bus1_import_fd(fd);
+		}
 		if (IS_ERR(file)) {
 			r = PTR_ERR(file);
 			goto error;
@@ -156,6 +318,7 @@ struct bus1_factory *bus1_factory_new(struct bus1_peer *peer,
 		f->files[f->n_files++] = file;
 	}
 
+	trace_bus1_factory_new(f);
 	return f;
 
 error:
@@ -196,6 +359,9 @@ struct bus1_factory *bus1_factory_free(struct bus1_factory *f)
 		/* ...but free total space (f->param->n_handles). */
 		bus1_flist_deinit(f->handles, f->param->n_handles);
 
+		kvfree(f->staging);
+		bus1_peer_release(f->blocked);
+
 		if (!f->on_stack)
 			kfree(f);
 	}
@@ -203,46 +369,117 @@ struct bus1_factory *bus1_factory_free(struct bus1_factory *f)
 	return NULL;
 }
 
+static bool bus1_factory_seal_charge(struct bus1_handle *h,
+				     size_t *n_charge)
+{
+	/*
+	 * A handle that is not public yet gets its first user reference on
+	 * seal. The same handle might be listed several times, so we mark it
+	 * via its tlink to charge it only once. The local lock is only dropped
+	 * if all handles were public. Hence, if one is neither public nor
+	 * hashed anymore, it was released meanwhile, and the send lost the
+	 * race against that release.
+	 */
+	if (bus1_handle_is_public(h) || h->tlink)
+		return true;
+	if (hlist_unhashed(&h->hash_to_peer))
+		return false;
+
+	h->tlink = BUS1_TAIL;
+	++*n_charge;
+	return true;
+}
+
+static void bus1_factory_seal_pin(struct bus1_handle *h)
+{
+	h->tlink = NULL;
+	if (!bus1_handle_is_public(h)) {
+		WARN_ON(h != bus1_handle_acquire(h, false));
+		WARN_ON(atomic_inc_return(&h->n_user) != 1);
+	}
+}
+
 /**
  * bus1_factory_seal() - charge and commit local resources
  * @f:				factory to use
+ * @mlist:			list of messages instantiated from @f
  *
  * The factory needs to pin and possibly create local peer resources. This
- * commits those resources. You should call this after you instantiated all
- * messages, since you cannot undo it easily.
+ * commits those resources, for both the transferred handles and the
+ * destination handles of all messages on @mlist (linked via qnode.next). You
+ * should call this after you filled all messages, since you cannot undo it
+ * easily.
+ *
+ * The local peer lock might have been dropped since the handles were imported,
+ * if all of them were public at that time. Hence, the charge is calculated
+ * here, rather than on import.
  *
  * Return: 0 on success, negative error code on failure.
  */
-int bus1_factory_seal(struct bus1_factory *f)
+int bus1_factory_seal(struct bus1_factory *f, struct bus1_queue_node *mlist)
 {
-	struct bus1_handle *h;
+	struct bus1_queue_node *qnode;
+	struct bus1_message *m;
 	struct bus1_flist *e;
-	size_t i;
+	size_t i, n_charge = 0;
+	bool valid = true;
 	int r;
 
 	lockdep_assert_held(&f->peer->local.lock);
 
-	r = bus1_user_charge(&f->peer->user->limits.n_handles,
-			     &f->peer->data.limits.n_handles,
-			     f->n_handles_charge);
-	if (r < 0)
+	for (i = 0, e = f->handles;
+	     i < f->n_handles && valid;
+	     e = bus1_flist_next(e, &i))
+		valid = bus1_factory_seal_charge(e->ptr, &n_charge);
+	for (qnode = mlist; qnode && valid; qnode = qnode->next) {
+		m = container_of(qnode, struct bus1_message, qnode);
+		valid = bus1_factory_seal_charge(m->dst, &n_charge);
+	}
+
+	if (!valid)
+		r = -ENXIO;
+	else
+		r = bus1_user_charge(&f->peer->user->limits.n_handles,
+				     &f->peer->data.limits.n_handles,
+				     n_charge);
+
+	if (r < 0) {
+		for (i = 0, e = f->handles;
+		     i < f->n_handles;
+		     e = bus1_flist_next(e, &i))
+			((struct bus1_handle *)e->ptr)->tlink = NULL;
+		for (qnode = mlist; qnode; qnode = qnode->next) {
+			m = container_of(qnode, struct bus1_message, qnode);
+			m->dst->tlink = NULL;
+		}
+		trace_bus1_factory_seal(f, r);
 		return r;
+	}
 
 	for (i = 0, e = f->handles;
 	     i < f->n_handles;
-	     e = bus1_flist_next(e, &i)) {
-		h = e->ptr;
-		if (bus1_handle_is_public(h))
-			continue;
-
-		--f->n_handles_charge;
-		WARN_ON(h != bus1_handle_acquire(h, false));
-		WARN_ON(atomic_inc_return(&h->n_user) != 1);
+	     e = bus1_flist_next(e, &i))
+		bus1_factory_seal_pin(e->ptr);
+	for (qnode = mlist; qnode; qnode = qnode->next) {
+		m = container_of(qnode, struct bus1_message, qnode);
+		bus1_factory_seal_pin(m->dst);
 	}
 
+	trace_bus1_factory_seal(f, 0);
 	return 0;
 }
 
+static void bus1_factory_block(struct bus1_factory *f,
+			       struct bus1_peer *peer,
+			       unsigned int seq)
+{
+	/* the first failure aborts the send, so only one is ever recorded */
+	if (!f->blocked) {
+		f->blocked = bus1_peer_acquire(peer);
+		f->blocked_seq = seq;
+	}
+}
+
 /**
  * bus1_factory_instantiate() - instantiate a message from a factory
  * @f:				factory to use
@@ -250,55 +487,95 @@ int bus1_factory_seal(struct bus1_factory *f)
  * @peer:			destination peer
  *
  * This instantiates a new message targeted at @handle, based on the plans in
- * the message factory @f.
+ * the message factory @f. Only the message itself is allocated and charged
+ * here. Its content is filled in via bus1_factory_fill() afterwards.
+ *
+ * If @peer asked for it, tiny messages without handles and files are inlined.
+ * That is, the payload is stored in the message object, so no pool slice is
+ * needed. The message is still charged a slice, as that limits the number of
+ * queued messages.
  *
  * The newly created message is not linked into any contexts, but is available
  * for free use to the caller.
  *
+ * If @peer is out of quota, it is recorded as blocked destination in @f, so the
+ * caller can wait for it to release resources.
+ *
  * Return: Pointer to new message, or ERR_PTR on failure.
  */
 struct bus1_message *bus1_factory_instantiate(struct bus1_factory *f,
 					      struct bus1_handle *handle,
 					      struct bus1_peer *peer)
 {
-	struct bus1_flist *src_e, *dst_e;
 	struct bus1_message *m;
-	size_t size, i, j;
+	unsigned int seq;
+	bool inlined, is_local;
+	size_t size;
 	int r;
 
 	lockdep_assert_held(&f->peer->local.lock);
 
-	r = bus1_user_charge(&peer->user->limits.n_slices,
-			     &peer->data.limits.n_slices, 1);
-	if (r < 0)
-		return ERR_PTR(r);
-
-	r = bus1_user_charge(&peer->user->limits.n_handles,
-			     &peer->data.limits.n_handles, f->n_handles);
+	/* inlined messages must always be served from the cache */
+	BUILD_BUG_ON(sizeof(*m) + BUS1_MSG_INLINE_MAX > BUS1_MESSAGE_CACHE_SIZE);
+
+	inlined = f->n_handles == 0 && f->n_files == 0 &&
+		  f->length_vecs <= BUS1_MSG_INLINE_MAX &&
+		  (READ_ONCE(peer->flags) & BUS1_PEER_FLAG_RECV_INLINE);
+
+	/*
+	 * Sample the release counter before charging, see bus1_peer_block().
+	 * Only the per-peer limits are released by @peer, and thus bump its
+	 * counter. If the user-wide limits are exhausted, other peers of the
+	 * user must release resources, and nothing on @peer is worth waiting
+	 * for.
+	 */
+	seq = atomic_read_acquire(&peer->room_seq);
+	r = bus1_user_charge_limits(&peer->user->limits, &peer->data.limits,
+				    1, f->n_handles, &is_local);
 	if (r < 0) {
-		bus1_user_discharge(&peer->user->limits.n_slices,
-				    &peer->data.limits.n_slices, 1);
-		return ERR_PTR(r);
+		if (r == -EDQUOT && is_local)
+			bus1_factory_block(f, peer, seq);
+		goto error;
 	}
 
-	size = sizeof(*m) + bus1_flist_inline_size(f->n_handles) +
-	       f->n_files * sizeof(struct file *);
-	m = kmalloc(size, GFP_KERNEL);
+	/*
+	 * Most messages carry no, or only a few, handles and files. Those are
+	 * served from a dedicated cache of fixed-size objects. Only larger
+	 * messages fall back to kmalloc().
+	 */
+	if (inlined)
+		size = sizeof(*m) + f->length_vecs;
+	else
+		size = sizeof(*m) + bus1_flist_inline_size(f->n_handles) +
+		       f->n_files * sizeof(struct file *);
+	if (likely(size <= BUS1_MESSAGE_CACHE_SIZE)) {
+		m = kmem_cache_alloc(bus1_message_cache, GFP_KERNEL);
+		if (m)
+			m->cached = true;
+	} else {
+		m = kmalloc(size, GFP_KERNEL);
+		if (m)
+			m->cached = false;
+	}
 	if (!m) {
 		bus1_user_discharge(&peer->user->limits.n_handles,
 				    &peer->data.limits.n_handles, f->n_handles);
 		bus1_user_discharge(&peer->user->limits.n_slices,
 				    &peer->data.limits.n_slices, 1);
-		return ERR_PTR(-ENOMEM);
+		r = -ENOMEM;
+		goto error;
 	}
 
 	/* set to default first, so the destructor can be called anytime */
+	percpu_counter_inc(&bus1_message_count);
 	kref_init(&m->ref);
 	bus1_queue_node_init(&m->qnode, BUS1_MSG_DATA);
 	m->qnode.owner = peer;
 	m->dst = bus1_handle_ref(handle);
 	m->user = bus1_user_ref(f->peer->user);
 
+	m->pin_files = false;
+	m->inlined = inlined;
 	m->flags = 0;
 
 	m->n_bytes = f->length_vecs;
@@ -309,27 +586,96 @@ struct bus1_message *bus1_factory_instantiate(struct bus1_factory *f,
 	m->files = (void *)(m + 1) + bus1_flist_inline_size(f->n_handles);
 	bus1_flist_init(m->handles, f->n_handles);
 
+	trace_bus1_factory_instantiate(f, peer, 0);
+	return m;
+
+error:
+	trace_bus1_factory_instantiate(f, peer, r);
+	return ERR_PTR(r);
+}
+
+/**
+ * bus1_factory_fill() - fill a message instantiated from a factory
+ * @f:				factory to use
+ * @m:				message to fill
+ *
+ * This allocates the pool slice of @m in its destination, copies the payload
+ * from @f, and imports all handles and files into the destination. This does
+ * not require the local peer lock, as everything is pinned by @f and @m.
+ * Inlined messages get their payload copied into the message object instead.
+ * A destination without pool space left is recorded as blocked destination in
+ * @f, just like in bus1_factory_instantiate().
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_factory_fill(struct bus1_factory *f, struct bus1_message *m)
+{
+	struct bus1_peer *peer = m->qnode.owner;
+	struct bus1_flist *src_e, *dst_e;
+	struct iov_iter iter;
+	struct kvec vec;
+	size_t size, i, j;
+	unsigned int seq;
+	bool blocked;
+	int r;
+
+	if (m->inlined) {
+		if (f->staging) {
+			memcpy(bus1_message_inline_data(m), f->staging,
+			       f->length_vecs);
+		} else {
+			iov_iter_init(&iter, WRITE, f->vecs, f->n_vecs,
+				      f->length_vecs);
+			if (copy_from_iter(bus1_message_inline_data(m),
+					   f->length_vecs, &iter) !=
+							f->length_vecs)
+				return -EFAULT;
+		}
+		return 0;
+	}
+
 	/* allocate pool slice */
 	size = max_t(size_t, 8,
 			     ALIGN(m->n_bytes, 8) +
 			     ALIGN(f->n_handles * sizeof(u64), 8) +
 			     ALIGN(f->n_files * sizeof(int), 8));
 	mutex_lock(&peer->data.lock);
+	seq = atomic_read(&peer->room_seq);
 	r = bus1_pool_alloc(&peer->data.pool, &m->slice, size);
+	/* slices larger than the entire pool will never fit */
+	blocked = r == -EXFULL && size <= peer->data.pool.size;
 	mutex_unlock(&peer->data.lock);
-	if (r < 0)
-		goto error;
+	trace_bus1_pool_alloc(peer, &m->slice, size, r);
+	if (r < 0) {
+		if (blocked)
+			bus1_factory_block(f, peer, seq);
+		return r;
+	}
 
 	/* import blob */
-	r = bus1_pool_write_iovec(&peer->data.pool, &m->slice, 0, f->vecs,
-				  f->n_vecs, f->length_vecs);
+	if (f->staging) {
+		vec.iov_base = f->staging;
+		vec.iov_len = f->length_vecs;
+		r = bus1_pool_write_kvec(&peer->data.pool, &m->slice, 0, &vec,
+					 1, vec.iov_len);
+	} else {
+		r = bus1_pool_write_iovec(&peer->data.pool, &m->slice, 0,
+					  f->vecs, f->n_vecs, f->length_vecs);
+	}
 	if (r < 0)
-		goto error;
+		return r;
 
 	/* import handles */
 	r = bus1_flist_populate(m->handles, f->n_handles, GFP_KERNEL);
 	if (r < 0)
-		goto error;
+		return r;
+
+	/*
+	 * Look up existing handles of the destination in bulk first, so the
+	 * node owners are locked once per destination, not once per handle.
+	 * Only handles the destination does not hold yet are allocated.
+	 */
+	bus1_handle_ref_by_other_n(peer, f->handles, m->handles, f->n_handles);
 
 	r = 0;
 	m->n_handles = f->n_handles;
@@ -340,7 +686,6 @@ struct bus1_message *bus1_factory_instantiate(struct bus1_factory *f,
 	while (i < f->n_handles) {
 		WARN_ON(i != j);
 
-		dst_e->ptr = bus1_handle_ref_by_other(peer, src_e->ptr);
 		if (!dst_e->ptr) {
 			dst_e->ptr = bus1_handle_new_remote(peer, src_e->ptr);
 			if (IS_ERR(dst_e->ptr) && r >= 0) {
@@ -358,31 +703,89 @@ struct bus1_message *bus1_factory_instantiate(struct bus1_factory *f,
 		dst_e = bus1_flist_next(dst_e, &j);
 	}
 	if (r < 0)
-		goto error;
+		return r;
 
 	/* import files */
 	while (m->n_files < f->n_files) {
 		r = security_bus1_transfer_file(f->peer, peer,
 						f->files[m->n_files]);
 		if (r < 0)
-			goto error;
+			return r;
+
+		/* each file stays charged until bus1_message_deinit() drops it */
+		r = bus1_user_charge(&peer->user->limits.n_inflight_fds,
+				     &peer->data.limits.n_inflight_fds, 1);
+		if (r < 0)
+			return r;
 
 		m->files[m->n_files] = get_file(f->files[m->n_files]);
 		++m->n_files;
 	}
 
-	return m;
+	return 0;
 
-error:
-	bus1_message_unref(m);
-	return ERR_PTR(r);
+}
+
+/**
+ * bus1_message_new_notification() - allocate a coalesced node notification
+ * @peer:			receiving peer
+ *
+ * This allocates a message that carries the IDs of several node notifications
+ * of @peer as payload, rather than handles or files. It is only created when
+ * the notifications are dequeued, and is never queued itself. Still, it is a
+ * regular data message, so it is released via its slice like any other, and
+ * it is charged a slice on @peer. The pool slice is allocated and filled by
+ * the caller, which also reports the type of the coalesced notifications.
+ *
+ * Return: Pointer to new message, or ERR_PTR on failure.
+ */
+struct bus1_message *bus1_message_new_notification(struct bus1_peer *peer)
+{
+	struct bus1_message *m;
+	int r;
+
+	r = bus1_user_charge_limits(&peer->user->limits, &peer->data.limits,
+				    1, 0, NULL);
+	if (r < 0)
+		return ERR_PTR(r);
+
+	m = kmem_cache_alloc(bus1_message_cache, GFP_KERNEL);
+	if (!m) {
+		bus1_user_discharge(&peer->user->limits.n_slices,
+				    &peer->data.limits.n_slices, 1);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	percpu_counter_inc(&bus1_message_count);
+	kref_init(&m->ref);
+	bus1_queue_node_init(&m->qnode, BUS1_MSG_DATA);
+	m->qnode.owner = peer;
+	m->dst = NULL;
+	m->user = bus1_user_ref(peer->user);
+
+	m->cached = true;
+	m->pin_files = false;
+	m->inlined = false;
+	m->flags = BUS1_MSG_FLAG_COALESCED;
+
+	m->n_bytes = 0;
+	m->n_handles = 0;
+	m->n_handles_charge = 0;
+	m->n_files = 0;
+	bus1_pool_slice_init(&m->slice);
+	m->files = NULL;
+	bus1_flist_init(m->handles, 0);
+
+	return m;
 }
 
 /**
  * bus1_message_deinit() - release file descriptors and handles of message
  * @m:		message to operate on
  *
- * This frees the fds and handles pinned by the message @m.
+ * This frees the fds and handles pinned by the message @m. If @m->pin_files is
+ * set, the files are left untouched, and only released once the message is
+ * freed. They stay charged against the inflight-fd limits until then.
  */
 void bus1_message_deinit(struct bus1_message *m)
 {
@@ -393,9 +796,14 @@ void bus1_message_deinit(struct bus1_message *m)
 	WARN_ON(!peer);
 	lockdep_assert_held(&peer->active);
 
-	for (i = 0; i < m->n_files; ++i)
-		fput(m->files[i]);
-	m->n_files = 0;
+	if (!m->pin_files) {
+		for (i = 0; i < m->n_files; ++i)
+			fput(m->files[i]);
+		bus1_user_discharge(&peer->user->limits.n_inflight_fds,
+				    &peer->data.limits.n_inflight_fds,
+				    m->n_files);
+		m->n_files = 0;
+	}
 
 	for (i = 0, e = m->handles;
 	     i < m->n_handles;
@@ -427,18 +835,28 @@ void bus1_message_free(struct kref *k)
 {
 	struct bus1_message *m = container_of(k, struct bus1_message, ref);
 	struct bus1_peer *peer = m->qnode.owner;
+	size_t size;
+	int r;
 
+	m->pin_files = false;
 	bus1_message_deinit(m);
 
-	mutex_lock(&peer->data.lock);
-	bus1_pool_dealloc(&peer->data.pool, &m->slice);
-	mutex_unlock(&peer->data.lock);
+	/* inlined messages never allocate a slice, skip the data lock */
+	if (!m->inlined) {
+		size = m->slice.size;
+		mutex_lock(&peer->data.lock);
+		r = bus1_pool_dealloc(&peer->data.pool, &m->slice);
+		mutex_unlock(&peer->data.lock);
+		trace_bus1_pool_dealloc(peer, &m->slice, size, r);
+	}
 	bus1_user_discharge(&peer->user->limits.n_slices,
 			    &peer->data.limits.n_slices, 1);
+	bus1_peer_wake_room(peer);
 
 	bus1_user_unref(m->user);
 
-	kfree_rcu(m, qnode.rcu);
+	percpu_counter_dec(&bus1_message_count);
+	call_rcu(&m->qnode.rcu, bus1_message_free_rcu);
 }
 
 /**
@@ -468,8 +886,11 @@ void bus1_message_stage(struct bus1_message *m, struct bus1_tx *tx)
 	     e = bus1_flist_next(e, &i))
 		e->ptr = bus1_handle_acquire(e->ptr, true);
 
-	/* this consumes an active reference on m->qnode.owner */
-	bus1_tx_stage_sync(tx, &m->qnode);
+	/*
+	 * The destination is not locked here, so postpone staging to the
+	 * commit. This consumes an active reference on m->qnode.owner.
+	 */
+	bus1_tx_stage_later(tx, &m->qnode);
 }
 
 /**
@@ -597,3 +1018,60 @@ exit:
 		kfree(buffer);
 	return r;
 }
+
+/**
+ * bus1_message_install_files() - install selected files of a message
+ * @m:				message to operate on
+ * @indices:			indices of the files to install
+ * @n_indices:			number of entries in @indices
+ * @ptr_fds:			user-space array to store the FD numbers in
+ *
+ * This installs the files of @m selected by @indices into the calling process,
+ * and copies the new FD numbers into @ptr_fds. This is only possible while
+ * the files of @m are pinned, see BUS1_RECV_FLAG_KEEP_FDS. Either all files are
+ * installed, or none.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_message_install_files(struct bus1_message *m,
+			       const u64 *indices,
+			       size_t n_indices,
+			       int __user *ptr_fds)
+{
+	size_t i, n_fds = 0;
+	int r, *fds;
+
+	for (i = 0; i < n_indices; ++i)
+		if (!m->pin_files || indices[i] >= m->n_files)
+			return -EBADF;
+
+	fds = kmalloc_array(n_indices, sizeof(*fds), GFP_TEMPORARY);
+	if (!fds)
+		return -ENOMEM;
+
+	for ( ; n_fds < n_indices; ++n_fds) {
+		r = get_unused_fd_flags(O_CLOEXEC);
+		if (r < 0)
+			goto exit;
+
+		fds[n_fds] = r;
+	}
+
+	if (copy_to_user(ptr_fds, fds, n_fds * sizeof(*fds))) {
+		r = -EFAULT;
+		goto exit;
+	}
+
+	while (n_fds > 0) {
+		--n_fds;
+		fd_install(fds[n_fds], get_file(m->files[indices[n_fds]]));
+	}
+
+	r = 0;
+
+exit:
+	while (n_fds-- > 0)
+		put_unused_fd(fds[n_fds]);
+	kfree(fds);
+	return r;
+}
@@ -18,6 +18,7 @@
 
 #include <linux/kernel.h>
 #include <linux/kref.h>
+#include <linux/percpu_counter.h>
 #include "util/flist.h"
 #include "util/pool.h"
 #include "util/queue.h"
@@ -30,16 +31,22 @@ struct bus1_user;
 struct file;
 struct iovec;
 
+/* maximum payload size that is staged in kernel memory for multicasts */
+#define BUS1_FACTORY_STAGING_MAX (4UL * 1024UL * 1024UL)
+
 /**
  * struct bus1_factory - message factory
  * @peer:			sending peer
  * @param:			factory parameters
  * @on_stack:			whether object lives on stack
+ * @has_new:			whether a handle was created on import
  * @length_vecs:		total length of data in vectors
  * @n_vecs:			number of vectors
  * @n_handles:			number of handles
- * @n_handles_charge:		number of handles to charge on commit
  * @n_files:			number of files
+ * @staging:			kernel copy of the payload, or NULL
+ * @blocked:			destination that ran out of resources, or NULL
+ * @blocked_seq:		room sequence of @blocked before the failed charge
  * @vecs:			vector array
  * @files:			file array
  * @handles:			handle array
@@ -49,12 +56,15 @@ struct bus1_factory {
 	struct bus1_cmd_send *param;
 
 	bool on_stack : 1;
+	bool has_new : 1;
 
 	size_t length_vecs;
 	size_t n_vecs;
 	size_t n_handles;
-	size_t n_handles_charge;
 	size_t n_files;
+	void *staging;
+	struct bus1_peer *blocked;
+	unsigned int blocked_seq;
 	struct iovec *vecs;
 	struct file **files;
 
@@ -67,6 +77,9 @@ struct bus1_factory {
  * @qnode:			embedded queue node
  * @dst:			destination handle
  * @user:			sending user
+ * @cached:			whether object was allocated from the cache
+ * @pin_files:			whether files outlive the dequeue
+ * @inlined:			whether the payload is stored in the message
  * @flags:			message flags
  * @n_bytes:			number of user-bytes transmitted
  * @n_handles:			number of handles transmitted
@@ -82,6 +95,10 @@ struct bus1_message {
 	struct bus1_handle *dst;
 	struct bus1_user *user;
 
+	bool cached : 1;
+	bool pin_files : 1;
+	bool inlined : 1;
+
 	u64 flags;
 
 	size_t n_bytes;
@@ -94,20 +111,59 @@ struct bus1_message {
 	struct bus1_flist handles[];
 };
 
+/*
+ * Messages with up to BUS1_MESSAGE_CACHE_N handles and files are allocated from
+ * a dedicated slab cache. Everything else uses kmalloc().
+ */
+#define BUS1_MESSAGE_CACHE_N (4)
+#define BUS1_MESSAGE_CACHE_SIZE (sizeof(struct bus1_message) +		\
+				 BUS1_MESSAGE_CACHE_N *			\
+				 (sizeof(struct bus1_flist) +		\
+				  sizeof(struct file *)))
+
+extern struct percpu_counter bus1_message_count;
+
+/**
+ * bus1_message_inline_data() - access inlined payload of a message
+ * @m:			message to operate on
+ *
+ * Messages with @m->inlined set carry neither handles nor files, and their
+ * payload is stored directly behind the message object, rather than in a pool
+ * slice. See BUS1_PEER_FLAG_RECV_INLINE.
+ *
+ * Return: Pointer to the @m->n_bytes bytes of payload.
+ */
+static inline void *bus1_message_inline_data(struct bus1_message *m)
+{
+	WARN_ON(!m->inlined);
+	return m + 1;
+}
+
+int bus1_message_modinit(void);
+void bus1_message_modexit(void);
+
 struct bus1_factory *bus1_factory_new(struct bus1_peer *peer,
 				      struct bus1_cmd_send *param,
+				      const struct iovec *vecs,
 				      void *stack,
 				      size_t n_stack);
 struct bus1_factory *bus1_factory_free(struct bus1_factory *f);
-int bus1_factory_seal(struct bus1_factory *f);
+int bus1_factory_stage(struct bus1_factory *f);
+int bus1_factory_seal(struct bus1_factory *f, struct bus1_queue_node *mlist);
 struct bus1_message *bus1_factory_instantiate(struct bus1_factory *f,
 					      struct bus1_handle *handle,
 					      struct bus1_peer *peer);
+int bus1_factory_fill(struct bus1_factory *f, struct bus1_message *m);
 
+struct bus1_message *bus1_message_new_notification(struct bus1_peer *peer);
 void bus1_message_deinit(struct bus1_message *m);
 void bus1_message_free(struct kref *k);
 void bus1_message_stage(struct bus1_message *m, struct bus1_tx *tx);
 int bus1_message_install(struct bus1_message *m, bool inst_fds);
+int bus1_message_install_files(struct bus1_message *m,
+			       const u64 *indices,
+			       size_t n_indices,
+			       int __user *ptr_fds);
 
 /**
  * bus1_message_ref() - acquire object reference
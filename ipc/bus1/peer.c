@@ -14,19 +14,34 @@
 #include <linux/err.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/hrtimer.h>
+#include <linux/idr.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/mutex.h>
+#include <linux/nodemask.h>
+#include <linux/poll.h>
 #include <linux/rbtree.h>
 #include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/string.h>
 #include <linux/uaccess.h>
 #include <linux/uio.h>
+#include <linux/vmalloc.h>
 #include <linux/wait.h>
 #include <uapi/linux/bus1.h>
 #include "handle.h"
 #include "main.h"
 #include "message.h"
 #include "peer.h"
+#include "trace.h"
 #include "tx.h"
 #include "user.h"
 #include "util.h"
@@ -69,6 +84,371 @@ bus1_peer_free_qnode(struct bus1_queue_node *qnode)
 	return NULL;
 }
 
+/**
+ * struct bus1_peer_set - registered destination set
+ * @n_handles:			number of destinations
+ * @n_vecs:			number of payload vectors, 0 if none registered
+ * @vecs:			imported payload vectors
+ * @handles:			pinned destination handles
+ *
+ * A destination set is registered by a peer via BUS1_CMD_SET_REGISTER and is
+ * only ever accessed under its local lock. It pins the destination handles,
+ * so sends to the set neither copy nor resolve destination IDs. If payload
+ * vectors were registered as well, they are validated once and then used for
+ * every send to the set.
+ */
+struct bus1_peer_set {
+	size_t n_handles;
+	size_t n_vecs;
+	struct iovec *vecs;
+	struct bus1_handle *handles[];
+};
+
+static struct bus1_peer_set *bus1_peer_set_new(size_t n_handles, size_t n_vecs)
+{
+	struct bus1_peer_set *set;
+	size_t size;
+
+	size = sizeof(*set) + n_handles * sizeof(*set->handles) +
+	       n_vecs * sizeof(*set->vecs);
+
+	set = kmalloc(size, GFP_KERNEL | __GFP_NOWARN);
+	if (!set)
+		set = vmalloc(size);
+	if (!set)
+		return ERR_PTR(-ENOMEM);
+
+	set->n_handles = 0;
+	set->n_vecs = n_vecs;
+	set->vecs = (void *)(set->handles + n_handles);
+
+	return set;
+}
+
+static struct bus1_peer_set *bus1_peer_set_free(struct bus1_peer_set *set)
+{
+	size_t i;
+
+	if (set) {
+		for (i = 0; i < set->n_handles; ++i)
+			bus1_handle_unref(set->handles[i]);
+		kvfree(set);
+	}
+
+	return NULL;
+}
+
+static void bus1_peer_flush_sets(struct bus1_peer *peer)
+{
+	struct bus1_peer_set *set;
+	int id;
+
+	lockdep_assert_held(&peer->local.lock);
+
+	idr_for_each_entry(&peer->local.sets, set, id) {
+		idr_remove(&peer->local.sets, id);
+		bus1_peer_set_free(set);
+	}
+}
+
+static int bus1_peer_unblock_fn(wait_queue_t *wait,
+				unsigned int mode,
+				int sync,
+				void *key)
+{
+	struct bus1_peer *peer = container_of(wait, struct bus1_peer,
+					      blocked_wait);
+
+	/*
+	 * This is called with the room wait-queue lock of @peer->blocked_on
+	 * held. Once @peer->blocked_on is cleared, @peer might be freed by a
+	 * racing bus1_peer_unblock(), hence the rcu read lock.
+	 */
+	rcu_read_lock();
+	__remove_wait_queue(&peer->blocked_on->room_waitq, wait);
+	WRITE_ONCE(peer->blocked_on, NULL);
+	wake_up_interruptible_poll(&peer->waitq, POLLOUT | POLLWRNORM);
+	rcu_read_unlock();
+
+	return 0;
+}
+
+static void bus1_peer_unblock(struct bus1_peer *peer)
+{
+	struct bus1_peer *dst;
+
+	/* @dst is rcu-protected, and clears us before it is freed */
+	rcu_read_lock();
+	dst = READ_ONCE(peer->blocked_on);
+	if (dst) {
+		spin_lock_irq(&dst->room_waitq.lock);
+		if (peer->blocked_on == dst) {
+			__remove_wait_queue(&dst->room_waitq,
+					    &peer->blocked_wait);
+			WRITE_ONCE(peer->blocked_on, NULL);
+		}
+		spin_unlock_irq(&dst->room_waitq.lock);
+	}
+	rcu_read_unlock();
+}
+
+/*
+ * Mark @peer as blocked on @dst, so POLLOUT is cleared until @dst releases
+ * resources. @seq is the room sequence of @dst sampled before the failed
+ * charge. If it changed meanwhile, @dst already has room again. The caller
+ * must hold an active reference to @dst, so its disconnect is guaranteed to
+ * see and unlink our entry.
+ */
+static void bus1_peer_block(struct bus1_peer *peer,
+			    struct bus1_peer *dst,
+			    unsigned int seq)
+{
+	lockdep_assert_held(&peer->local.lock);
+
+	if (!(READ_ONCE(peer->flags) & BUS1_PEER_FLAG_POLLOUT))
+		return;
+
+	bus1_peer_unblock(peer);
+
+	spin_lock_irq(&dst->room_waitq.lock);
+	WRITE_ONCE(peer->blocked_on, dst);
+	__add_wait_queue(&dst->room_waitq, &peer->blocked_wait);
+
+	/* pairs with the barrier in bus1_peer_wake_room() */
+	smp_mb();
+	if (atomic_read(&dst->room_seq) != seq) {
+		__remove_wait_queue(&dst->room_waitq, &peer->blocked_wait);
+		WRITE_ONCE(peer->blocked_on, NULL);
+	}
+	spin_unlock_irq(&dst->room_waitq.lock);
+}
+
+/*
+ * Per-peer debugfs entries are opt-in. Creating and removing them is a
+ * significant part of the cost of short-lived peers, and the global summary
+ * list is serialized by a single mutex.
+ */
+static bool bus1_peer_debugfs;
+module_param_named(peer_debugfs, bus1_peer_debugfs, bool, 0644);
+MODULE_PARM_DESC(peer_debugfs,
+		 "Create debugfs entries for each new peer.");
+
+/* list of all peers with debugfs entries, for the global summary */
+static DEFINE_MUTEX(bus1_peer_debuglock);
+static LIST_HEAD(bus1_peer_debuglist);
+
+static void bus1_peer_debugfs_show_limits(struct seq_file *m,
+					  const char *prefix,
+					  struct bus1_user_limits *limits)
+{
+	int n_slices, n_handles;
+
+	bus1_user_limits_read(limits, &n_slices, &n_handles);
+
+	seq_printf(m, "%s.slices:\t%d/%u\n", prefix,
+		   (int)limits->max_slices - n_slices, limits->max_slices);
+	seq_printf(m, "%s.handles:\t%d/%u\n", prefix,
+		   (int)limits->max_handles - n_handles, limits->max_handles);
+	seq_printf(m, "%s.inflight_bytes:\t%d/%u\n", prefix,
+		   (int)limits->max_inflight_bytes -
+				atomic_read(&limits->n_inflight_bytes),
+		   limits->max_inflight_bytes);
+	seq_printf(m, "%s.inflight_fds:\t%d/%u\n", prefix,
+		   (int)limits->max_inflight_fds -
+				atomic_read(&limits->n_inflight_fds),
+		   limits->max_inflight_fds);
+}
+
+/* per-reader state of the stats file, so readers do not disturb each other */
+struct bus1_peer_debugfs_stats {
+	struct bus1_peer *peer;
+	u64 ns;
+	u64 n_sends;
+	u64 n_recvs;
+};
+
+static int bus1_peer_debugfs_stats_show(struct seq_file *m, void *unused)
+{
+	struct bus1_peer_debugfs_stats *stats = m->private;
+	struct bus1_peer *peer = stats->peer;
+	u64 now, ns, n_sends, n_recvs, d_sends, d_recvs;
+	struct bus1_pool_stats pool;
+	size_t n_committed, n_staged;
+	int node, n_slices, n_handles;
+	unsigned long *n_pages;
+
+	/*
+	 * Rates are averaged over the interval since this open file was last
+	 * read, or since the peer was created. The counters are maintained by
+	 * the peer itself, hence neither the local, nor the data lock is
+	 * needed, and reading this never stalls the peer.
+	 */
+	now = ktime_get_ns();
+	n_sends = READ_ONCE(peer->local.n_sends);
+	n_recvs = READ_ONCE(peer->local.n_recvs);
+	ns = now - stats->ns;
+	d_sends = n_sends - stats->n_sends;
+	d_recvs = n_recvs - stats->n_recvs;
+	stats->ns = now;
+	stats->n_sends = n_sends;
+	stats->n_recvs = n_recvs;
+
+	bus1_queue_count(&peer->data.queue, &n_committed, &n_staged);
+	bus1_pool_get_stats(&peer->data.pool, &pool);
+
+	seq_printf(m, "queue.committed:\t%zu\n", n_committed);
+	seq_printf(m, "queue.staged:\t%zu\n", n_staged);
+	seq_printf(m, "pool.allocated:\t%zu\n", pool.allocated_size);
+	seq_printf(m, "pool.extent:\t%zu\n", pool.extent);
+	seq_printf(m, "pool.slices:\t%zu\n", pool.n_slices);
+	seq_printf(m, "pool.holes:\t%zu\n", pool.n_holes);
+	seq_printf(m, "pool.hole_size:\t%zu\n", pool.hole_size);
+
+	/* placement of the backing pages, which follows the first writer */
+	n_pages = kcalloc(nr_node_ids, sizeof(*n_pages), GFP_KERNEL);
+	if (n_pages) {
+		bus1_pool_count_nodes(&peer->data.pool, n_pages);
+		for_each_node(node)
+			seq_printf(m, "pool.pages.node%d:\t%lu\n", node,
+				   n_pages[node]);
+		kfree(n_pages);
+	}
+
+	/*
+	 * Per-peer share of the global object counters: every message queued
+	 * on the peer or held in its pool is charged a slice on the peer
+	 * limits, and every handle the peer holds is linked in its map. The
+	 * latter is protected by the local lock, so this is a racy snapshot.
+	 */
+	bus1_user_limits_read(&peer->data.limits, &n_slices, &n_handles);
+	seq_printf(m, "objects.messages:\t%d\n",
+		   (int)peer->data.limits.max_slices - n_slices);
+	seq_printf(m, "objects.handles:\t%zu\n",
+		   READ_ONCE(peer->local.n_map_handles));
+
+	bus1_peer_debugfs_show_limits(m, "peer", &peer->data.limits);
+	bus1_peer_debugfs_show_limits(m, "user", &peer->user->limits);
+	seq_printf(m, "sends:\t%llu\n", n_sends);
+	seq_printf(m, "recvs:\t%llu\n", n_recvs);
+	seq_printf(m, "sends_per_sec:\t%llu\n",
+		   ns ? div64_u64(d_sends * NSEC_PER_SEC, ns) : 0);
+	seq_printf(m, "recvs_per_sec:\t%llu\n",
+		   ns ? div64_u64(d_recvs * NSEC_PER_SEC, ns) : 0);
+
+	return 0;
+}
+
+static int bus1_peer_debugfs_stats_open(struct inode *inode,
+					struct file *file)
+{
+	struct bus1_peer_debugfs_stats *stats;
+	struct bus1_peer *peer = inode->i_private;
+	int r;
+
+	stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+	if (!stats)
+		return -ENOMEM;
+
+	stats->peer = peer;
+	stats->ns = peer->local.created_ns;
+	stats->n_sends = 0;
+	stats->n_recvs = 0;
+
+	r = single_open(file, bus1_peer_debugfs_stats_show, stats);
+	if (r < 0)
+		kfree(stats);
+	return r;
+}
+
+static int bus1_peer_debugfs_stats_release(struct inode *inode,
+					   struct file *file)
+{
+	struct seq_file *m = file->private_data;
+
+	kfree(m->private);
+	return single_release(inode, file);
+}
+
+static const struct file_operations bus1_peer_debugfs_stats_fops = {
+	.owner			= THIS_MODULE,
+	.open			= bus1_peer_debugfs_stats_open,
+	.read			= seq_read,
+	.llseek			= seq_lseek,
+	.release		= bus1_peer_debugfs_stats_release,
+};
+
+static int bus1_peer_debugfs_summary_show(struct seq_file *m, void *unused)
+{
+	struct bus1_user_limits *limits;
+	struct bus1_pool_stats pool;
+	size_t n_committed, n_staged;
+	int n_slices, n_handles;
+	struct bus1_peer *peer;
+
+	seq_puts(m, "peer\tcommitted\tstaged\tallocated\tholes\thole_size\tslices\thandles\tinflight_bytes\tinflight_fds\n");
+
+	mutex_lock(&bus1_peer_debuglock);
+	list_for_each_entry(peer, &bus1_peer_debuglist, debuglink) {
+		limits = &peer->data.limits;
+		bus1_user_limits_read(limits, &n_slices, &n_handles);
+
+		/* only reads counters, so no peer is stalled by this */
+		bus1_queue_count(&peer->data.queue, &n_committed, &n_staged);
+		bus1_pool_get_stats(&peer->data.pool, &pool);
+
+		seq_printf(m, "%llx\t%zu\t%zu\t%zu\t%zu\t%zu\t%d/%u\t%d/%u\t%d/%u\t%d/%u\n",
+			   peer->id, n_committed, n_staged,
+			   pool.allocated_size, pool.n_holes, pool.hole_size,
+			   (int)limits->max_slices - n_slices,
+			   limits->max_slices,
+			   (int)limits->max_handles - n_handles,
+			   limits->max_handles,
+			   (int)limits->max_inflight_bytes -
+					atomic_read(&limits->n_inflight_bytes),
+			   limits->max_inflight_bytes,
+			   (int)limits->max_inflight_fds -
+					atomic_read(&limits->n_inflight_fds),
+			   limits->max_inflight_fds);
+	}
+	mutex_unlock(&bus1_peer_debuglock);
+
+	return 0;
+}
+
+static int bus1_peer_debugfs_summary_open(struct inode *inode,
+					  struct file *file)
+{
+	return single_open(file, bus1_peer_debugfs_summary_show, NULL);
+}
+
+static const struct file_operations bus1_peer_debugfs_summary_fops = {
+	.owner			= THIS_MODULE,
+	.open			= bus1_peer_debugfs_summary_open,
+	.read			= seq_read,
+	.llseek			= seq_lseek,
+	.release		= single_release,
+};
+
+/**
+ * bus1_peer_debugfs_create_summary() - create debugfs summary of all peers
+ * @name:	file name to use
+ * @mode:	permissions for the file
+ * @parent:	parent directory
+ *
+ * This creates a read-only debugfs file that prints one line per peer, listing
+ * its queue depth, pool fragmentation, and quota usage. Only peers created
+ * while the bus1 debugfs root exists are listed.
+ *
+ * Return: Pointer to new dentry, NULL/ERR_PTR if disabled or on failure.
+ */
+struct dentry *bus1_peer_debugfs_create_summary(const char *name,
+						umode_t mode,
+						struct dentry *parent)
+{
+	return debugfs_create_file(name, mode, parent, NULL,
+				   &bus1_peer_debugfs_summary_fops);
+}
+
 /**
  * bus1_peer_new() - allocate new peer
  * @cred:	credentials used for accounting
@@ -101,26 +481,47 @@ struct bus1_peer *bus1_peer_new(const struct cred *cred)
 	peer->flags = 0;
 	peer->user = user;
 	peer->debugdir = NULL;
+	INIT_LIST_HEAD(&peer->debuglink);
 	init_waitqueue_head(&peer->waitq);
+	init_waitqueue_head(&peer->room_waitq);
+	atomic_set(&peer->room_seq, 0);
+	peer->blocked_on = NULL;
+	init_waitqueue_func_entry(&peer->blocked_wait, bus1_peer_unblock_fn);
 	bus1_active_init(&peer->active);
 
 	/* initialize data section */
 	mutex_init(&peer->data.lock);
 	peer->data.pool = BUS1_POOL_NULL;
 	bus1_queue_init(&peer->data.queue);
-	bus1_user_limits_init(&peer->data.limits, peer->user);
 
 	/* initialize peer-private section */
 	mutex_init(&peer->local.lock);
 	peer->local.seed = NULL;
-	peer->local.map_handles = RB_ROOT;
+	peer->local.map_handles = NULL;
+	peer->local.map_shift = 0;
+	peer->local.n_map_handles = 0;
 	peer->local.handle_ids = 0;
+	idr_init(&peer->local.sets);
+	peer->local.created_ns = ktime_get_ns();
+	peer->local.n_sends = 0;
+	peer->local.n_recvs = 0;
+	peer->local.recv_timeout_ns = 0;
+	peer->local.recv_busy_poll_ns = 0;
+	peer->local.send_timeout_ns = 0;
+
+	r = bus1_user_limits_init(&peer->data.limits, peer->user);
+	if (r < 0)
+		goto error;
+
+	r = bus1_handle_map_init(peer);
+	if (r < 0)
+		goto error;
 
-	r = bus1_pool_init(&peer->data.pool, KBUILD_MODNAME "-peer");
+	r = bus1_pool_init(&peer->data.pool, KBUILD_MODNAME "-peer", cred);
 	if (r < 0)
 		goto error;
 
-	if (!IS_ERR_OR_NULL(bus1_debugdir)) {
+	if (READ_ONCE(bus1_peer_debugfs) && !IS_ERR_OR_NULL(bus1_debugdir)) {
 		char idstr[22];
 
 		snprintf(idstr, sizeof(idstr), "peer-%llx", peer->id);
@@ -133,7 +534,14 @@ struct bus1_peer *bus1_peer_new(const struct cred *cred)
 			bus1_debugfs_create_atomic_x("active", S_IRUGO,
 						     peer->debugdir,
 						     &peer->active.count);
+			debugfs_create_file("stats", S_IRUGO,
+					    peer->debugdir, peer,
+					    &bus1_peer_debugfs_stats_fops);
 		}
+
+		mutex_lock(&bus1_peer_debuglock);
+		list_add_tail(&peer->debuglink, &bus1_peer_debuglist);
+		mutex_unlock(&bus1_peer_debuglock);
 	}
 
 	bus1_active_activate(&peer->active);
@@ -149,8 +557,10 @@ static void bus1_peer_flush(struct bus1_peer *peer, u64 flags)
 	struct bus1_message *message;
 	struct bus1_pool_slice *slist, *slice;
 	struct bus1_queue_node *qlist, *qnode;
-	struct bus1_handle *h, *safe;
+	struct bus1_handle *h;
+	struct hlist_node *safe;
 	struct bus1_tx tx;
+	unsigned int i;
 	u64 ts;
 	int n;
 
@@ -159,6 +569,9 @@ static void bus1_peer_flush(struct bus1_peer *peer, u64 flags)
 	bus1_tx_init(&tx, peer);
 
 	if (flags & BUS1_PEER_RESET_FLAG_FLUSH) {
+		/* registered sets pin handles, drop them before the handles */
+		bus1_peer_flush_sets(peer);
+
 		/* protect handles on the seed */
 		if (!(flags & BUS1_PEER_RESET_FLAG_FLUSH_SEED) &&
 		    peer->local.seed) {
@@ -177,9 +590,7 @@ static void bus1_peer_flush(struct bus1_peer *peer, u64 flags)
 
 		/* first destroy all live anchors */
 		mutex_lock(&peer->data.lock);
-		rbtree_postorder_for_each_entry_safe(h, safe,
-						     &peer->local.map_handles,
-						     rb_to_peer) {
+		bus1_handle_map_for_each_entry_safe(h, safe, i, peer) {
 			if (!bus1_handle_is_anchor(h) ||
 			    !bus1_handle_is_live(h))
 				continue;
@@ -192,11 +603,9 @@ static void bus1_peer_flush(struct bus1_peer *peer, u64 flags)
 		ts = bus1_tx_commit(&tx);
 
 		/* now release all user handles */
-		rbtree_postorder_for_each_entry_safe(h, safe,
-						     &peer->local.map_handles,
-						     rb_to_peer) {
+		bus1_handle_map_for_each_entry_safe(h, safe, i, peer) {
 			n = atomic_xchg(&h->n_user, 0);
-			bus1_handle_forget_keep(h);
+			bus1_handle_forget(h);
 			bus1_user_discharge(&peer->user->limits.n_handles,
 					    &peer->data.limits.n_handles, n);
 
@@ -208,7 +617,7 @@ static void bus1_peer_flush(struct bus1_peer *peer, u64 flags)
 				bus1_handle_release_n(h, n, true);
 			}
 		}
-		peer->local.map_handles = RB_ROOT;
+		WARN_ON(peer->local.n_map_handles != 0);
 
 		/* finally flush the queue and pool */
 		mutex_lock(&peer->data.lock);
@@ -252,8 +661,18 @@ static void bus1_peer_cleanup(struct bus1_active *a, void *userdata)
 static int bus1_peer_disconnect(struct bus1_peer *peer)
 {
 	bus1_active_deactivate(&peer->active);
+
+	/* blocking receives and sends hold an active reference, kick them out */
+	wake_up_interruptible_all(&peer->waitq);
+	wake_up_interruptible_all(&peer->room_waitq);
 	bus1_active_drain(&peer->active, &peer->waitq);
 
+	/*
+	 * Blocked senders link their entry while holding an active reference,
+	 * so after the drain this catches all of them, see bus1_peer_block().
+	 */
+	wake_up_interruptible_all(&peer->room_waitq);
+
 	if (!bus1_active_cleanup(&peer->active, &peer->waitq,
 				 bus1_peer_cleanup, NULL))
 		return -ESHUTDOWN;
@@ -279,12 +698,23 @@ struct bus1_peer *bus1_peer_free(struct bus1_peer *peer)
 	if (!peer)
 		return NULL;
 
+	/* unlink from debugfs first, it inspects the data section */
+	if (!list_empty(&peer->debuglink)) {
+		mutex_lock(&bus1_peer_debuglock);
+		list_del_init(&peer->debuglink);
+		mutex_unlock(&bus1_peer_debuglock);
+	}
+	debugfs_remove_recursive(peer->debugdir);
+	peer->debugdir = NULL;
+
 	/* disconnect from environment */
 	bus1_peer_disconnect(peer);
+	bus1_peer_unblock(peer);
 
 	/* deinitialize peer-private section */
-	WARN_ON(!RB_EMPTY_ROOT(&peer->local.map_handles));
+	bus1_handle_map_deinit(peer);
 	WARN_ON(peer->local.seed);
+	idr_destroy(&peer->local.sets);
 	mutex_destroy(&peer->local.lock);
 
 	/* deinitialize data section */
@@ -294,7 +724,6 @@ struct bus1_peer *bus1_peer_free(struct bus1_peer *peer)
 	mutex_destroy(&peer->data.lock);
 
 	/* deinitialize constant fields */
-	debugfs_remove_recursive(peer->debugdir);
 	bus1_active_deinit(&peer->active);
 	peer->user = bus1_user_unref(peer->user);
 	kfree_rcu(peer, rcu);
@@ -316,11 +745,15 @@ static int bus1_peer_ioctl_peer_query(struct bus1_peer *peer,
 		return -EINVAL;
 
 	mutex_lock(&peer->local.lock);
-	param.peer_flags = 0;
+	param.peer_flags = peer->flags;
 	param.max_slices = peer->data.limits.max_slices;
 	param.max_handles = peer->data.limits.max_handles;
 	param.max_inflight_bytes = peer->data.limits.max_inflight_bytes;
 	param.max_inflight_fds = peer->data.limits.max_inflight_fds;
+	param.recv_timeout_ns = peer->local.recv_timeout_ns;
+	param.recv_busy_poll_ns = peer->local.recv_busy_poll_ns;
+	param.pool_size = peer->data.pool.size;
+	param.send_timeout_ns = peer->local.send_timeout_ns;
 	mutex_unlock(&peer->local.lock);
 
 	return copy_to_user(uparam, &param, sizeof(param)) ? -EFAULT : 0;
@@ -331,15 +764,22 @@ static int bus1_peer_ioctl_peer_reset(struct bus1_peer *peer,
 {
 	struct bus1_cmd_peer_reset __user *uparam = (void __user *)arg;
 	struct bus1_cmd_peer_reset param;
+	int r = 0;
 
 	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_PEER_RESET) != sizeof(param));
 
 	if (copy_from_user(&param, uparam, sizeof(param)))
 		return -EFAULT;
 	if (unlikely(param.flags & ~(BUS1_PEER_RESET_FLAG_FLUSH |
-				     BUS1_PEER_RESET_FLAG_FLUSH_SEED)))
+				     BUS1_PEER_RESET_FLAG_FLUSH_SEED |
+				     BUS1_PEER_RESET_FLAG_PREFAULT)))
 		return -EINVAL;
-	if (unlikely(param.peer_flags != -1))
+	if (unlikely(param.peer_flags != -1 &&
+		     (param.peer_flags & ~(BUS1_PEER_FLAG_POOL_HUGEPAGE |
+					   BUS1_PEER_FLAG_POOL_RING |
+					   BUS1_PEER_FLAG_RECV_INLINE |
+					   BUS1_PEER_FLAG_POLLOUT |
+					   BUS1_PEER_FLAG_NOTIFY_COALESCE))))
 		return -EINVAL;
 	if (unlikely((param.max_slices != -1 &&
 		      param.max_slices > INT_MAX) ||
@@ -348,13 +788,43 @@ static int bus1_peer_ioctl_peer_reset(struct bus1_peer *peer,
 		     (param.max_inflight_bytes != -1 &&
 		      param.max_inflight_bytes > INT_MAX) ||
 		     (param.max_inflight_fds != -1 &&
-		      param.max_inflight_fds > INT_MAX)))
+		      param.max_inflight_fds > INT_MAX) ||
+		     (param.recv_busy_poll_ns != -1 &&
+		      param.recv_busy_poll_ns > BUS1_PEER_BUSY_POLL_MAX_NS) ||
+		     (param.pool_size != -1 &&
+		      (param.pool_size < PAGE_SIZE ||
+		       !PAGE_ALIGNED(param.pool_size) ||
+		       param.pool_size > BUS1_POOL_SLICE_SIZE_MAX))))
 		return -EINVAL;
 
 	mutex_lock(&peer->local.lock);
 
-	if (param.peer_flags != -1)
-		peer->flags = param.peer_flags;
+	/*
+	 * The pool can only be resized while empty. Flush it first, if asked
+	 * to, and resize it before anything else is changed, so a busy pool
+	 * leaves the remaining settings untouched.
+	 */
+	bus1_peer_flush(peer, param.flags);
+
+	if (param.pool_size != -1) {
+		mutex_lock(&peer->data.lock);
+		r = bus1_pool_resize(&peer->data.pool, param.pool_size);
+		mutex_unlock(&peer->data.lock);
+		if (r < 0)
+			goto exit;
+	}
+
+	if (param.peer_flags != -1) {
+		WRITE_ONCE(peer->flags, param.peer_flags);
+
+		/* the allocation policy can be switched at any time */
+		mutex_lock(&peer->data.lock);
+		peer->data.pool.ring = !!(param.peer_flags &
+					  BUS1_PEER_FLAG_POOL_RING);
+		mutex_unlock(&peer->data.lock);
+	}
+	if (!(peer->flags & BUS1_PEER_FLAG_POLLOUT))
+		bus1_peer_unblock(peer);
 
 	if (param.max_slices != -1) {
 		atomic_add((int)param.max_slices -
@@ -384,33 +854,40 @@ static int bus1_peer_ioctl_peer_reset(struct bus1_peer *peer,
 		peer->data.limits.max_inflight_fds = param.max_inflight_fds;
 	}
 
-	bus1_peer_flush(peer, param.flags);
+	/* raised limits, or a flush, might unblock senders */
+	bus1_peer_wake_room(peer);
 
-	mutex_unlock(&peer->local.lock);
+	if (param.recv_timeout_ns != -1)
+		peer->local.recv_timeout_ns = param.recv_timeout_ns;
+	if (param.recv_busy_poll_ns != -1)
+		peer->local.recv_busy_poll_ns = param.recv_busy_poll_ns;
+	if (param.send_timeout_ns != -1)
+		peer->local.send_timeout_ns = param.send_timeout_ns;
 
-	return 0;
+	/*
+	 * The default pool spans 4GiB, and is not backed by any limit. Never
+	 * populate more than the peer may have in flight at a time.
+	 */
+	if (param.flags & BUS1_PEER_RESET_FLAG_PREFAULT)
+		r = bus1_pool_prefault(&peer->data.pool,
+				       peer->data.limits.max_inflight_bytes);
+
+exit:
+	mutex_unlock(&peer->local.lock);
+	return r;
 }
 
-static int bus1_peer_ioctl_handle_release(struct bus1_peer *peer,
-					  unsigned long arg)
+static int bus1_peer_release_handle(struct bus1_peer *peer, u64 id)
 {
-	struct bus1_handle *h = NULL;
+	struct bus1_handle *h;
 	bool is_new, strong = true;
-	u64 id;
 	int r;
 
-	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_HANDLE_RELEASE) != sizeof(id));
-
-	if (get_user(id, (const u64 __user *)arg))
-		return -EFAULT;
-
-	mutex_lock(&peer->local.lock);
+	lockdep_assert_held(&peer->local.lock);
 
 	h = bus1_handle_import(peer, id, &is_new);
-	if (IS_ERR(h)) {
-		r = PTR_ERR(h);
-		goto exit;
-	}
+	if (IS_ERR(h))
+		return PTR_ERR(h);
 
 	if (is_new) {
 		/*
@@ -442,27 +919,94 @@ static int bus1_peer_ioctl_handle_release(struct bus1_peer *peer,
 	bus1_handle_forget(h);
 	bus1_user_discharge(&peer->user->limits.n_handles,
 			    &peer->data.limits.n_handles, 1);
+	bus1_peer_wake_room(peer);
 	bus1_handle_release(h, strong);
 
 	r = 0;
 
 exit:
-	mutex_unlock(&peer->local.lock);
 	bus1_handle_unref(h);
 	return r;
 }
 
+static int bus1_peer_ioctl_handle_release(struct bus1_peer *peer,
+					  unsigned long arg)
+{
+	u64 id;
+	int r;
+
+	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_HANDLE_RELEASE) != sizeof(id));
+
+	if (get_user(id, (const u64 __user *)arg))
+		return -EFAULT;
+
+	mutex_lock(&peer->local.lock);
+	r = bus1_peer_release_handle(peer, id);
+	mutex_unlock(&peer->local.lock);
+
+	return r;
+}
+
+static int bus1_peer_ioctl_handles_release(struct bus1_peer *peer,
+					   unsigned long arg)
+{
+	struct bus1_cmd_handles_release __user *uparam = (void __user *)arg;
+	struct bus1_cmd_handles_release param;
+	u64 *ids, i, n;
+	int r;
+
+	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_HANDLES_RELEASE) != sizeof(param));
+
+	if (copy_from_user(&param, uparam, sizeof(param)))
+		return -EFAULT;
+	if (unlikely(param.flags))
+		return -EINVAL;
+	if (unlikely(param.ptr_handles !=
+		     (u64)(unsigned long)param.ptr_handles) ||
+	    unlikely(param.ptr_errors != (u64)(unsigned long)param.ptr_errors))
+		return -EFAULT;
+
+	/* bounded, like BUS1_CMD_SLICES_RELEASE, as the lock is held */
+	n = min_t(u64, param.n_handles, UIO_MAXIOV);
+	if (n == 0)
+		return put_user(0, &uparam->n_handles) ? -EFAULT : 0;
+
+	ids = memdup_user((void __user *)(unsigned long)param.ptr_handles,
+			  n * sizeof(*ids));
+	if (IS_ERR(ids))
+		return PTR_ERR(ids);
+
+	/* the IDs are replaced by the per-entry error codes */
+	mutex_lock(&peer->local.lock);
+	for (i = 0; i < n; ++i)
+		ids[i] = -bus1_peer_release_handle(peer, ids[i]);
+	mutex_unlock(&peer->local.lock);
+
+	r = 0;
+	if (param.ptr_errors &&
+	    copy_to_user((void __user *)(unsigned long)param.ptr_errors,
+			 ids, n * sizeof(*ids)))
+		r = -EFAULT;
+	else if (put_user(n, &uparam->n_handles))
+		r = -EFAULT;
+
+	kfree(ids);
+	return r;
+}
+
 static int bus1_peer_transfer(struct bus1_peer *src,
 			      struct bus1_peer *dst,
-			      struct bus1_cmd_handle_transfer *param)
+			      u64 src_id,
+			      u64 *dst_idp)
 {
 	struct bus1_handle *src_h = NULL, *dst_h = NULL;
 	bool is_new;
 	int r;
 
-	bus1_mutex_lock2(&src->local.lock, &dst->local.lock);
+	lockdep_assert_held(&src->local.lock);
+	lockdep_assert_held(&dst->local.lock);
 
-	src_h = bus1_handle_import(src, param->src_handle, &is_new);
+	src_h = bus1_handle_import(src, src_id, &is_new);
 	if (IS_ERR(src_h)) {
 		r = PTR_ERR(src_h);
 		src_h = NULL;
@@ -482,7 +1026,7 @@ static int bus1_peer_transfer(struct bus1_peer *src,
 		 * XXX: We really ought to settle on the destruction. This
 		 *      requires some waitq to settle on, though.
 		 */
-		param->dst_handle = BUS1_HANDLE_INVALID;
+		*dst_idp = BUS1_HANDLE_INVALID;
 		r = 0;
 		goto exit;
 	}
@@ -516,7 +1060,7 @@ static int bus1_peer_transfer(struct bus1_peer *src,
 	}
 
 	dst_h = bus1_handle_acquire(dst_h, true);
-	param->dst_handle = bus1_handle_identify(dst_h);
+	*dst_idp = bus1_handle_identify(dst_h);
 	bus1_handle_export(dst_h);
 	WARN_ON(atomic_inc_return(&dst_h->n_user) < 1);
 
@@ -524,19 +1068,39 @@ static int bus1_peer_transfer(struct bus1_peer *src,
 
 exit:
 	bus1_handle_forget(src_h);
-	bus1_mutex_unlock2(&src->local.lock, &dst->local.lock);
 	bus1_handle_unref(dst_h);
 	bus1_handle_unref(src_h);
 	return r;
 }
 
+/* acquire the peer behind @fd, or return NULL if @fd is -1 */
+static struct bus1_peer *bus1_peer_acquire_by_fd(u64 fd)
+{
+	struct bus1_peer *peer;
+	struct fd f;
+
+	if (fd == -1)
+		return NULL;
+
+	f = fdget(fd);
+	if (!f.file)
+		return ERR_PTR(-EBADF);
+	if (f.file->f_op != &bus1_fops) {
+		fdput(f);
+		return ERR_PTR(-EOPNOTSUPP);
+	}
+
+	peer = bus1_peer_acquire(f.file->private_data);
+	fdput(f);
+	return peer ?: ERR_PTR(-ESHUTDOWN);
+}
+
 static int bus1_peer_ioctl_handle_transfer(struct bus1_peer *src,
 					   unsigned long arg)
 {
 	struct bus1_cmd_handle_transfer __user *uparam = (void __user *)arg;
 	struct bus1_cmd_handle_transfer param;
-	struct bus1_peer *dst = NULL;
-	struct fd dst_f;
+	struct bus1_peer *dst;
 	int r;
 
 	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_HANDLE_TRANSFER) != sizeof(param));
@@ -546,22 +1110,14 @@ static int bus1_peer_ioctl_handle_transfer(struct bus1_peer *src,
 	if (unlikely(param.flags))
 		return -EINVAL;
 
-	if (param.dst_fd != -1) {
-		dst_f = fdget(param.dst_fd);
-		if (!dst_f.file)
-			return -EBADF;
-		if (dst_f.file->f_op != &bus1_fops) {
-			fdput(dst_f);
-			return -EOPNOTSUPP;
-		}
-
-		dst = bus1_peer_acquire(dst_f.file->private_data);
-		fdput(dst_f);
-		if (!dst)
-			return -ESHUTDOWN;
-	}
+	dst = bus1_peer_acquire_by_fd(param.dst_fd);
+	if (IS_ERR(dst))
+		return PTR_ERR(dst);
 
-	r = bus1_peer_transfer(src, dst ?: src, &param);
+	bus1_mutex_lock2(&src->local.lock, &(dst ?: src)->local.lock);
+	r = bus1_peer_transfer(src, dst ?: src, param.src_handle,
+			       &param.dst_handle);
+	bus1_mutex_unlock2(&src->local.lock, &(dst ?: src)->local.lock);
 	bus1_peer_release(dst);
 	if (r < 0)
 		return r;
@@ -569,6 +1125,78 @@ static int bus1_peer_ioctl_handle_transfer(struct bus1_peer *src,
 	return copy_to_user(uparam, &param, sizeof(param)) ? -EFAULT : 0;
 }
 
+static int bus1_peer_ioctl_handles_transfer(struct bus1_peer *src,
+					    unsigned long arg)
+{
+	struct bus1_cmd_handles_transfer __user *uparam = (void __user *)arg;
+	struct bus1_cmd_handles_transfer param;
+	struct bus1_peer *dst;
+	u64 *ids, *errors, i, n;
+	int r;
+
+	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_HANDLES_TRANSFER) != sizeof(param));
+
+	if (copy_from_user(&param, uparam, sizeof(param)))
+		return -EFAULT;
+	if (unlikely(param.flags))
+		return -EINVAL;
+	if (unlikely(param.ptr_src_handles !=
+		     (u64)(unsigned long)param.ptr_src_handles) ||
+	    unlikely(param.ptr_dst_handles !=
+		     (u64)(unsigned long)param.ptr_dst_handles) ||
+	    unlikely(param.ptr_errors != (u64)(unsigned long)param.ptr_errors))
+		return -EFAULT;
+
+	/* bounded, like BUS1_CMD_SLICES_RELEASE, as both locks are held */
+	n = min_t(u64, param.n_handles, UIO_MAXIOV);
+	if (n == 0)
+		return put_user(0, &uparam->n_handles) ? -EFAULT : 0;
+
+	ids = memdup_user((void __user *)(unsigned long)param.ptr_src_handles,
+			  n * sizeof(*ids));
+	if (IS_ERR(ids))
+		return PTR_ERR(ids);
+
+	errors = kmalloc_array(n, sizeof(*errors), GFP_TEMPORARY);
+	if (!errors) {
+		r = -ENOMEM;
+		goto exit;
+	}
+
+	dst = bus1_peer_acquire_by_fd(param.dst_fd);
+	if (IS_ERR(dst)) {
+		r = PTR_ERR(dst);
+		goto exit;
+	}
+
+	/* the source IDs are replaced by the destination IDs */
+	bus1_mutex_lock2(&src->local.lock, &(dst ?: src)->local.lock);
+	for (i = 0; i < n; ++i) {
+		r = bus1_peer_transfer(src, dst ?: src, ids[i], &ids[i]);
+		if (r < 0)
+			ids[i] = BUS1_HANDLE_INVALID;
+		errors[i] = -r;
+	}
+	bus1_mutex_unlock2(&src->local.lock, &(dst ?: src)->local.lock);
+	bus1_peer_release(dst);
+
+	r = 0;
+	if (copy_to_user((void __user *)(unsigned long)param.ptr_dst_handles,
+			 ids, n * sizeof(*ids)))
+		r = -EFAULT;
+	else if (param.ptr_errors &&
+		 copy_to_user((void __user *)(unsigned long)param.ptr_errors,
+			      errors, n * sizeof(*errors)))
+		r = -EFAULT;
+	else if (put_user(n, &uparam->n_handles))
+		r = -EFAULT;
+
+exit:
+	kfree(errors);
+	kfree(ids);
+	return r;
+}
+
 static int bus1_peer_ioctl_nodes_destroy(struct bus1_peer *peer,
 					 unsigned long arg)
 {
@@ -680,6 +1308,7 @@ static int bus1_peer_ioctl_nodes_destroy(struct bus1_peer *peer,
 
 	bus1_user_discharge(&peer->user->limits.n_handles,
 			    &peer->data.limits.n_handles, n_discharge);
+	bus1_peer_wake_room(peer);
 
 	r = 0;
 
@@ -724,26 +1353,145 @@ static int bus1_peer_ioctl_slice_release(struct bus1_peer *peer,
 	return 0;
 }
 
-static struct bus1_message *bus1_peer_new_message(struct bus1_peer *peer,
-						  struct bus1_factory *f,
-						  u64 id)
+static int bus1_peer_ioctl_slices_release(struct bus1_peer *peer,
+					  unsigned long arg)
 {
-	struct bus1_message *m = NULL;
-	struct bus1_handle *h = NULL;
-	struct bus1_peer *p = NULL;
-	bool is_new;
+	struct bus1_cmd_slices_release __user *uparam = (void __user *)arg;
+	struct bus1_pool_slice *slice, *list = NULL;
+	struct bus1_cmd_slices_release param;
+	struct bus1_message *message;
+	u64 *offsets, i, n;
 	int r;
 
-	h = bus1_handle_import(peer, id, &is_new);
-	if (IS_ERR(h))
-		return ERR_CAST(h);
-
-	if (h->tlink) {
-		r = -ENOTUNIQ;
-		goto error;
-	}
+	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_SLICES_RELEASE) != sizeof(param));
 
-	if (bus1_handle_is_anchor(h))
+	if (copy_from_user(&param, uparam, sizeof(param)))
+		return -EFAULT;
+	if (unlikely(param.flags))
+		return -EINVAL;
+	if (unlikely(param.ptr_offsets !=
+		     (u64)(unsigned long)param.ptr_offsets) ||
+	    unlikely(param.ptr_errors != (u64)(unsigned long)param.ptr_errors))
+		return -EFAULT;
+
+	/*
+	 * Like BUS1_CMD_RECV_MANY, we silently limit the number of slices that
+	 * can be released in one go. All lookups are done under a single hold
+	 * of the data lock, so it must stay bounded.
+	 */
+	n = min_t(u64, param.n_offsets, UIO_MAXIOV);
+	if (n == 0)
+		return put_user(0, &uparam->n_offsets) ? -EFAULT : 0;
+
+	offsets = memdup_user((void __user *)(unsigned long)param.ptr_offsets,
+			      n * sizeof(*offsets));
+	if (IS_ERR(offsets))
+		return PTR_ERR(offsets);
+
+	/*
+	 * Unpublish all slices at once, and collect them on a list. The
+	 * offsets array is re-used to store the per-entry error codes. Note
+	 * that a slice given twice is no longer published on its second
+	 * occurrence, and thus fails with ENXIO.
+	 */
+	mutex_lock(&peer->local.lock);
+	mutex_lock(&peer->data.lock);
+	for (i = 0; i < n; ++i) {
+		slice = bus1_pool_slice_find_published(&peer->data.pool,
+						       offsets[i]);
+		if (slice) {
+			bus1_pool_unpublish(slice);
+			slice->next = list;
+			list = slice;
+			offsets[i] = 0;
+		} else {
+			offsets[i] = ENXIO;
+		}
+	}
+	mutex_unlock(&peer->data.lock);
+	mutex_unlock(&peer->local.lock);
+
+	while ((slice = list)) {
+		list = slice->next;
+		message = container_of(slice, struct bus1_message, slice);
+		bus1_message_unref(message);
+	}
+
+	r = 0;
+	if (param.ptr_errors &&
+	    copy_to_user((void __user *)(unsigned long)param.ptr_errors,
+			 offsets, n * sizeof(*offsets)))
+		r = -EFAULT;
+	else if (put_user(n, &uparam->n_offsets))
+		r = -EFAULT;
+
+	kfree(offsets);
+	return r;
+}
+
+static int bus1_peer_ioctl_slice_install_fds(struct bus1_peer *peer,
+					     unsigned long arg)
+{
+	struct bus1_cmd_slice_install_fds param;
+	struct bus1_pool_slice *slice;
+	struct bus1_message *m;
+	u64 *indices;
+	int r;
+
+	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_SLICE_INSTALL_FDS) != sizeof(param));
+
+	if (copy_from_user(&param, (void __user *)arg, sizeof(param)))
+		return -EFAULT;
+	if (unlikely(param.flags))
+		return -EINVAL;
+	if (unlikely(param.ptr_indices !=
+		     (u64)(unsigned long)param.ptr_indices) ||
+	    unlikely(param.ptr_fds != (u64)(unsigned long)param.ptr_fds))
+		return -EFAULT;
+	if (unlikely(param.n_fds > BUS1_FD_MAX))
+		return -EMSGSIZE;
+	if (param.n_fds == 0)
+		return 0;
+
+	indices = memdup_user((void __user *)(unsigned long)param.ptr_indices,
+			      param.n_fds * sizeof(*indices));
+	if (IS_ERR(indices))
+		return PTR_ERR(indices);
+
+	/* published slices are only released under the local lock */
+	mutex_lock(&peer->local.lock);
+	mutex_lock(&peer->data.lock);
+	slice = bus1_pool_slice_find_published(&peer->data.pool, param.offset);
+	mutex_unlock(&peer->data.lock);
+	if (slice) {
+		m = container_of(slice, struct bus1_message, slice);
+		r = bus1_message_install_files(m, indices, param.n_fds,
+				(int __user *)(unsigned long)param.ptr_fds);
+	} else {
+		r = -ENXIO;
+	}
+	mutex_unlock(&peer->local.lock);
+
+	kfree(indices);
+	return r;
+}
+
+/* this consumes the reference to @h, which was imported (@is_new) or pinned */
+static struct bus1_message *bus1_peer_new_message(struct bus1_peer *peer,
+						  struct bus1_factory *f,
+						  struct bus1_handle *h,
+						  bool is_new)
+{
+	struct bus1_message *m = NULL;
+	struct bus1_peer *p = NULL;
+	int r;
+
+	if (h->tlink) {
+		r = -ENOTUNIQ;
+		goto error;
+	}
+
+	if (bus1_handle_is_anchor(h))
 		p = bus1_peer_acquire(peer);
 	else
 		p = bus1_handle_acquire_owner(h);
@@ -764,10 +1512,6 @@ static struct bus1_message *bus1_peer_new_message(struct bus1_peer *peer,
 	/* m->dst pins the handle for us */
 	bus1_handle_unref(h);
 
-	/* merge charge into factory (which shares the lookup with us) */
-	if (is_new)
-		++f->n_handles_charge;
-
 	return m;
 
 error:
@@ -778,228 +1522,1085 @@ error:
 	return ERR_PTR(r);
 }
 
-static int bus1_peer_ioctl_send(struct bus1_peer *peer,
-				unsigned long arg)
+/*
+ * On failure, the destination that ran out of resources, if any, is returned
+ * in @blockedp, with an active reference held, and its room sequence sampled
+ * before the failure in @seqp.
+ */
+static int bus1_peer_send_once(struct bus1_peer *peer,
+			       struct bus1_cmd_send *param,
+			       struct bus1_peer **blockedp,
+			       unsigned int *seqp)
 {
-	struct bus1_queue_node *mlist = NULL;
+	struct bus1_queue_node *qnode, *mlist = NULL;
 	struct bus1_factory *factory = NULL;
 	const u64 __user *ptr_destinations;
-	struct bus1_cmd_send param;
+	struct bus1_peer_set *set = NULL;
 	struct bus1_message *m;
+	struct bus1_handle *h;
 	struct bus1_peer *p;
-	size_t i, n_charge = 0;
 	struct bus1_tx tx;
 	u8 stack[512];
+	bool is_new, has_new;
+	size_t i;
 	u64 id;
 	int r;
 
-	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_SEND) != sizeof(param));
-
-	if (copy_from_user(&param, (void __user *)arg, sizeof(param)))
-		return -EFAULT;
-	if (unlikely(param.flags & ~(BUS1_SEND_FLAG_CONTINUE |
-				     BUS1_SEND_FLAG_SEED)))
+	if (unlikely(param->flags & ~(BUS1_SEND_FLAG_CONTINUE |
+				      BUS1_SEND_FLAG_SEED |
+				      BUS1_SEND_FLAG_SLICE_FDS |
+				      BUS1_SEND_FLAG_SET |
+				      BUS1_SEND_FLAG_WAIT)))
 		return -EINVAL;
 
+	/* with a set, @ptr_destinations carries the set ID instead */
+	if (param->flags & BUS1_SEND_FLAG_SET) {
+		if (unlikely(param->n_destinations))
+			return -EINVAL;
+		if (unlikely(param->ptr_destinations > INT_MAX))
+			return -ENXIO;
+	}
+
 	/* check basic limits; avoids integer-overflows later on */
-	if (unlikely(param.n_destinations > INT_MAX) ||
-	    unlikely(param.n_vecs > UIO_MAXIOV) ||
-	    unlikely(param.n_fds > BUS1_FD_MAX))
+	if (unlikely(param->n_destinations > INT_MAX) ||
+	    unlikely(param->n_vecs > UIO_MAXIOV) ||
+	    unlikely(param->n_fds > BUS1_FD_MAX))
 		return -EMSGSIZE;
 
 	/* 32bit pointer validity checks */
+	if (unlikely(!(param->flags & BUS1_SEND_FLAG_SET) &&
+		     param->ptr_destinations !=
+		     (u64)(unsigned long)param->ptr_destinations) ||
+	    unlikely(param->ptr_errors !=
+		     (u64)(unsigned long)param->ptr_errors) ||
+	    unlikely(param->ptr_vecs !=
+		     (u64)(unsigned long)param->ptr_vecs) ||
+	    unlikely(param->ptr_handles !=
+		     (u64)(unsigned long)param->ptr_handles) ||
+	    unlikely(param->ptr_fds !=
+		     (u64)(unsigned long)param->ptr_fds))
+		return -EFAULT;
+
+	if (unlikely(param->n_destinations > peer->user->limits.max_handles))
+		return -EINVAL;
+
+	bus1_tx_init(&tx, peer);
+	ptr_destinations =
+		(const u64 __user *)(unsigned long)param->ptr_destinations;
+
+	mutex_lock(&peer->local.lock);
+
+	/*
+	 * A registered set provides the destinations, and possibly the payload
+	 * vectors. It is only accessed until the local lock is dropped below,
+	 * since it might be unregistered afterwards.
+	 */
+	if (param->flags & BUS1_SEND_FLAG_SET) {
+		set = idr_find(&peer->local.sets, param->ptr_destinations);
+		if (!set) {
+			r = -ENXIO;
+			goto exit;
+		}
+		if (set->n_vecs && (param->ptr_vecs || param->n_vecs)) {
+			r = -EINVAL;
+			goto exit;
+		}
+
+		param->n_destinations = set->n_handles;
+		if (set->n_vecs)
+			param->n_vecs = set->n_vecs;
+	}
+
+	factory = bus1_factory_new(peer, param,
+				   set && set->n_vecs ? set->vecs : NULL,
+				   stack, sizeof(stack));
+	if (IS_ERR(factory)) {
+		r = PTR_ERR(factory);
+		factory = NULL;
+		goto exit;
+	}
+
+	if (param->flags & BUS1_SEND_FLAG_SEED) {
+		if (unlikely((param->flags & BUS1_SEND_FLAG_CONTINUE) ||
+			     param->n_destinations)) {
+			r = -EINVAL;
+			goto exit;
+		}
+
+		/* XXX: set seed */
+		r = -ENOTSUPP;
+		goto exit;
+	}
+
+	has_new = factory->has_new;
+	for (i = 0; i < param->n_destinations; ++i) {
+		if (set) {
+			/* released handles are no longer valid destinations */
+			h = set->handles[i];
+			if (h->id == BUS1_HANDLE_INVALID) {
+				r = -ENXIO;
+				goto exit;
+			}
+
+			h = bus1_handle_ref(h);
+			is_new = false;
+		} else {
+			if (get_user(id, ptr_destinations + i)) {
+				r = -EFAULT;
+				goto exit;
+			}
+
+			h = bus1_handle_import(peer, id, &is_new);
+			if (IS_ERR(h)) {
+				r = PTR_ERR(h);
+				goto exit;
+			}
+
+			has_new |= is_new;
+		}
+
+		m = bus1_peer_new_message(peer, factory, h, is_new);
+		if (IS_ERR(m)) {
+			r = PTR_ERR(m);
+			goto exit;
+		}
+
+		m->qnode.next = mlist;
+		mlist = &m->qnode;
+	}
+
+	/*
+	 * All handles are resolved and pinned now, so we drop the local lock
+	 * while allocating pool slices and copying the payload. This allows
+	 * other threads to send and receive on this peer meanwhile. The
+	 * duplicate markers are only valid under the lock, so clear them
+	 * first.
+	 *
+	 * Handles created by the import are hashed, but not public until the
+	 * seal. Nobody else must see them in that state, as they are neither
+	 * charged nor pinned. Hence, if there are any, the lock is kept. That
+	 * is, only sends whose transferred and destination handles are all
+	 * public already copy in parallel. Sends that create a handle, like
+	 * the first transfer of a node to a peer, are serialized on the local
+	 * lock as before.
+	 */
+	for (qnode = mlist; qnode; qnode = qnode->next) {
+		m = container_of(qnode, struct bus1_message, qnode);
+		m->dst->tlink = NULL;
+	}
+
+	if (!has_new)
+		mutex_unlock(&peer->local.lock);
+
+	r = bus1_factory_stage(factory);
+	for (qnode = mlist; qnode && r >= 0; qnode = qnode->next) {
+		m = container_of(qnode, struct bus1_message, qnode);
+		r = bus1_factory_fill(factory, m);
+	}
+
+	if (!has_new)
+		mutex_lock(&peer->local.lock);
+
+	if (r < 0)
+		goto exit;
+
+	r = bus1_factory_seal(factory, mlist);
+	if (r < 0)
+		goto exit;
+
+	/*
+	 * Now everything is prepared, charged, and pinned. Iterate each
+	 * message, acquire references, and stage the message. From here on,
+	 * we must not error out, anymore. Staging and committing is still done
+	 * under the local lock, so all transactions of a peer are ordered.
+	 */
+	while (mlist) {
+		m = container_of(mlist, struct bus1_message, qnode);
+		mlist = m->qnode.next;
+		m->qnode.next = NULL;
+
+		/* this consumes @m and @m->qnode.owner */
+		bus1_message_stage(m, &tx);
+	}
+
+	bus1_tx_commit(&tx);
+	WRITE_ONCE(peer->local.n_sends, peer->local.n_sends + 1);
+	r = 0;
+
+exit:
+	while (mlist) {
+		m = container_of(mlist, struct bus1_message, qnode);
+		mlist = m->qnode.next;
+		m->qnode.next = NULL;
+
+		p = m->qnode.owner;
+		m->dst->tlink = NULL;
+
+		bus1_handle_forget(m->dst);
+		bus1_message_unref(m);
+		bus1_peer_release(p);
+	}
+	if (factory && factory->blocked) {
+		*blockedp = factory->blocked;
+		*seqp = factory->blocked_seq;
+		factory->blocked = NULL;
+	}
+	bus1_factory_free(factory);
+	mutex_unlock(&peer->local.lock);
+	bus1_tx_deinit(&tx);
+	return r;
+}
+
+static int bus1_peer_wait_room(struct bus1_peer *peer,
+			       struct bus1_peer *dst,
+			       unsigned int seq,
+			       u64 deadline)
+{
+	ktime_t expires = ns_to_ktime(deadline);
+	DEFINE_WAIT(wait_room);
+	DEFINE_WAIT(wait_peer);
+	int r = 0;
+
+	/*
+	 * Wait for @dst to release resources. We also queue on the wait-queue
+	 * of @peer, so a disconnect of @peer kicks us out, just like it does
+	 * for blocking receives. A disconnect of @dst wakes us as well, and
+	 * the retried send reports it.
+	 */
+	for (;;) {
+		prepare_to_wait(&dst->room_waitq, &wait_room,
+				TASK_INTERRUPTIBLE);
+		prepare_to_wait(&peer->waitq, &wait_peer, TASK_INTERRUPTIBLE);
+
+		if (bus1_active_is_deactivated(&peer->active)) {
+			r = -ESHUTDOWN;
+			break;
+		}
+		if (atomic_read(&dst->room_seq) != seq ||
+		    bus1_active_is_deactivated(&dst->active))
+			break;
+		if (signal_pending(current)) {
+			r = -ERESTARTSYS;
+			break;
+		}
+
+		if (deadline == U64_MAX) {
+			schedule();
+		} else if (ktime_get_ns() >= deadline) {
+			r = -ETIME;
+			break;
+		} else {
+			schedule_hrtimeout(&expires, HRTIMER_MODE_ABS);
+		}
+	}
+
+	finish_wait(&peer->waitq, &wait_peer);
+	finish_wait(&dst->room_waitq, &wait_room);
+	return r;
+}
+
+static int bus1_peer_send(struct bus1_peer *peer,
+			  struct bus1_cmd_send *param)
+{
+	struct bus1_peer *blocked = NULL;
+	struct bus1_cmd_send attempt;
+	u64 now, deadline = 0;
+	unsigned int seq;
+	int r, w;
+
+	for (;;) {
+		/* a send to a set rewrites @param, so retry on a copy */
+		attempt = *param;
+		r = bus1_peer_send_once(peer, &attempt, &blocked, &seq);
+		if (!blocked || !(param->flags & BUS1_SEND_FLAG_WAIT))
+			break;
+
+		if (!deadline) {
+			/* timeouts beyond the range of ktime_t are unlimited */
+			now = ktime_get_ns();
+			mutex_lock(&peer->local.lock);
+			if (!peer->local.send_timeout_ns ||
+			    peer->local.send_timeout_ns > KTIME_MAX - now)
+				deadline = U64_MAX;
+			else
+				deadline = now + peer->local.send_timeout_ns;
+			mutex_unlock(&peer->local.lock);
+		}
+
+		/* on timeout, report why the send failed */
+		w = bus1_peer_wait_room(peer, blocked, seq, deadline);
+		if (w < 0) {
+			if (w != -ETIME)
+				r = w;
+			break;
+		}
+
+		blocked = bus1_peer_release(blocked);
+	}
+
+	if (blocked) {
+		mutex_lock(&peer->local.lock);
+		bus1_peer_block(peer, blocked, seq);
+		mutex_unlock(&peer->local.lock);
+		bus1_peer_release(blocked);
+	}
+
+	return r;
+}
+
+static int bus1_peer_ioctl_send(struct bus1_peer *peer,
+				unsigned long arg)
+{
+	struct bus1_cmd_send param;
+
+	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_SEND) != sizeof(param));
+
+	if (copy_from_user(&param, (void __user *)arg, sizeof(param)))
+		return -EFAULT;
+
+	return bus1_peer_send(peer, &param);
+}
+
+static int bus1_peer_ioctl_set_register(struct bus1_peer *peer,
+					unsigned long arg)
+{
+	struct bus1_cmd_set_register __user *uparam = (void __user *)arg;
+	const u64 __user *ptr_destinations;
+	struct bus1_cmd_set_register param;
+	struct bus1_peer_set *set;
+	size_t i, length;
+	struct bus1_handle *h;
+	bool is_new;
+	int r, id;
+	u64 dst;
+
+	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_SET_REGISTER) != sizeof(param));
+
+	if (copy_from_user(&param, uparam, sizeof(param)))
+		return -EFAULT;
+	if (unlikely(param.flags))
+		return -EINVAL;
 	if (unlikely(param.ptr_destinations !=
 		     (u64)(unsigned long)param.ptr_destinations) ||
-	    unlikely(param.ptr_errors !=
-		     (u64)(unsigned long)param.ptr_errors) ||
-	    unlikely(param.ptr_vecs !=
-		     (u64)(unsigned long)param.ptr_vecs) ||
-	    unlikely(param.ptr_handles !=
-		     (u64)(unsigned long)param.ptr_handles) ||
-	    unlikely(param.ptr_fds !=
-		     (u64)(unsigned long)param.ptr_fds))
+	    unlikely(param.ptr_vecs != (u64)(unsigned long)param.ptr_vecs))
 		return -EFAULT;
+	if (unlikely(param.n_destinations < 1 ||
+		     param.n_destinations > peer->user->limits.max_handles))
+		return -EINVAL;
+	if (unlikely(param.n_vecs > UIO_MAXIOV))
+		return -EMSGSIZE;
 
-	mutex_lock(&peer->local.lock);
+	set = bus1_peer_set_new(param.n_destinations, param.n_vecs);
+	if (IS_ERR(set))
+		return PTR_ERR(set);
+
+	r = bus1_import_vecs(set->vecs, &length,
+			     (const void __user *)(unsigned long)param.ptr_vecs,
+			     set->n_vecs);
+	if (r < 0)
+		goto exit;
 
-	bus1_tx_init(&tx, peer);
 	ptr_destinations =
 		(const u64 __user *)(unsigned long)param.ptr_destinations;
 
-	if (unlikely(param.n_destinations > peer->user->limits.max_handles)) {
-		r = -EINVAL;
-		goto exit;
+	mutex_lock(&peer->local.lock);
+
+	/*
+	 * Resolve and pin all destinations once. Like a send, this requires
+	 * every destination to be unique. Unlike a send, it does not create
+	 * new nodes, since the set would be the only user of them.
+	 */
+	while (set->n_handles < param.n_destinations) {
+		if (get_user(dst, ptr_destinations + set->n_handles)) {
+			r = -EFAULT;
+			break;
+		}
+
+		h = bus1_handle_import(peer, dst, &is_new);
+		if (IS_ERR(h)) {
+			r = PTR_ERR(h);
+			break;
+		}
+		if (is_new || h->tlink) {
+			r = is_new ? -ENXIO : -ENOTUNIQ;
+			if (is_new)
+				bus1_handle_forget(h);
+			bus1_handle_unref(h);
+			break;
+		}
+
+		h->tlink = BUS1_TAIL;
+		set->handles[set->n_handles++] = h;
+	}
+
+	/* the duplicate markers are only valid under the lock */
+	for (i = 0; i < set->n_handles; ++i)
+		set->handles[i]->tlink = NULL;
+
+	if (r >= 0) {
+		id = idr_alloc(&peer->local.sets, set, 1,
+			       BUS1_PEER_SETS_MAX + 1, GFP_KERNEL);
+		if (id < 0) {
+			r = id == -ENOSPC ? -EDQUOT : id;
+		} else if (put_user(id, &uparam->set_id)) {
+			idr_remove(&peer->local.sets, id);
+			r = -EFAULT;
+		} else {
+			set = NULL;
+		}
+	}
+
+	mutex_unlock(&peer->local.lock);
+
+exit:
+	bus1_peer_set_free(set);
+	return r;
+}
+
+static int bus1_peer_ioctl_set_unregister(struct bus1_peer *peer,
+					  unsigned long arg)
+{
+	struct bus1_peer_set *set;
+	u64 id;
+
+	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_SET_UNREGISTER) != sizeof(id));
+
+	if (get_user(id, (const u64 __user *)arg))
+		return -EFAULT;
+	if (id > INT_MAX)
+		return -ENXIO;
+
+	mutex_lock(&peer->local.lock);
+	set = idr_find(&peer->local.sets, id);
+	if (set)
+		idr_remove(&peer->local.sets, id);
+	mutex_unlock(&peer->local.lock);
+
+	if (!set)
+		return -ENXIO;
+
+	bus1_peer_set_free(set);
+	return 0;
+}
+
+static struct bus1_queue_node *bus1_peer_peek(struct bus1_peer *peer,
+					      struct bus1_queue_node *prev,
+					      u64 destination,
+					      bool *morep)
+{
+	struct bus1_queue_node *qnode, *next, *dropped = NULL;
+	struct bus1_message *m;
+	struct bus1_handle *h;
+	u64 ts, id;
+
+	lockdep_assert_held(&peer->local.lock);
+
+	mutex_lock(&peer->data.lock);
+
+	/*
+	 * If the caller consumed a data message, it is still queued. Remove it
+	 * in the same critical section we use to peek at the next entry, so
+	 * batched receives only take the data lock once per message. The
+	 * caller is responsible for releasing @prev afterwards.
+	 */
+	if (prev) {
+		trace_bus1_queue_remove(peer, prev);
+		bus1_queue_remove(&peer->data.queue, &peer->waitq, prev);
+	}
+
+	qnode = bus1_queue_peek(&peer->data.queue, morep);
+	while (qnode) {
+		switch (bus1_queue_node_get_type(qnode)) {
+		case BUS1_MSG_DATA:
+			m = container_of(qnode, struct bus1_message, qnode);
+			h = m->dst;
+			break;
+		case BUS1_MSG_NODE_DESTROY:
+		case BUS1_MSG_NODE_RELEASE:
+			m = NULL;
+			h = container_of(qnode, struct bus1_handle, qnode);
+			break;
+		case BUS1_MSG_NONE:
+		default:
+			WARN(1, "Unknown message type\n");
+			qnode = ERR_PTR(-ENOTRECOVERABLE);
+			goto exit;
+		}
+
+		/*
+		 * Drop stale entries and continue with their successor, so a
+		 * destination filter walks the queue only once. Dropped
+		 * messages take the data lock when freed, hence they are only
+		 * released once we are done.
+		 */
+		ts = bus1_queue_node_get_timestamp(qnode);
+		if (ts <= peer->data.queue.flush ||
+		    !bus1_handle_is_public(h) ||
+		    !bus1_handle_is_live_at(h, ts)) {
+			next = bus1_queue_peek_next(&peer->data.queue, qnode,
+						    morep);
+			trace_bus1_queue_remove(peer, qnode);
+			bus1_queue_remove(&peer->data.queue, &peer->waitq,
+					  qnode);
+			if (m) {
+				qnode->next = dropped;
+				dropped = qnode;
+			} else {
+				bus1_handle_unref(h);
+			}
+
+			qnode = next;
+			continue;
+		}
+
+		/*
+		 * If the caller only asked for entries of a single destination,
+		 * skip anything else. Skipped entries stay queued in order, so
+		 * other receivers still see them as before. There is no index
+		 * by destination, so this walk is linear in the number of
+		 * skipped entries, and it runs under the data lock, which
+		 * stalls senders to this peer meanwhile.
+		 */
+		id = m ? h->anchor->id : h->id;
+		if (destination != BUS1_HANDLE_INVALID && destination != id) {
+			qnode = bus1_queue_peek_next(&peer->data.queue, qnode,
+						     morep);
+			continue;
+		}
+
+		if (!m) {
+			trace_bus1_queue_remove(peer, qnode);
+			bus1_queue_remove(&peer->data.queue, &peer->waitq,
+					  qnode);
+		}
+
+		break;
+	}
+
+exit:
+	mutex_unlock(&peer->data.lock);
+
+	while (dropped) {
+		m = container_of(dropped, struct bus1_message, qnode);
+		dropped = m->qnode.next;
+		m->qnode.next = NULL;
+		bus1_message_unref(m);
+	}
+
+	return qnode ?: ERR_PTR(-EAGAIN);
+}
+
+static bool bus1_peer_is_readable(struct bus1_peer *peer)
+{
+	bool readable;
+
+	/* access queue->front unlocked, just like bus1_fop_poll() */
+	rcu_read_lock();
+	readable = bus1_queue_is_readable_rcu(&peer->data.queue) ||
+		   bus1_active_is_deactivated(&peer->active);
+	rcu_read_unlock();
+
+	return readable;
+}
+
+static int bus1_peer_wait(struct bus1_peer *peer, u64 busy_until, u64 deadline)
+{
+	ktime_t expires = ns_to_ktime(deadline);
+	DEFINE_WAIT(wait);
+	int r = 0;
+
+	/*
+	 * Spin on the queue front until it becomes readable or the busy-poll
+	 * period ends. This only reads shared state, so it does not disturb
+	 * the senders. We stop early if the scheduler wants the CPU back, or
+	 * a signal is pending, and fall back to sleeping.
+	 */
+	while (!bus1_peer_is_readable(peer)) {
+		if (need_resched() || signal_pending(current) ||
+		    ktime_get_ns() >= busy_until)
+			break;
+		cpu_relax();
+	}
+
+	/*
+	 * Receivers wait exclusively, so a new message wakes only one of them,
+	 * see bus1_peer_wake(). If we give up while the queue is readable, we
+	 * might have consumed the wake-up meant for it, so pass it on.
+	 */
+	for (;;) {
+		prepare_to_wait_exclusive(&peer->waitq, &wait,
+					  TASK_INTERRUPTIBLE);
+
+		if (bus1_peer_is_readable(peer))
+			break;
+		if (signal_pending(current)) {
+			r = -ERESTARTSYS;
+			break;
+		}
+
+		if (deadline == U64_MAX) {
+			schedule();
+		} else if (ktime_get_ns() >= deadline) {
+			r = -EAGAIN;
+			break;
+		} else {
+			schedule_hrtimeout(&expires, HRTIMER_MODE_ABS);
+		}
+	}
+
+	finish_wait(&peer->waitq, &wait);
+
+	if (r < 0) {
+		if (bus1_peer_is_readable(peer))
+			bus1_peer_wake(peer);
+		return r;
+	}
+	if (bus1_active_is_deactivated(&peer->active))
+		return -ESHUTDOWN;
+
+	return 0;
+}
+
+/*
+ * A receiver woken up for @qnode consumed the exclusive wake-up of the queue.
+ * If more entries are ready behind @qnode, wake up the next receiver as well.
+ */
+static void bus1_peer_wake_next(struct bus1_peer *peer,
+				struct bus1_queue_node *qnode)
+{
+	struct bus1_queue_node *next;
+	bool more;
+
+	mutex_lock(&peer->data.lock);
+	/* data messages are still queued, notifications are dequeued */
+	if (bus1_queue_node_get_type(qnode) == BUS1_MSG_DATA)
+		next = bus1_queue_peek_next(&peer->data.queue, qnode, &more);
+	else
+		next = bus1_queue_peek(&peer->data.queue, &more);
+	mutex_unlock(&peer->data.lock);
+
+	if (next)
+		bus1_peer_wake(peer);
+}
+
+/*
+ * Peek at the front of the queue, and wait for it to become readable if it is
+ * not. If @releasep points to a message, it is dropped before going to sleep,
+ * so a released slice never stays charged while the caller waits for more.
+ */
+static struct bus1_queue_node *
+bus1_peer_peek_wait(struct bus1_peer *peer,
+		    struct bus1_message **releasep,
+		    bool *morep)
+{
+	struct bus1_queue_node *qnode;
+	u64 now, busy_until, deadline;
+	int r;
+
+	lockdep_assert_held(&peer->local.lock);
+
+	qnode = bus1_peer_peek(peer, NULL, BUS1_HANDLE_INVALID, morep);
+	if (qnode != ERR_PTR(-EAGAIN))
+		return qnode;
+
+	/* timeouts beyond the range of ktime_t are treated as unlimited */
+	now = ktime_get_ns();
+	busy_until = now + peer->local.recv_busy_poll_ns;
+	if (!peer->local.recv_timeout_ns ||
+	    peer->local.recv_timeout_ns > KTIME_MAX - now)
+		deadline = U64_MAX;
+	else
+		deadline = now + peer->local.recv_timeout_ns;
+
+	/*
+	 * The local lock must not be held while waiting, otherwise any other
+	 * operation on this peer would stall. Hence, another receiver might
+	 * dequeue the message we were woken up for, in which case we simply
+	 * go back to sleep until the deadline is reached.
+	 */
+	do {
+		mutex_unlock(&peer->local.lock);
+		if (releasep)
+			*releasep = bus1_message_unref(*releasep);
+		r = bus1_peer_wait(peer, busy_until, deadline);
+		mutex_lock(&peer->local.lock);
+		if (r < 0)
+			return ERR_PTR(r);
+
+		*morep = false;
+		qnode = bus1_peer_peek(peer, NULL, BUS1_HANDLE_INVALID, morep);
+	} while (qnode == ERR_PTR(-EAGAIN));
+
+	if (!IS_ERR(qnode))
+		bus1_peer_wake_next(peer, qnode);
+
+	return qnode;
+}
+
+/*
+ * Coalesce the node notification @h, which was already dequeued, with the
+ * notifications of the same type committed in the same group, that is, by the
+ * same transaction, or as back-to-back releases (see
+ * bus1_queue_commit_grouped()). Their IDs are delivered as payload of a
+ * single message in the pool. Entries of other types stay queued; a message
+ * never spans more than one group. Nothing is allocated unless at least one
+ * entry follows, and nothing else is dequeued unless the message is ready, so
+ * on failure @h is simply delivered on its own. Entries a receive would drop
+ * are dropped along the way.
+ *
+ * Return: True if @msg describes the coalesced message, false if not.
+ */
+static bool bus1_peer_coalesce(struct bus1_peer *peer,
+			       struct bus1_handle *h,
+			       unsigned int type,
+			       u64 max_offset,
+			       struct bus1_msg *msg,
+			       bool *morep)
+{
+	struct bus1_queue_node *qnode, *next;
+	struct bus1_message *m = NULL;
+	struct bus1_handle *t;
+	size_t i, n_walk, n_ids;
+	struct kvec vec;
+	u64 *ids = NULL;
+	void *group;
+	bool more;
+	u64 ts;
+	int r;
+
+	lockdep_assert_held(&peer->local.lock);
+
+	/* nothing of the same group follows, no need to coalesce */
+	if (!*morep)
+		return false;
+
+	mutex_lock(&peer->data.lock);
+
+	/* a release notification might have been re-queued meanwhile */
+	if (bus1_queue_node_is_queued(&h->qnode))
+		goto error;
+
+	ts = bus1_queue_node_get_timestamp(&h->qnode);
+	group = h->qnode.group;
+
+	/* count the entries of the same type in the group at the front */
+	n_walk = 0;
+	qnode = bus1_queue_peek(&peer->data.queue, &more);
+	while (qnode && n_walk < BUS1_PEER_COALESCE_MAX - 1 &&
+	       !bus1_queue_compare(bus1_queue_node_get_timestamp(qnode),
+				   qnode->group, ts, group)) {
+		if (bus1_queue_node_get_type(qnode) == type)
+			++n_walk;
+		qnode = bus1_queue_peek_next(&peer->data.queue, qnode, &more);
 	}
+	if (!n_walk)
+		goto error;
 
-	factory = bus1_factory_new(peer, &param, stack, sizeof(stack));
-	if (IS_ERR(factory)) {
-		r = PTR_ERR(factory);
-		factory = NULL;
-		goto exit;
+	m = bus1_message_new_notification(peer);
+	if (IS_ERR(m)) {
+		m = NULL;
+		goto error;
 	}
 
-	if (param.flags & BUS1_SEND_FLAG_SEED) {
-		if (unlikely((param.flags & BUS1_SEND_FLAG_CONTINUE) ||
-			     param.n_destinations)) {
-			r = -EINVAL;
-			goto exit;
-		}
+	ids = kmalloc_array(n_walk + 1, sizeof(*ids), GFP_TEMPORARY);
+	if (!ids)
+		goto error;
 
-		/* XXX: set seed */
-		r = -ENOTSUPP;
-		goto exit;
-	} else {
-		for (i = 0; i < param.n_destinations; ++i) {
-			if (get_user(id, ptr_destinations + i)) {
-				r = -EFAULT;
-				goto exit;
-			}
+	ids[0] = h->id;
+	n_ids = 1;
+	qnode = bus1_queue_peek(&peer->data.queue, &more);
+	for (i = 0; i < n_walk; ) {
+		if (bus1_queue_node_get_type(qnode) == type) {
+			t = container_of(qnode, struct bus1_handle, qnode);
+			if (ts > peer->data.queue.flush &&
+			    bus1_handle_is_public(t) &&
+			    bus1_handle_is_live_at(t, ts))
+				ids[n_ids++] = t->id;
+			++i;
+		}
+		qnode = bus1_queue_peek_next(&peer->data.queue, qnode, &more);
+	}
 
-			m = bus1_peer_new_message(peer, factory, id);
-			if (IS_ERR(m)) {
-				r = PTR_ERR(m);
-				goto exit;
-			}
+	r = bus1_pool_alloc(&peer->data.pool, &m->slice,
+			    n_ids * sizeof(*ids));
+	trace_bus1_pool_alloc(peer, &m->slice, n_ids * sizeof(*ids), r);
+	if (r < 0 || max_offset < m->slice.offset + m->slice.size)
+		goto error;
 
-			if (!bus1_handle_is_public(m->dst))
-				++n_charge;
+	vec.iov_base = ids;
+	vec.iov_len = n_ids * sizeof(*ids);
+	r = bus1_pool_write_kvec(&peer->data.pool, &m->slice, 0, &vec, 1,
+				 vec.iov_len);
+	if (r < 0)
+		goto error;
 
-			m->qnode.next = mlist;
-			mlist = &m->qnode;
+	/* the message is ready, dequeue everything that was counted */
+	qnode = bus1_queue_peek(&peer->data.queue, &more);
+	for (i = 0; i < n_walk; ) {
+		next = bus1_queue_peek_next(&peer->data.queue, qnode, &more);
+		if (bus1_queue_node_get_type(qnode) == type) {
+			t = container_of(qnode, struct bus1_handle, qnode);
+			trace_bus1_queue_remove(peer, qnode);
+			bus1_queue_remove(&peer->data.queue, &peer->waitq,
+					  qnode);
+			bus1_handle_unref(t);
+			++i;
 		}
+		qnode = next;
+	}
 
-		r = bus1_factory_seal(factory);
-		if (r < 0)
-			goto exit;
+	/* anything left of the group is reported as continuation */
+	qnode = bus1_queue_peek(&peer->data.queue, &more);
+	*morep = qnode &&
+		 !bus1_queue_compare(bus1_queue_node_get_timestamp(qnode),
+				     qnode->group, ts, group);
 
-		/*
-		 * Now everything is prepared, charged, and pinned. Iterate
-		 * each message, acquire references, and stage the message.
-		 * From here on, we must not error out, anymore.
-		 */
+	mutex_unlock(&peer->data.lock);
+	kfree(ids);
 
-		while (mlist) {
-			m = container_of(mlist, struct bus1_message, qnode);
-			mlist = m->qnode.next;
-			m->qnode.next = NULL;
-
-			if (!bus1_handle_is_public(m->dst)) {
-				--factory->n_handles_charge;
-				WARN_ON(m->dst != bus1_handle_acquire(m->dst,
-								      false));
-				WARN_ON(atomic_inc_return(&m->dst->n_user)
-									!= 1);
-			}
+	/* the pool owns a reference to published slices */
+	m->n_bytes = n_ids * sizeof(*ids);
+	bus1_message_ref(m);
+	bus1_pool_publish(&m->slice);
 
-			m->dst->tlink = NULL;
+	msg->type = type;
+	msg->flags = m->flags;
+	msg->destination = BUS1_HANDLE_INVALID;
+	msg->offset = m->slice.offset;
+	msg->n_bytes = m->n_bytes;
+	msg->n_handles = 0;
+	msg->n_fds = 0;
 
-			/* this consumes @m and @m->qnode.owner */
-			bus1_message_stage(m, &tx);
-		}
+	bus1_message_unref(m);
+	return true;
 
-		WARN_ON(factory->n_handles_charge != 0);
-		bus1_tx_commit(&tx);
-	}
+error:
+	if (m)
+		bus1_pool_dealloc(&peer->data.pool, &m->slice);
+	mutex_unlock(&peer->data.lock);
+	kfree(ids);
+	bus1_message_unref(m);
+	return false;
+}
 
-	r = 0;
+/*
+ * Move the payload of the inlined message @m into a new pool slice, for
+ * receivers that provided no buffer for inlined payloads. The message was
+ * charged a slice already, so only the pool space is allocated. On success,
+ * @m is delivered like any other message, and released via its slice.
+ */
+static int bus1_peer_uninline(struct bus1_peer *peer, struct bus1_message *m)
+{
+	struct kvec vec;
+	size_t size;
+	int r;
 
-exit:
-	while (mlist) {
-		m = container_of(mlist, struct bus1_message, qnode);
-		mlist = m->qnode.next;
-		m->qnode.next = NULL;
+	lockdep_assert_held(&peer->local.lock);
 
-		p = m->qnode.owner;
-		m->dst->tlink = NULL;
+	size = max_t(size_t, 8, ALIGN(m->n_bytes, 8));
+	mutex_lock(&peer->data.lock);
+	r = bus1_pool_alloc(&peer->data.pool, &m->slice, size);
+	mutex_unlock(&peer->data.lock);
+	trace_bus1_pool_alloc(peer, &m->slice, size, r);
+	if (r < 0)
+		return r;
 
-		bus1_handle_forget(m->dst);
-		bus1_message_unref(m);
-		bus1_peer_release(p);
+	vec.iov_base = bus1_message_inline_data(m);
+	vec.iov_len = m->n_bytes;
+	r = bus1_pool_write_kvec(&peer->data.pool, &m->slice, 0, &vec, 1,
+				 vec.iov_len);
+	if (r < 0) {
+		mutex_lock(&peer->data.lock);
+		bus1_pool_dealloc(&peer->data.pool, &m->slice);
+		mutex_unlock(&peer->data.lock);
+		return r;
 	}
-	bus1_factory_free(factory);
-	bus1_tx_deinit(&tx);
-	mutex_unlock(&peer->local.lock);
-	return r;
+
+	m->inlined = false;
+	return 0;
 }
 
-static struct bus1_queue_node *bus1_peer_peek(struct bus1_peer *peer,
-					      bool *morep)
+static int bus1_peer_fill_msg(struct bus1_peer *peer,
+			      struct bus1_queue_node *qnode,
+			      u64 flags,
+			      u64 max_offset,
+			      struct bus1_msg *msg,
+			      u8 *data,
+			      bool *morep)
 {
-	struct bus1_queue_node *qnode;
 	struct bus1_message *m;
 	struct bus1_handle *h;
-	u64 ts;
+	unsigned int type;
+	int r;
 
 	lockdep_assert_held(&peer->local.lock);
 
-	mutex_lock(&peer->data.lock);
-	while ((qnode = bus1_queue_peek(&peer->data.queue, morep))) {
-		switch (bus1_queue_node_get_type(qnode)) {
-		case BUS1_MSG_DATA:
-			m = container_of(qnode, struct bus1_message, qnode);
-			h = m->dst;
-			break;
-		case BUS1_MSG_NODE_DESTROY:
-		case BUS1_MSG_NODE_RELEASE:
-			m = NULL;
-			h = container_of(qnode, struct bus1_handle, qnode);
+	/*
+	 * Data messages are installed into the caller, but are left queued.
+	 * The caller dequeues them once the descriptor was copied. Node
+	 * notifications were already dequeued by bus1_peer_peek(), hence we
+	 * consume them right here, possibly along with the notifications
+	 * behind them. Inlined messages have nothing to install, their payload
+	 * is copied into @data. Without @data, they are moved into the pool.
+	 */
+
+	type = bus1_queue_node_get_type(qnode);
+	switch (type) {
+	case BUS1_MSG_DATA:
+		m = container_of(qnode, struct bus1_message, qnode);
+		WARN_ON(m->dst->anchor->id == BUS1_HANDLE_INVALID);
+
+		if (m->inlined && !data) {
+			r = bus1_peer_uninline(peer, m);
+			if (r < 0)
+				return r;
+		}
+
+		if (m->inlined) {
+			memcpy(data, bus1_message_inline_data(m), m->n_bytes);
+
+			msg->type = BUS1_MSG_DATA;
+			msg->flags = m->flags | BUS1_MSG_FLAG_INLINE;
+			msg->destination = m->dst->anchor->id;
+			msg->offset = BUS1_OFFSET_INVALID;
+			msg->n_bytes = m->n_bytes;
+			msg->n_handles = 0;
+			msg->n_fds = 0;
 			break;
-		case BUS1_MSG_NONE:
-		default:
-			mutex_unlock(&peer->data.lock);
-			WARN(1, "Unknown message type\n");
-			return ERR_PTR(-ENOTRECOVERABLE);
 		}
 
-		ts = bus1_queue_node_get_timestamp(qnode);
-		if (ts <= peer->data.queue.flush ||
-		    !bus1_handle_is_public(h) ||
-		    !bus1_handle_is_live_at(h, ts)) {
-			bus1_queue_remove(&peer->data.queue, &peer->waitq,
-					  qnode);
-			if (m) {
-				mutex_unlock(&peer->data.lock);
-				bus1_message_unref(m);
-				mutex_lock(&peer->data.lock);
-			} else {
-				bus1_handle_unref(h);
-			}
+		if (max_offset < m->slice.offset + m->slice.size)
+			return -ERANGE;
 
-			continue;
+		r = bus1_message_install(m, flags & BUS1_RECV_FLAG_INSTALL_FDS);
+		if (r < 0)
+			return r;
+
+		/* keep the files for BUS1_CMD_SLICE_INSTALL_FDS, if asked */
+		m->pin_files = !!(flags & BUS1_RECV_FLAG_KEEP_FDS);
+
+		msg->type = BUS1_MSG_DATA;
+		msg->flags = m->flags;
+		msg->destination = m->dst->anchor->id;
+		msg->offset = m->slice.offset;
+		msg->n_bytes = m->n_bytes;
+		msg->n_handles = m->n_handles;
+		msg->n_fds = m->n_files;
+		break;
+	case BUS1_MSG_NODE_DESTROY:
+	case BUS1_MSG_NODE_RELEASE:
+		h = container_of(qnode, struct bus1_handle, qnode);
+		WARN_ON(h->id == BUS1_HANDLE_INVALID);
+
+		/* entries picked by destination are never coalesced */
+		if ((READ_ONCE(peer->flags) & BUS1_PEER_FLAG_NOTIFY_COALESCE) &&
+		    !(flags & BUS1_RECV_FLAG_DESTINATION) &&
+		    bus1_peer_coalesce(peer, h, type, max_offset, msg, morep)) {
+			bus1_handle_unref(h);
+			break;
 		}
 
-		if (!m)
-			bus1_queue_remove(&peer->data.queue, &peer->waitq,
-					  qnode);
+		msg->type = type;
+		msg->flags = 0;
+		msg->destination = h->id;
+		msg->offset = BUS1_OFFSET_INVALID;
+		msg->n_bytes = 0;
+		msg->n_handles = 0;
+		msg->n_fds = 0;
 
+		bus1_handle_unref(h);
 		break;
+	case BUS1_MSG_NONE:
+	default:
+		WARN(1, "Unknown message type\n");
+		return -ENOTRECOVERABLE;
 	}
+
+	return 0;
+}
+
+/*
+ * A descriptor that could not be copied to user-space never tells the caller
+ * about the slice it describes, so nobody would ever release it. Unpublish the
+ * slice at @offset again, if any. The pool reference is handed to the caller,
+ * which must drop it once the local lock was released.
+ */
+static struct bus1_message *bus1_peer_unpublish(struct bus1_peer *peer,
+						u64 offset)
+{
+	struct bus1_pool_slice *slice;
+
+	lockdep_assert_held(&peer->local.lock);
+
+	if (offset == BUS1_OFFSET_INVALID)
+		return NULL;
+
+	mutex_lock(&peer->data.lock);
+	slice = bus1_pool_slice_find_published(&peer->data.pool, offset);
 	mutex_unlock(&peer->data.lock);
+	if (!slice)
+		return NULL;
 
-	return qnode ?: ERR_PTR(-EAGAIN);
+	bus1_pool_unpublish(slice);
+	return container_of(slice, struct bus1_message, slice);
 }
 
 static int bus1_peer_ioctl_recv(struct bus1_peer *peer,
 				unsigned long arg)
 {
+	struct bus1_cmd_recv __user *uparam = (void __user *)arg;
+	struct bus1_message *m, *released = NULL, *unpublished = NULL;
+	unsigned int type = BUS1_MSG_NONE;
 	struct bus1_queue_node *qnode = NULL;
+	struct bus1_pool_slice *slice;
 	struct bus1_cmd_recv param;
-	struct bus1_message *m;
-	struct bus1_handle *h;
-	unsigned int type;
-	bool more = false;
+	bool more = false, release = false;
+	u64 ts = 0;
 	int r;
 
 	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_RECV) != sizeof(param));
 
-	if (copy_from_user(&param, (void __user *)arg, sizeof(param)))
+	if (copy_from_user(&param, uparam, sizeof(param)))
 		return -EFAULT;
 	if (unlikely(param.flags & ~(BUS1_RECV_FLAG_SEED |
-				     BUS1_RECV_FLAG_INSTALL_FDS)))
+				     BUS1_RECV_FLAG_INSTALL_FDS |
+				     BUS1_RECV_FLAG_KEEP_FDS |
+				     BUS1_RECV_FLAG_WAIT |
+				     BUS1_RECV_FLAG_DESTINATION |
+				     BUS1_RECV_FLAG_RELEASE)))
+		return -EINVAL;
+	/* wake-ups are per peer, not per destination */
+	if (unlikely((param.flags & BUS1_RECV_FLAG_WAIT) &&
+		     (param.flags & BUS1_RECV_FLAG_DESTINATION)))
 		return -EINVAL;
 
 	mutex_lock(&peer->local.lock);
 
+	/*
+	 * Consumers usually release the slice of the previous message right
+	 * before receiving the next one. If asked to, do this in the same
+	 * critical section. The descriptor still carries the offset of the
+	 * previous message, if the caller re-uses it. Like with
+	 * BUS1_CMD_SLICE_RELEASE, the message is only dropped once the local
+	 * lock was released. That is, at the end, or when going to sleep,
+	 * since its release might be what a blocked sender waits for.
+	 */
+	if ((param.flags & BUS1_RECV_FLAG_RELEASE) &&
+	    param.msg.offset != BUS1_OFFSET_INVALID) {
+		mutex_lock(&peer->data.lock);
+		slice = bus1_pool_slice_find_published(&peer->data.pool,
+						       param.msg.offset);
+		mutex_unlock(&peer->data.lock);
+		if (!slice) {
+			r = -ENXIO;
+			goto exit;
+		}
+
+		bus1_pool_unpublish(slice);
+		released = container_of(slice, struct bus1_message, slice);
+		release = true;
+	}
+
 	if (unlikely(param.flags & BUS1_RECV_FLAG_SEED)) {
 		if (!peer->local.seed) {
 			r = -EAGAIN;
@@ -1008,7 +2609,14 @@ static int bus1_peer_ioctl_recv(struct bus1_peer *peer,
 
 		qnode = &peer->local.seed->qnode;
 	} else {
-		qnode = bus1_peer_peek(peer, &more);
+		if (param.flags & BUS1_RECV_FLAG_WAIT)
+			qnode = bus1_peer_peek_wait(peer, &released, &more);
+		else if (param.flags & BUS1_RECV_FLAG_DESTINATION)
+			qnode = bus1_peer_peek(peer, NULL,
+					       param.msg.destination, &more);
+		else
+			qnode = bus1_peer_peek(peer, NULL, BUS1_HANDLE_INVALID,
+					       &more);
 		if (IS_ERR(qnode)) {
 			r = PTR_ERR(qnode);
 			goto exit;
@@ -1016,75 +2624,168 @@ static int bus1_peer_ioctl_recv(struct bus1_peer *peer,
 	}
 
 	type = bus1_queue_node_get_type(qnode);
-	switch (type) {
-	case BUS1_MSG_DATA:
-		m = container_of(qnode, struct bus1_message, qnode);
-		WARN_ON(m->dst->anchor->id == BUS1_HANDLE_INVALID);
-
-		if (param.max_offset < m->slice.offset + m->slice.size) {
-			r = -ERANGE;
-			goto exit;
-		}
-
-		r = bus1_message_install(m,
-				param.flags & BUS1_RECV_FLAG_INSTALL_FDS);
-		if (r < 0)
-			goto exit;
-
-		param.msg.type = BUS1_MSG_DATA;
-		param.msg.flags = m->flags;
-		param.msg.destination = m->dst->anchor->id;
-		param.msg.offset = m->slice.offset;
-		param.msg.n_bytes = m->n_bytes;
-		param.msg.n_handles = m->n_handles;
-		param.msg.n_fds = m->n_files;
+	ts = bus1_queue_node_get_timestamp(qnode);
+	r = bus1_peer_fill_msg(peer, qnode, param.flags, param.max_offset,
+			       &param.msg, NULL, &more);
+	if (r < 0)
+		goto exit;
 
+	if (type == BUS1_MSG_DATA) {
+		m = container_of(qnode, struct bus1_message, qnode);
 		if (unlikely(param.flags & BUS1_RECV_FLAG_SEED)) {
 			peer->local.seed = NULL;
 		} else {
 			mutex_lock(&peer->data.lock);
+			trace_bus1_queue_remove(peer, qnode);
 			bus1_queue_remove(&peer->data.queue,
 					  &peer->waitq, qnode);
 			mutex_unlock(&peer->data.lock);
 		}
 		bus1_message_deinit(m);
 		bus1_message_unref(m);
-		break;
-	case BUS1_MSG_NODE_DESTROY:
-	case BUS1_MSG_NODE_RELEASE:
-		h = container_of(qnode, struct bus1_handle, qnode);
-		WARN_ON(h->id == BUS1_HANDLE_INVALID);
-
-		param.msg.type = type;
-		param.msg.flags = 0;
-		param.msg.destination = h->id;
-		param.msg.offset = BUS1_OFFSET_INVALID;
-		param.msg.n_bytes = 0;
-		param.msg.n_handles = 0;
-		param.msg.n_fds = 0;
-
-		bus1_handle_unref(h);
-		break;
-	case BUS1_MSG_NONE:
-	default:
-		WARN(1, "Unknown message type\n");
-		r = -ENOTRECOVERABLE;
-		goto exit;
 	}
 
-	if (more)
+	/* the rest of the transaction is usually filtered, do not hint it */
+	if (more && !(param.flags & BUS1_RECV_FLAG_DESTINATION))
 		param.msg.flags |= BUS1_MSG_FLAG_CONTINUE;
 
-	if (copy_to_user((void __user *)arg, &param, sizeof(param)))
+	if (copy_to_user(uparam, &param, sizeof(param))) {
+		unpublished = bus1_peer_unpublish(peer, param.msg.offset);
 		r = -EFAULT;
-	else
+	} else {
+		WRITE_ONCE(peer->local.n_recvs, peer->local.n_recvs + 1);
 		r = 0;
+	}
 
 exit:
 	mutex_unlock(&peer->local.lock);
+	/* the release sticks, even if there was nothing to receive */
+	if (release && r < 0)
+		put_user(BUS1_OFFSET_INVALID, &uparam->msg.offset);
+	bus1_message_unref(released);
+	bus1_message_unref(unpublished);
+	trace_bus1_peer_recv(peer, type, ts, r);
 	return r;
 }
 
+static int bus1_peer_ioctl_recv_many(struct bus1_peer *peer,
+				     unsigned long arg)
+{
+	struct bus1_cmd_recv_many __user *uparam = (void __user *)arg;
+	struct bus1_queue_node *qnode, *prev = NULL;
+	struct bus1_cmd_recv_many param;
+	u8 data[BUS1_MSG_INLINE_MAX], __user *ptr_data;
+	struct bus1_msg __user *ptr_msgs;
+	struct bus1_message *m, *unpublished = NULL;
+	struct bus1_msg msg;
+	unsigned int type;
+	bool more;
+	u64 i, n, ts;
+	int r = 0;
+
+	BUILD_BUG_ON(_IOC_SIZE(BUS1_CMD_RECV_MANY) != sizeof(param));
+
+	if (copy_from_user(&param, uparam, sizeof(param)))
+		return -EFAULT;
+	if (unlikely(param.flags & ~(BUS1_RECV_FLAG_INSTALL_FDS |
+				     BUS1_RECV_FLAG_KEEP_FDS |
+				     BUS1_RECV_FLAG_WAIT)))
+		return -EINVAL;
+	if (unlikely(param.ptr_msgs != (u64)(unsigned long)param.ptr_msgs) ||
+	    unlikely(param.ptr_data != (u64)(unsigned long)param.ptr_data))
+		return -EFAULT;
+
+	ptr_msgs = (struct bus1_msg __user *)(unsigned long)param.ptr_msgs;
+	ptr_data = (u8 __user *)(unsigned long)param.ptr_data;
+
+	/*
+	 * Like recvmmsg(2), we silently limit the number of messages that can
+	 * be dequeued in one go, so a single call cannot block the peer-local
+	 * lock for an unbounded amount of time.
+	 */
+	n = min_t(u64, param.n_msgs, UIO_MAXIOV);
+
+	mutex_lock(&peer->local.lock);
+
+	for (i = 0; i < n; ++i) {
+		/*
+		 * Dequeued entries cannot be put back. Hence, make sure the
+		 * descriptor slot is writable before anything is dequeued, so
+		 * a bad buffer ends the batch without losing a message.
+		 */
+		if (clear_user(ptr_msgs + i, sizeof(*ptr_msgs)) ||
+		    (ptr_data && clear_user(ptr_data + i * BUS1_MSG_INLINE_MAX,
+					    BUS1_MSG_INLINE_MAX))) {
+			r = -EFAULT;
+			break;
+		}
+
+		more = false;
+		if (i == 0 && (param.flags & BUS1_RECV_FLAG_WAIT))
+			qnode = bus1_peer_peek_wait(peer, NULL, &more);
+		else
+			qnode = bus1_peer_peek(peer, prev, BUS1_HANDLE_INVALID,
+					       &more);
+		if (prev) {
+			m = container_of(prev, struct bus1_message, qnode);
+			bus1_message_deinit(m);
+			bus1_message_unref(m);
+			prev = NULL;
+		}
+		if (IS_ERR(qnode)) {
+			r = PTR_ERR(qnode);
+			break;
+		}
+
+		type = bus1_queue_node_get_type(qnode);
+		ts = bus1_queue_node_get_timestamp(qnode);
+		r = bus1_peer_fill_msg(peer, qnode, param.flags,
+				       param.max_offset, &msg,
+				       ptr_data ? data : NULL, &more);
+		trace_bus1_peer_recv(peer, type, ts, r);
+		if (r < 0)
+			break;
+
+		if (type == BUS1_MSG_DATA)
+			prev = qnode;
+		if (more)
+			msg.flags |= BUS1_MSG_FLAG_CONTINUE;
+
+		if (copy_to_user(ptr_msgs + i, &msg, sizeof(msg)) ||
+		    ((msg.flags & BUS1_MSG_FLAG_INLINE) &&
+		     copy_to_user(ptr_data + i * BUS1_MSG_INLINE_MAX, data,
+				  msg.n_bytes))) {
+			unpublished = bus1_peer_unpublish(peer, msg.offset);
+			r = -EFAULT;
+			break;
+		}
+	}
+
+	if (prev) {
+		m = container_of(prev, struct bus1_message, qnode);
+		mutex_lock(&peer->data.lock);
+		trace_bus1_queue_remove(peer, prev);
+		bus1_queue_remove(&peer->data.queue, &peer->waitq, prev);
+		mutex_unlock(&peer->data.lock);
+		bus1_message_deinit(m);
+		bus1_message_unref(m);
+	}
+
+	WRITE_ONCE(peer->local.n_recvs, peer->local.n_recvs + i);
+	mutex_unlock(&peer->local.lock);
+	bus1_message_unref(unpublished);
+
+	/*
+	 * Errors are only reported if not a single message was dequeued.
+	 * Otherwise, we return what we got and the next call will report the
+	 * error (if it persists).
+	 */
+	if (i == 0 && r < 0)
+		return r;
+
+	return put_user(i, &uparam->n_msgs) ? -EFAULT : 0;
+}
+
 /**
  * bus1_peer_ioctl() - handle peer ioctls
  * @file:		file the ioctl is called on
@@ -1131,18 +2832,39 @@ long bus1_peer_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		case BUS1_CMD_HANDLE_TRANSFER:
 			r = bus1_peer_ioctl_handle_transfer(peer, arg);
 			break;
+		case BUS1_CMD_HANDLES_RELEASE:
+			r = bus1_peer_ioctl_handles_release(peer, arg);
+			break;
+		case BUS1_CMD_HANDLES_TRANSFER:
+			r = bus1_peer_ioctl_handles_transfer(peer, arg);
+			break;
 		case BUS1_CMD_NODES_DESTROY:
 			r = bus1_peer_ioctl_nodes_destroy(peer, arg);
 			break;
 		case BUS1_CMD_SLICE_RELEASE:
 			r = bus1_peer_ioctl_slice_release(peer, arg);
 			break;
+		case BUS1_CMD_SLICES_RELEASE:
+			r = bus1_peer_ioctl_slices_release(peer, arg);
+			break;
+		case BUS1_CMD_SLICE_INSTALL_FDS:
+			r = bus1_peer_ioctl_slice_install_fds(peer, arg);
+			break;
 		case BUS1_CMD_SEND:
 			r = bus1_peer_ioctl_send(peer, arg);
 			break;
+		case BUS1_CMD_SET_REGISTER:
+			r = bus1_peer_ioctl_set_register(peer, arg);
+			break;
+		case BUS1_CMD_SET_UNREGISTER:
+			r = bus1_peer_ioctl_set_unregister(peer, arg);
+			break;
 		case BUS1_CMD_RECV:
 			r = bus1_peer_ioctl_recv(peer, arg);
 			break;
+		case BUS1_CMD_RECV_MANY:
+			r = bus1_peer_ioctl_recv_many(peer, arg);
+			break;
 		default:
 			r = -ENOTTY;
 			break;
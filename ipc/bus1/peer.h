@@ -44,11 +44,22 @@
  * The local peer lock, however, is private to the peer itself and no such
  * restrictions apply. It is mostly used to give the impression of atomic
  * operations (i.e., making the API appear consistent and coherent).
+ *
+ * If a send fails as a destination ran out of quota or pool space, the sender
+ * can wait on the room wait-queue of that destination, which is woken whenever
+ * the destination returns resources. Peers that asked for accurate POLLOUT
+ * also link their own wait-queue entry into it, so their wait-queue is woken
+ * once the destination has room again. This entry, and the pointer to the
+ * destination it is linked on, are protected by the lock of the room
+ * wait-queue of that destination.
  */
 
 #include <linux/atomic.h>
+#include <linux/idr.h>
 #include <linux/kernel.h>
+#include <linux/list.h>
 #include <linux/mutex.h>
+#include <linux/poll.h>
 #include <linux/rcupdate.h>
 #include <linux/rbtree.h>
 #include <linux/wait.h>
@@ -69,16 +80,30 @@ struct dentry;
  * @user:			pinned user
  * @rcu:			rcu-delayed kfree of peer
  * @waitq:			peer wide wait queue
+ * @room_waitq:			senders waiting for resources of this peer
+ * @room_seq:			number of resource releases of this peer
+ * @blocked_on:			destination this peer is blocked on, or NULL
+ * @blocked_wait:		wait queue entry queued on @blocked_on
  * @active:			active references
  * @debugdir:			debugfs root of this peer, or NULL/ERR_PTR
+ * @debuglink:			link into global debugfs peer list
  * @data.lock:			data lock
  * @data.pool:			data pool
  * @data.queue:			message queue
  * @data.limits:		resource limit counter
  * @local.lock:			local peer runtime lock
  * @local.seed:			pinned seed message
- * @local.map_handles:		map of owned handles (by handle ID)
+ * @local.map_handles:		hash map of owned handles (by handle ID)
+ * @local.map_shift:		number of hash buckets, as power of 2
+ * @local.n_map_handles:	number of handles in hash map
  * @local.handle_ids:		handle ID allocator
+ * @local.sets:			registered destination sets (by set ID)
+ * @local.created_ns:		time the peer was created
+ * @local.n_sends:		number of successful send operations
+ * @local.n_recvs:		number of dequeued messages
+ * @local.recv_timeout_ns:	timeout of blocking receives, 0 if unlimited
+ * @local.recv_busy_poll_ns:	busy-poll period of blocking receives
+ * @local.send_timeout_ns:	timeout of blocking sends, 0 if unlimited
  */
 struct bus1_peer {
 	u64 id;
@@ -86,8 +111,13 @@ struct bus1_peer {
 	struct bus1_user *user;
 	struct rcu_head rcu;
 	wait_queue_head_t waitq;
+	wait_queue_head_t room_waitq;
+	atomic_t room_seq;
+	struct bus1_peer *blocked_on;
+	wait_queue_t blocked_wait;
 	struct bus1_active active;
 	struct dentry *debugdir;
+	struct list_head debuglink;
 
 	struct {
 		struct mutex lock;
@@ -99,14 +129,35 @@ struct bus1_peer {
 	struct {
 		struct mutex lock;
 		struct bus1_message *seed;
-		struct rb_root map_handles;
+		struct hlist_head *map_handles;
+		unsigned int map_shift;
+		size_t n_map_handles;
 		u64 handle_ids;
+		struct idr sets;
+		u64 created_ns;
+		u64 n_sends;
+		u64 n_recvs;
+		u64 recv_timeout_ns;
+		u64 recv_busy_poll_ns;
+		u64 send_timeout_ns;
 	} local;
 };
 
+/* maximum busy-poll period of blocking receives */
+#define BUS1_PEER_BUSY_POLL_MAX_NS (NSEC_PER_MSEC)
+
+/* maximum number of destination sets registered on a peer */
+#define BUS1_PEER_SETS_MAX (256)
+
+/* maximum number of node notifications coalesced into one message */
+#define BUS1_PEER_COALESCE_MAX (1024)
+
 struct bus1_peer *bus1_peer_new(const struct cred *cred);
 struct bus1_peer *bus1_peer_free(struct bus1_peer *peer);
 long bus1_peer_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+struct dentry *bus1_peer_debugfs_create_summary(const char *name,
+						umode_t mode,
+						struct dentry *parent);
 
 /**
  * bus1_peer_acquire() - acquire active reference to peer
@@ -155,4 +206,42 @@ static inline struct bus1_peer *bus1_peer_release(struct bus1_peer *peer)
 	return NULL;
 }
 
+/**
+ * bus1_peer_wake() - wake up readers of a peer
+ * @peer:	peer to operate on
+ *
+ * This wakes up waiters on the wait-queue of @peer, after its queue became
+ * readable. The caller should drop the data lock of @peer first, so the woken
+ * readers do not immediately contend on it.
+ *
+ * This is a keyed, interruptible wake-up of at most one exclusive waiter. That
+ * is, epoll instances that did not ask for POLLIN are skipped, and of all
+ * waiters registered via EPOLLEXCLUSIVE only one is woken.
+ */
+static inline void bus1_peer_wake(struct bus1_peer *peer)
+{
+	wake_up_interruptible_poll(&peer->waitq, POLLIN | POLLRDNORM);
+}
+
+/**
+ * bus1_peer_wake_room() - wake up senders blocked on a peer
+ * @peer:	peer to operate on
+ *
+ * This must be called after resources charged on @peer were returned, that
+ * is, after a slice was released or a quota was discharged. It bumps
+ * @peer->room_seq, so senders that failed to charge @peer earlier can tell
+ * that it is worth retrying, and wakes them up if any are waiting.
+ *
+ * Senders queue themselves first and then re-check the counter. The barrier
+ * in wq_has_sleeper() pairs with that, so no wake-up is lost.
+ */
+static inline void bus1_peer_wake_room(struct bus1_peer *peer)
+{
+	smp_mb__before_atomic();
+	atomic_inc(&peer->room_seq);
+	if (wq_has_sleeper(&peer->room_waitq))
+		wake_up_interruptible_poll(&peer->room_waitq,
+					   POLLOUT | POLLWRNORM);
+}
+
 #endif /* __BUS1_PEER_H */
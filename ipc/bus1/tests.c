@@ -11,10 +11,21 @@
 #include <linux/cred.h>
 #include <linux/err.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
 #include <linux/uio.h>
+#include <linux/vmalloc.h>
+#include <uapi/linux/bus1.h>
 #include "handle.h"
 #include "peer.h"
 #include "tests.h"
+#include "tx.h"
+#include "user.h"
 #include "util/active.h"
 #include "util/flist.h"
 #include "util/pool.h"
@@ -35,6 +46,14 @@ static inline unsigned int kref_read(const struct kref *kref)
 }
 #endif
 
+static bool bus1_tests_bench;
+module_param_named(tests_bench, bus1_tests_bench, bool, 0444);
+MODULE_PARM_DESC(tests_bench,
+		 "Run in-kernel benchmarks after the selftests.");
+
+/* number of operations timed by each benchmark */
+#define BUS1_BENCH_N (1 << 14)
+
 static void bus1_test_flist(void)
 {
 	struct bus1_flist *e, *list;
@@ -146,7 +165,7 @@ static void bus1_test_active(void)
 static void bus1_test_pool(void)
 {
 	struct bus1_pool pool = BUS1_POOL_NULL;
-	struct bus1_pool_slice slice;
+	struct bus1_pool_slice slice, small[3];
 	char *payload = "PAYLOAD";
 	struct iovec vec = {
 		.iov_base = payload,
@@ -159,7 +178,7 @@ static void bus1_test_pool(void)
 	int r;
 
 	bus1_pool_deinit(&pool);
-	WARN_ON(bus1_pool_init(&pool, "test") < 0);
+	WARN_ON(bus1_pool_init(&pool, "test", current_cred()) < 0);
 	bus1_pool_slice_init(&slice);
 
 	r = bus1_pool_alloc(&pool, &slice, 0);
@@ -173,17 +192,68 @@ static void bus1_test_pool(void)
 	r = bus1_pool_dealloc(&pool, &slice);
 	WARN_ON(r < 0);
 
+	/* the backing file is only created on first write */
+	WARN_ON(pool.f);
+
 	r = bus1_pool_alloc(&pool, &slice, 1024);
 	WARN_ON(r < 0);
 	r = bus1_pool_write_iovec(&pool, &slice, 0, &vec, 1, vec.iov_len);
 	WARN_ON(r < 0);
 	r = bus1_pool_write_kvec(&pool, &slice, 0, &kvec, 1, kvec.iov_len);
 	WARN_ON(r < 0);
+	WARN_ON(!pool.f);
 	bus1_pool_publish(&slice);
 	bus1_pool_unpublish(&slice);
 	r = bus1_pool_dealloc(&pool, &slice);
 	WARN_ON(r < 0);
 
+	/* small free space is served from its size-class */
+	bus1_pool_slice_init(&small[0]);
+	bus1_pool_slice_init(&small[1]);
+	bus1_pool_slice_init(&small[2]);
+	WARN_ON(bus1_pool_alloc(&pool, &small[0], 64) < 0);
+	WARN_ON(bus1_pool_alloc(&pool, &small[1], 64) < 0);
+	WARN_ON(bus1_pool_alloc(&pool, &small[2], 64) < 0);
+	WARN_ON(bus1_pool_dealloc(&pool, &small[1]) < 0);
+	WARN_ON(bus1_pool_alloc(&pool, &small[1], 60) < 0);
+	WARN_ON(small[1].offset != small[0].offset + 64);
+	WARN_ON(bus1_pool_dealloc(&pool, &small[1]) < 0);
+	WARN_ON(bus1_pool_dealloc(&pool, &small[2]) < 0);
+	WARN_ON(bus1_pool_dealloc(&pool, &small[0]) < 0);
+
+	bus1_pool_deinit(&pool);
+}
+
+static void bus1_test_pool_ring(void)
+{
+	struct bus1_pool pool = BUS1_POOL_NULL;
+	struct bus1_pool_slice s[4];
+	unsigned int i;
+
+	WARN_ON(bus1_pool_init(&pool, "test", current_cred()) < 0);
+	WARN_ON(bus1_pool_resize(&pool, PAGE_SIZE) < 0);
+	pool.ring = true;
+
+	for (i = 0; i < ARRAY_SIZE(s); ++i)
+		bus1_pool_slice_init(&s[i]);
+
+	/* slices are placed in order, holes in front are skipped */
+	WARN_ON(bus1_pool_alloc(&pool, &s[0], 64) < 0);
+	WARN_ON(bus1_pool_alloc(&pool, &s[1], 64) < 0);
+	WARN_ON(bus1_pool_dealloc(&pool, &s[0]) < 0);
+	WARN_ON(bus1_pool_alloc(&pool, &s[2], 64) < 0);
+	WARN_ON(s[2].offset != s[1].offset + 64);
+
+	/* once the end is reached, allocations wrap around */
+	WARN_ON(bus1_pool_alloc(&pool, &s[3], PAGE_SIZE - 192) < 0);
+	WARN_ON(bus1_pool_resize(&pool, PAGE_SIZE) != -EBUSY);
+	WARN_ON(bus1_pool_dealloc(&pool, &s[1]) < 0);
+	WARN_ON(bus1_pool_alloc(&pool, &s[0], 64) < 0);
+	WARN_ON(s[0].offset != 0);
+
+	WARN_ON(bus1_pool_dealloc(&pool, &s[0]) < 0);
+	WARN_ON(bus1_pool_dealloc(&pool, &s[2]) < 0);
+	WARN_ON(bus1_pool_dealloc(&pool, &s[3]) < 0);
 	bus1_pool_deinit(&pool);
 }
 
@@ -233,11 +303,11 @@ static void bus1_test_queue(void)
 	bus1_queue_sync(&qb, ts1);
 	bus1_queue_sync(&qb, ts2);
 
-	/* 'racing' commit the entries */
-	bus1_queue_commit_staged(&qa, NULL, &n1a, ts1);
-	bus1_queue_commit_staged(&qb, NULL, &n1b, ts1);
-	bus1_queue_commit_staged(&qb, NULL, &n2b, ts2);
-	bus1_queue_commit_staged(&qa, NULL, &n2a, ts2);
+	/* 'racing' commit the entries, each queue is readable after both */
+	WARN_ON(bus1_queue_commit_staged(&qa, &n1a, ts1));
+	WARN_ON(bus1_queue_commit_staged(&qb, &n1b, ts1));
+	WARN_ON(!bus1_queue_commit_staged(&qb, &n2b, ts2));
+	WARN_ON(!bus1_queue_commit_staged(&qa, &n2a, ts2));
 
 	/* dequeue queue a */
 	WARN_ON(bus1_queue_peek(&qa, &has_continue) != &n1a);
@@ -261,6 +331,44 @@ static void bus1_test_queue(void)
 	bus1_queue_deinit(&qb);
 }
 
+static void bus1_test_queue_append(void)
+{
+	struct bus1_queue_node n[4];
+	struct bus1_queue q;
+	bool has_continue;
+	size_t i;
+
+	bus1_queue_init(&q);
+	for (i = 0; i < ARRAY_SIZE(n); ++i)
+		bus1_queue_node_init(&n[i], 0);
+
+	/* a staging entry blocks the following, appended commits */
+	WARN_ON(bus1_queue_stage(&q, &n[0], 0) != 0);
+	WARN_ON(bus1_queue_commit_unstaged(&q, &n[1]));
+	WARN_ON(bus1_queue_commit_unstaged(&q, &n[2]));
+	WARN_ON(bus1_queue_peek(&q, &has_continue));
+
+	/* committing moves the right-most entry, the queue gets readable */
+	WARN_ON(!bus1_queue_commit_staged(&q, &n[0], bus1_queue_tick(&q)));
+	WARN_ON(bus1_queue_commit_unstaged(&q, &n[3]));
+
+	/* dequeue in commit order */
+	WARN_ON(bus1_queue_peek(&q, &has_continue) != &n[1]);
+	bus1_queue_remove(&q, NULL, &n[1]);
+	WARN_ON(bus1_queue_peek(&q, &has_continue) != &n[2]);
+	bus1_queue_remove(&q, NULL, &n[2]);
+	WARN_ON(bus1_queue_peek(&q, &has_continue) != &n[0]);
+	bus1_queue_remove(&q, NULL, &n[0]);
+	WARN_ON(bus1_queue_peek(&q, &has_continue) != &n[3]);
+	WARN_ON(has_continue);
+	bus1_queue_remove(&q, NULL, &n[3]);
+	WARN_ON(bus1_queue_peek(&q, &has_continue));
+
+	for (i = 0; i < ARRAY_SIZE(n); ++i)
+		bus1_queue_node_deinit(&n[i]);
+	bus1_queue_deinit(&q);
+}
+
 static void bus1_test_user(void)
 {
 	struct bus1_user *user1, *user2;
@@ -300,6 +408,50 @@ static void bus1_test_user(void)
 	WARN_ON(bus1_user_unref(user2));
 }
 
+static void bus1_test_user_stock(void)
+{
+	struct bus1_user_limits local;
+	kuid_t uid = KUIDT_INIT(1);
+	struct bus1_user *user;
+	int r, n_slices, n_handles;
+	unsigned int i;
+
+	user = bus1_user_ref_by_uid(uid);
+	WARN_ON(IS_ERR_OR_NULL(user));
+	r = bus1_user_limits_init(&local, user);
+	WARN_ON(r < 0);
+	WARN_ON(!user->limits.stock || local.stock);
+
+	/* restrict the local limits, like PEER_RESET does */
+	atomic_sub(local.max_slices - 4, &local.n_slices);
+	local.max_slices = 4;
+
+	/* charges beyond the local limit must be refused */
+	for (i = 0; i < 4; ++i) {
+		r = bus1_user_charge_limits(&user->limits, &local, 1, 0, NULL);
+		WARN_ON(r < 0);
+	}
+	r = bus1_user_charge_limits(&user->limits, &local, 1, 0, NULL);
+	WARN_ON(r != -EDQUOT);
+
+	/* reading includes stocked resources, draining makes them exact */
+	bus1_user_limits_read(&user->limits, &n_slices, &n_handles);
+	WARN_ON(n_slices != user->limits.max_slices - 4);
+	WARN_ON(atomic_read(&local.n_slices) != 0);
+	bus1_user_limits_drain(&user->limits);
+	WARN_ON(atomic_read(&user->limits.n_slices) !=
+		user->limits.max_slices - 4);
+
+	/* discharged resources can be charged again */
+	bus1_user_discharge(&user->limits.n_slices, &local.n_slices, 1);
+	r = bus1_user_charge_limits(&user->limits, &local, 1, 0, NULL);
+	WARN_ON(r < 0);
+
+	bus1_user_discharge(&user->limits.n_slices, &local.n_slices, 4);
+	bus1_user_limits_deinit(&local);
+	bus1_user_unref(user);
+}
+
 static void bus1_test_handle_basic(void)
 {
 	struct bus1_handle *t, *h[3] = {};
@@ -698,10 +850,11 @@ static void bus1_test_handle_lifetime(void)
 
 static void bus1_test_handle_ids(void)
 {
-	struct bus1_handle *t, *h[2] = {};
+	struct bus1_handle *t, *h[2] = {}, *m[64];
 	struct bus1_peer *p[2] = {};
 	const struct cred *cred = current_cred();
 	bool is_new;
+	size_t i;
 	u64 id;
 
 	p[0] = bus1_peer_new(cred);
@@ -734,6 +887,24 @@ static void bus1_test_handle_ids(void)
 	bus1_handle_forget(h[0]);
 	bus1_handle_unref(h[0]);
 
+	/* test lookups while the map grows */
+
+	for (i = 0; i < ARRAY_SIZE(m); ++i) {
+		m[i] = bus1_handle_import(p[0], (i + 1) << 3, &is_new);
+		WARN_ON(IS_ERR_OR_NULL(m[i]) || !is_new);
+	}
+	WARN_ON(p[0]->local.map_shift <= BUS1_HANDLE_MAP_SHIFT_MIN);
+	for (i = 0; i < ARRAY_SIZE(m); ++i) {
+		t = bus1_handle_import(p[0], (i + 1) << 3, &is_new);
+		WARN_ON(t != m[i] || is_new);
+		bus1_handle_unref(t);
+	}
+	for (i = 0; i < ARRAY_SIZE(m); ++i) {
+		bus1_handle_forget(m[i]);
+		bus1_handle_unref(m[i]);
+	}
+	WARN_ON(p[0]->local.n_map_handles != 0);
+
 	/* test handle export and re-export */
 
 	h[0] = bus1_handle_new_anchor(p[0]);
@@ -778,16 +949,239 @@ static void bus1_test_handle_ids(void)
 	p[0] = bus1_peer_free(p[0]);
 }
 
+static void bus1_bench_report(const char *name, size_t arg, u64 ns, size_t n)
+{
+	pr_info("bench %s/%zu: %llu ns/op (%zu ops)\n",
+		name, arg, div64_u64(ns, n ?: 1), n);
+}
+
+/*
+ * Dequeue the front of a queue with a backlog of @depth committed entries, and
+ * append it again. Each op is one remove and one commit.
+ */
+static void bus1_bench_queue(size_t depth)
+{
+	struct bus1_queue_node *nodes, *node;
+	struct bus1_queue q;
+	bool has_continue;
+	size_t i;
+	u64 ts;
+
+	nodes = vmalloc(depth * sizeof(*nodes));
+	if (WARN_ON(!nodes))
+		return;
+
+	bus1_queue_init(&q);
+	for (i = 0; i < depth; ++i) {
+		bus1_queue_node_init(&nodes[i], BUS1_MSG_NONE);
+		bus1_queue_commit_unstaged(&q, &nodes[i]);
+	}
+
+	ts = ktime_get_ns();
+	for (i = 0; i < BUS1_BENCH_N; ++i) {
+		node = bus1_queue_peek(&q, &has_continue);
+		bus1_queue_remove(&q, NULL, node);
+		bus1_queue_node_init(node, BUS1_MSG_NONE);
+		bus1_queue_commit_unstaged(&q, node);
+	}
+	bus1_bench_report("queue", depth, ktime_get_ns() - ts, BUS1_BENCH_N);
+
+	while ((node = bus1_queue_peek(&q, &has_continue)))
+		bus1_queue_remove(&q, NULL, node);
+	for (i = 0; i < depth; ++i)
+		bus1_queue_node_deinit(&nodes[i]);
+	bus1_queue_deinit(&q);
+	vfree(nodes);
+}
+
+/*
+ * Allocate and release slices of the sizes in @sizes, in turn. Before that,
+ * @n_pinned slices of the same distribution are allocated, with one released
+ * slice between each of them, so the free space is fragmented. Each op is one
+ * allocation and one release.
+ */
+static void bus1_bench_pool(const char *name,
+			    const size_t *sizes,
+			    size_t n_sizes,
+			    size_t n_pinned)
+{
+	struct bus1_pool pool = BUS1_POOL_NULL;
+	struct bus1_pool_slice *pinned, slice;
+	size_t i;
+	u64 ts;
+
+	pinned = vmalloc((n_pinned * 2 ?: 1) * sizeof(*pinned));
+	if (WARN_ON(!pinned))
+		return;
+
+	WARN_ON(bus1_pool_init(&pool, "bench", current_cred()) < 0);
+	WARN_ON(bus1_pool_resize(&pool, 64 * 1024 * 1024) < 0);
+
+	for (i = 0; i < n_pinned * 2; ++i) {
+		bus1_pool_slice_init(&pinned[i]);
+		WARN_ON(bus1_pool_alloc(&pool, &pinned[i],
+					sizes[i % n_sizes]) < 0);
+	}
+	for (i = 0; i < n_pinned * 2; i += 2)
+		WARN_ON(bus1_pool_dealloc(&pool, &pinned[i]) < 0);
+
+	bus1_pool_slice_init(&slice);
+
+	ts = ktime_get_ns();
+	for (i = 0; i < BUS1_BENCH_N; ++i) {
+		WARN_ON(bus1_pool_alloc(&pool, &slice, sizes[i % n_sizes]) < 0);
+		WARN_ON(bus1_pool_dealloc(&pool, &slice) < 0);
+	}
+	bus1_bench_report(name, n_pinned, ktime_get_ns() - ts, BUS1_BENCH_N);
+
+	for (i = 1; i < n_pinned * 2; i += 2)
+		WARN_ON(bus1_pool_dealloc(&pool, &pinned[i]) < 0);
+	bus1_pool_deinit(&pool);
+	vfree(pinned);
+}
+
+/*
+ * Allocate a list of @n entries, fill it via normal iteration, read it back
+ * via batch iteration, and free it again. Each op is one full list lifetime.
+ */
+static void bus1_bench_flist(size_t n)
+{
+	struct bus1_flist *e, *list;
+	size_t i, j, z, sum = 0;
+	u64 ts;
+
+	ts = ktime_get_ns();
+	for (j = 0; j < BUS1_BENCH_N / 16; ++j) {
+		list = bus1_flist_new(n, GFP_KERNEL);
+		if (WARN_ON(!list))
+			return;
+
+		for (i = 0, e = list; i < n; e = bus1_flist_next(e, &i))
+			e->ptr = (void *)(unsigned long)i;
+
+		i = 0;
+		while ((z = bus1_flist_walk(list, n, &e, &i)) > 0)
+			sum += (unsigned long)e[z - 1].ptr;
+
+		bus1_flist_free(list, n);
+	}
+	bus1_bench_report("flist", n, ktime_get_ns() - ts, BUS1_BENCH_N / 16);
+
+	/* consume the values read back, so the walk is not optimized out */
+	WARN_ON(n > 1 && !sum);
+}
+
+/*
+ * Commit a transaction with one message for each of @n_destinations peers,
+ * and dequeue all of them again. Each op is one full transaction.
+ */
+static void bus1_bench_tx(size_t n_destinations)
+{
+	const struct cred *cred = current_cred();
+	struct bus1_queue_node *nodes;
+	struct bus1_peer *origin, **peers;
+	struct bus1_tx tx;
+	size_t i, j;
+	u64 ts;
+
+	peers = kcalloc(n_destinations, sizeof(*peers), GFP_KERNEL);
+	nodes = kmalloc_array(n_destinations, sizeof(*nodes), GFP_KERNEL);
+	if (WARN_ON(!peers || !nodes))
+		goto exit;
+
+	origin = bus1_peer_new(cred);
+	WARN_ON(IS_ERR_OR_NULL(origin) || !bus1_peer_acquire(origin));
+	for (i = 0; i < n_destinations; ++i) {
+		peers[i] = bus1_peer_new(cred);
+		WARN_ON(IS_ERR_OR_NULL(peers[i]) ||
+			!bus1_peer_acquire(peers[i]));
+	}
+
+	ts = ktime_get_ns();
+	for (j = 0; j < BUS1_BENCH_N / 16; ++j) {
+		bus1_tx_init(&tx, origin);
+		for (i = 0; i < n_destinations; ++i) {
+			bus1_queue_node_init(&nodes[i], BUS1_MSG_NONE);
+			nodes[i].owner = bus1_peer_acquire(peers[i]);
+			bus1_tx_stage_later(&tx, &nodes[i]);
+		}
+		bus1_tx_commit(&tx);
+		bus1_tx_deinit(&tx);
+
+		for (i = 0; i < n_destinations; ++i) {
+			mutex_lock(&peers[i]->data.lock);
+			bus1_queue_remove(&peers[i]->data.queue, NULL,
+					  &nodes[i]);
+			mutex_unlock(&peers[i]->data.lock);
+			bus1_queue_node_deinit(&nodes[i]);
+		}
+	}
+	bus1_bench_report("tx", n_destinations, ktime_get_ns() - ts,
+			  BUS1_BENCH_N / 16);
+
+	for (i = 0; i < n_destinations; ++i) {
+		bus1_peer_release(peers[i]);
+		bus1_peer_free(peers[i]);
+	}
+	bus1_peer_release(origin);
+	bus1_peer_free(origin);
+
+exit:
+	kfree(nodes);
+	kfree(peers);
+}
+
+static void bus1_bench_run(void)
+{
+	static const size_t small[] = { 64 };
+	static const size_t large[] = { 4096 };
+	static const size_t mixed[] = { 64, 512, 4096, 256, 16384, 1024 };
+	size_t i;
+
+	pr_info("run benchmarks..\n");
+
+	for (i = 1; i <= 1024; i <<= 2) {
+		bus1_bench_queue(i);
+		cond_resched();
+	}
+
+	for (i = 0; i <= 4096; i = i ? i << 4 : 16) {
+		bus1_bench_pool("pool-small", small, ARRAY_SIZE(small), i);
+		bus1_bench_pool("pool-large", large, ARRAY_SIZE(large), i);
+		bus1_bench_pool("pool-mixed", mixed, ARRAY_SIZE(mixed), i);
+		cond_resched();
+	}
+
+	bus1_bench_flist(1);
+	bus1_bench_flist(BUS1_FLIST_BATCH - 1);
+	bus1_bench_flist(BUS1_FLIST_BATCH);
+	bus1_bench_flist(BUS1_FLIST_BATCH + 1);
+	bus1_bench_flist(BUS1_FLIST_BATCH * 4);
+	cond_resched();
+
+	for (i = 1; i <= 64; i <<= 1) {
+		bus1_bench_tx(i);
+		cond_resched();
+	}
+}
+
 int bus1_tests_run(void)
 {
 	pr_info("run selftests..\n");
 	bus1_test_active();
 	bus1_test_pool();
+	bus1_test_pool_ring();
 	bus1_test_queue();
+	bus1_test_queue_append();
 	bus1_test_flist();
 	bus1_test_user();
+	bus1_test_user_stock();
 	bus1_test_handle_basic();
 	bus1_test_handle_lifetime();
 	bus1_test_handle_ids();
+
+	if (bus1_tests_bench)
+		bus1_bench_run();
+
 	return 0;
 }
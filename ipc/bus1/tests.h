@@ -16,6 +16,11 @@
  * These tests are built into the kernel module itself if, and only if, the
  * required configuration is selected. On every module load, the selftests will
  * be run. On production builds, this option should not be selected.
+ *
+ * If the 'tests_bench' module parameter is set, the selftests are followed by
+ * micro-benchmarks of the queue, pool, flist, and transaction implementations.
+ * They run entirely in the kernel, without any syscall overhead, and report the
+ * average time each operation took via the kernel log.
  */
 
 #include <linux/kernel.h>
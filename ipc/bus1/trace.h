@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ */
+
+/**
+ * DOC: Tracepoints
+ *
+ * The message path is instrumented with tracepoints in the "bus1" trace
+ * system. They cover the lifetime of a transaction, from factory creation via
+ * instantiation, pool allocation and staging, to the final commit and the
+ * dequeue by the receiver. Every event carries the ID of the peer it operates
+ * on and, where already assigned, the queue timestamp of the message, so a
+ * single message can be followed across peers. Peer IDs match the names of
+ * the per-peer debugfs directories.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM bus1
+
+#if !defined(__BUS1_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define __BUS1_TRACE_H
+
+#include <linux/kernel.h>
+#include <linux/tracepoint.h>
+#include "message.h"
+#include "peer.h"
+#include "tx.h"
+#include "util/pool.h"
+#include "util/queue.h"
+
+TRACE_EVENT(bus1_factory_new,
+	TP_PROTO(struct bus1_factory *f),
+	TP_ARGS(f),
+	TP_STRUCT__entry(
+		__field(u64, peer_id)
+		__field(u64, n_destinations)
+		__field(size_t, n_bytes)
+		__field(size_t, n_handles)
+		__field(size_t, n_files)
+	),
+	TP_fast_assign(
+		__entry->peer_id = f->peer->id;
+		__entry->n_destinations = f->param->n_destinations;
+		__entry->n_bytes = f->length_vecs;
+		__entry->n_handles = f->n_handles;
+		__entry->n_files = f->n_files;
+	),
+	TP_printk("peer=%llx n_destinations=%llu n_bytes=%zu n_handles=%zu n_files=%zu",
+		  __entry->peer_id, __entry->n_destinations, __entry->n_bytes,
+		  __entry->n_handles, __entry->n_files)
+);
+
+TRACE_EVENT(bus1_factory_seal,
+	TP_PROTO(struct bus1_factory *f, int r),
+	TP_ARGS(f, r),
+	TP_STRUCT__entry(
+		__field(u64, peer_id)
+		__field(int, r)
+	),
+	TP_fast_assign(
+		__entry->peer_id = f->peer->id;
+		__entry->r = r;
+	),
+	TP_printk("peer=%llx r=%d", __entry->peer_id, __entry->r)
+);
+
+TRACE_EVENT(bus1_factory_instantiate,
+	TP_PROTO(struct bus1_factory *f, struct bus1_peer *peer, int r),
+	TP_ARGS(f, peer, r),
+	TP_STRUCT__entry(
+		__field(u64, peer_id)
+		__field(u64, dst_id)
+		__field(int, r)
+	),
+	TP_fast_assign(
+		__entry->peer_id = f->peer->id;
+		__entry->dst_id = peer->id;
+		__entry->r = r;
+	),
+	TP_printk("peer=%llx dst=%llx r=%d",
+		  __entry->peer_id, __entry->dst_id, __entry->r)
+);
+
+DECLARE_EVENT_CLASS(bus1_pool_slice,
+	TP_PROTO(struct bus1_peer *peer, struct bus1_pool_slice *slice,
+		 size_t size, int r),
+	TP_ARGS(peer, slice, size, r),
+	TP_STRUCT__entry(
+		__field(u64, peer_id)
+		__field(size_t, size)
+		__field(u32, offset)
+		__field(int, r)
+	),
+	TP_fast_assign(
+		__entry->peer_id = peer->id;
+		__entry->size = size;
+		__entry->offset = slice->offset;
+		__entry->r = r;
+	),
+	TP_printk("peer=%llx offset=%u size=%zu r=%d",
+		  __entry->peer_id, __entry->offset, __entry->size,
+		  __entry->r)
+);
+
+DEFINE_EVENT(bus1_pool_slice, bus1_pool_alloc,
+	TP_PROTO(struct bus1_peer *peer, struct bus1_pool_slice *slice,
+		 size_t size, int r),
+	TP_ARGS(peer, slice, size, r)
+);
+
+DEFINE_EVENT(bus1_pool_slice, bus1_pool_dealloc,
+	TP_PROTO(struct bus1_peer *peer, struct bus1_pool_slice *slice,
+		 size_t size, int r),
+	TP_ARGS(peer, slice, size, r)
+);
+
+DECLARE_EVENT_CLASS(bus1_tx_phase,
+	TP_PROTO(struct bus1_tx *tx, size_t n_destinations),
+	TP_ARGS(tx, n_destinations),
+	TP_STRUCT__entry(
+		__field(u64, peer_id)
+		__field(u64, timestamp)
+		__field(size_t, n_destinations)
+	),
+	TP_fast_assign(
+		__entry->peer_id = tx->origin->id;
+		__entry->timestamp = tx->timestamp;
+		__entry->n_destinations = n_destinations;
+	),
+	TP_printk("peer=%llx ts=%llu n_destinations=%zu",
+		  __entry->peer_id, __entry->timestamp,
+		  __entry->n_destinations)
+);
+
+DEFINE_EVENT(bus1_tx_phase, bus1_tx_stage,
+	TP_PROTO(struct bus1_tx *tx, size_t n_destinations),
+	TP_ARGS(tx, n_destinations)
+);
+
+DEFINE_EVENT(bus1_tx_phase, bus1_tx_sync,
+	TP_PROTO(struct bus1_tx *tx, size_t n_destinations),
+	TP_ARGS(tx, n_destinations)
+);
+
+DEFINE_EVENT(bus1_tx_phase, bus1_tx_commit,
+	TP_PROTO(struct bus1_tx *tx, size_t n_destinations),
+	TP_ARGS(tx, n_destinations)
+);
+
+DEFINE_EVENT(bus1_tx_phase, bus1_tx_commit_unicast,
+	TP_PROTO(struct bus1_tx *tx, size_t n_destinations),
+	TP_ARGS(tx, n_destinations)
+);
+
+DECLARE_EVENT_CLASS(bus1_queue_node,
+	TP_PROTO(struct bus1_peer *peer, struct bus1_queue_node *qnode),
+	TP_ARGS(peer, qnode),
+	TP_STRUCT__entry(
+		__field(u64, peer_id)
+		__field(u64, timestamp)
+		__field(unsigned int, type)
+	),
+	TP_fast_assign(
+		__entry->peer_id = peer->id;
+		__entry->timestamp = bus1_queue_node_get_timestamp(qnode);
+		__entry->type = bus1_queue_node_get_type(qnode);
+	),
+	TP_printk("peer=%llx ts=%llu type=%u",
+		  __entry->peer_id, __entry->timestamp, __entry->type)
+);
+
+DEFINE_EVENT(bus1_queue_node, bus1_queue_add,
+	TP_PROTO(struct bus1_peer *peer, struct bus1_queue_node *qnode),
+	TP_ARGS(peer, qnode)
+);
+
+DEFINE_EVENT(bus1_queue_node, bus1_queue_remove,
+	TP_PROTO(struct bus1_peer *peer, struct bus1_queue_node *qnode),
+	TP_ARGS(peer, qnode)
+);
+
+TRACE_EVENT(bus1_peer_recv,
+	TP_PROTO(struct bus1_peer *peer, unsigned int type, u64 timestamp,
+		 int r),
+	TP_ARGS(peer, type, timestamp, r),
+	TP_STRUCT__entry(
+		__field(u64, peer_id)
+		__field(u64, timestamp)
+		__field(unsigned int, type)
+		__field(int, r)
+	),
+	TP_fast_assign(
+		__entry->peer_id = peer->id;
+		__entry->timestamp = timestamp;
+		__entry->type = type;
+		__entry->r = r;
+	),
+	TP_printk("peer=%llx ts=%llu type=%u r=%d",
+		  __entry->peer_id, __entry->timestamp, __entry->type,
+		  __entry->r)
+);
+
+#endif /* __BUS1_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
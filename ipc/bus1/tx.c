@@ -13,7 +13,9 @@
 #include <linux/mutex.h>
 #include <linux/wait.h>
 #include "peer.h"
+#include "trace.h"
 #include "tx.h"
+#include "util.h"
 #include "util/active.h"
 #include "util/queue.h"
 
@@ -140,6 +142,7 @@ static void bus1_tx_stage(struct bus1_tx *tx,
 
 	bus1_tx_push(tx, list, qnode);
 	*timestamp = bus1_queue_stage(&peer->data.queue, qnode, *timestamp);
+	trace_bus1_queue_add(peer, qnode);
 }
 
 /**
@@ -266,7 +269,51 @@ bool bus1_tx_join(struct bus1_queue_node *whom, struct bus1_queue_node *qnode)
 	 */
 	qnode->group = whom->group;
 	bus1_queue_sync(&peer->data.queue, timestamp);
-	return bus1_queue_commit_synthetic(&peer->data.queue, qnode, timestamp);
+	if (!bus1_queue_commit_synthetic(&peer->data.queue, qnode, timestamp))
+		return false;
+
+	trace_bus1_queue_add(peer, qnode);
+	return true;
+}
+
+static u64 bus1_tx_commit_unicast(struct bus1_tx *tx)
+{
+	struct bus1_peer *owner, *peer, *origin = tx->origin;
+	struct bus1_queue_node *qnode;
+	bool wake;
+
+	/*
+	 * Unicast Commit
+	 * A transaction with a single, postponed message does not need the
+	 * separate stage, sync, and commit rounds. Instead, we lock origin
+	 * and destination at the same time, sync the destination clock to
+	 * the origin, and commit the message directly with a fresh tick of
+	 * the destination. Then the origin clock is synced to the commit
+	 * timestamp. Hence, like with a multicast, the message is ordered
+	 * after everything the origin did before and in front of anything
+	 * the origin or destination do afterwards.
+	 */
+	qnode = bus1_tx_pop(tx, &tx->postponed);
+	owner = qnode->owner;
+	peer = owner ?: origin;
+
+	bus1_mutex_lock2(&origin->data.lock, &peer->data.lock);
+	bus1_queue_sync(&peer->data.queue, origin->data.queue.clock);
+	wake = bus1_queue_commit_unstaged(&peer->data.queue, qnode);
+	trace_bus1_queue_add(peer, qnode);
+	tx->timestamp = bus1_queue_node_get_timestamp(qnode);
+	bus1_queue_sync(&origin->data.queue, tx->timestamp);
+	WARN_ON(test_and_set_bit(BUS1_TX_BIT_SEALED, &tx->flags));
+	bus1_mutex_unlock2(&origin->data.lock, &peer->data.lock);
+
+	if (wake)
+		bus1_peer_wake(peer);
+
+	trace_bus1_tx_commit_unicast(tx, 1);
+
+	bus1_peer_release(owner);
+
+	return tx->timestamp;
 }
 
 /**
@@ -275,7 +322,8 @@ bool bus1_tx_join(struct bus1_queue_node *whom, struct bus1_queue_node *qnode)
  *
  * Commit a transaction. First all postponed entries are staged, then we commit
  * all messages that belong to this transaction. This works with any number of
- * messages.
+ * messages. If the transaction consists of a single postponed message, it is
+ * committed directly, without staging it first.
  *
  * Return: This returns the commit timestamp used.
  */
@@ -283,10 +331,15 @@ u64 bus1_tx_commit(struct bus1_tx *tx)
 {
 	struct bus1_queue_node *qnode, **tail;
 	struct bus1_peer *peer, *origin = tx->origin;
+	size_t n = 0;
+	bool wake;
 
 	if (WARN_ON(test_bit(BUS1_TX_BIT_SEALED, &tx->flags)))
 		return tx->timestamp;
 
+	if (tx->postponed && !tx->postponed->next && !tx->sync && !tx->async)
+		return bus1_tx_commit_unicast(tx);
+
 	/*
 	 * Stage Round
 	 * Callers can stage messages manually via bus1_tx_stage_*(). However,
@@ -300,8 +353,12 @@ u64 bus1_tx_commit(struct bus1_tx *tx)
 		mutex_lock(&peer->data.lock);
 		bus1_tx_stage_sync(tx, qnode);
 		mutex_unlock(&peer->data.lock);
+		++n;
 	}
 
+	trace_bus1_tx_stage(tx, n);
+	n = 0;
+
 	/*
 	 * Acquire Commit TS
 	 * Now that everything is staged, we atomically acquire a commit
@@ -332,6 +389,7 @@ u64 bus1_tx_commit(struct bus1_tx *tx)
 			mutex_lock(&peer->data.lock);
 			bus1_queue_sync(&peer->data.queue, tx->timestamp);
 			mutex_unlock(&peer->data.lock);
+			++n;
 		}
 
 		/* append async-list to the tail of the previous list */
@@ -339,22 +397,35 @@ u64 bus1_tx_commit(struct bus1_tx *tx)
 		tx->async = NULL;
 	} while (*tail);
 
+	trace_bus1_tx_sync(tx, n);
+	n = 0;
+
 	/*
 	 * Commit Round
 	 * Now that everything is staged and the clocks synced, we can finally
 	 * commit all the messages on their respective queues. Iterate over
 	 * each message again, commit it, and release the pinned destination.
+	 * A destination is only woken up if the commit made its queue
+	 * readable, and only after its lock was dropped. Hence, a transaction
+	 * wakes each destination at most once, regardless of how many of its
+	 * messages target it.
 	 */
 	while ((qnode = bus1_tx_pop(tx, &tx->sync))) {
 		peer = qnode->owner ?: tx->origin;
 
 		mutex_lock(&peer->data.lock);
-		bus1_queue_commit_staged(&peer->data.queue, &peer->waitq,
-					 qnode, tx->timestamp);
+		wake = bus1_queue_commit_staged(&peer->data.queue, qnode,
+						tx->timestamp);
+		trace_bus1_queue_add(peer, qnode);
 		mutex_unlock(&peer->data.lock);
 
+		if (wake)
+			bus1_peer_wake(peer);
+
 		bus1_peer_release(qnode->owner);
+		++n;
 	}
 
+	trace_bus1_tx_commit(tx, n);
 	return tx->timestamp;
 }
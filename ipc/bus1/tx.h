@@ -18,6 +18,10 @@
  * just be queued on each destination, but must be properly synchronized. This
  * requires us to first stage each message on their respective destination,
  * then sync and tick the clocks, and eventual commit all messages.
+ *
+ * A transaction that carries just a single postponed message is a unicast. It
+ * is committed directly by locking origin and destination together, without
+ * any staging.
  */
 
 #include <linux/err.h>
@@ -14,12 +14,16 @@
 #include <linux/kref.h>
 #include <linux/moduleparam.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
 #include <linux/rcupdate.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/uidgid.h>
 #include "user.h"
 
+/* number of resources a CPU moves from a shared counter into its stock */
+#define BUS1_USER_STOCK_BATCH (32)
+
 static DEFINE_MUTEX(bus1_user_lock);
 static DEFINE_IDR(bus1_user_idr);
 
@@ -94,9 +98,20 @@ bus1_user_usage_free(struct bus1_user_usage *usage)
  *
  * This initializes the resource-limit counter @limit. The initial limits are
  * taken from @source, if given. If NULL, the global default limits are taken.
+ *
+ * Only the limits of a user (@source is NULL) get per-CPU stocks. They are
+ * charged by every peer of the user, so the shared counters are contended.
+ * Limits of a single peer, which are copied from its user, are charged
+ * directly. This way, opening a peer does not allocate per-CPU memory, and no
+ * sender can hold back stocked quota of a receiving peer.
+ *
+ * Even if this fails, @limits is left in a state that bus1_user_limits_deinit()
+ * can be called on.
+ *
+ * Return: 0 on success, negative error code on failure.
  */
-void bus1_user_limits_init(struct bus1_user_limits *limits,
-			   struct bus1_user *source)
+int bus1_user_limits_init(struct bus1_user_limits *limits,
+			  struct bus1_user *source)
 {
 	if (source) {
 		limits->max_slices = source->limits.max_slices;
@@ -118,6 +133,15 @@ void bus1_user_limits_init(struct bus1_user_limits *limits,
 	atomic_set(&limits->n_usages, 0);
 	idr_init(&limits->usages);
 	mutex_init(&limits->lock);
+
+	limits->stock = NULL;
+	if (!source) {
+		limits->stock = alloc_percpu(struct bus1_user_stock);
+		if (!limits->stock)
+			return -ENOMEM;
+	}
+
+	return 0;
 }
 
 /**
@@ -141,6 +165,10 @@ void bus1_user_limits_deinit(struct bus1_user_limits *limits)
 	idr_destroy(&limits->usages);
 	WARN_ON(atomic_read(&limits->n_usages) != 0);
 
+	bus1_user_limits_drain(limits);
+	free_percpu(limits->stock);
+	limits->stock = NULL;
+
 	WARN_ON(atomic_read(&limits->n_slices) !=
 		limits->max_slices);
 	WARN_ON(atomic_read(&limits->n_handles) !=
@@ -151,6 +179,74 @@ void bus1_user_limits_deinit(struct bus1_user_limits *limits)
 		limits->max_inflight_fds);
 }
 
+static void bus1_user_stock_drain(atomic_t *remaining,
+				  atomic_t __percpu *stock)
+{
+	int cpu, v;
+
+	for_each_possible_cpu(cpu) {
+		v = atomic_xchg(per_cpu_ptr(stock, cpu), 0);
+		if (v)
+			atomic_add(v, remaining);
+	}
+}
+
+/**
+ * bus1_user_limits_drain() - return stocked resources to the limits
+ * @limits:		limits to operate on
+ *
+ * This moves all resources that were charged into the per-CPU stocks of
+ * @limits, but not used, back to the shared counters. Afterwards, the counters
+ * reflect the exact number of resources in use (until the next charge refills
+ * a stock). This must be called before the counters are adjusted. Limits
+ * without stocks are left untouched.
+ */
+void bus1_user_limits_drain(struct bus1_user_limits *limits)
+{
+	if (!limits->stock)
+		return;
+
+	bus1_user_stock_drain(&limits->n_slices, &limits->stock->n_slices);
+	bus1_user_stock_drain(&limits->n_handles, &limits->stock->n_handles);
+}
+
+static int bus1_user_stock_read(atomic_t *remaining, atomic_t __percpu *stock)
+{
+	int cpu, v;
+
+	v = atomic_read(remaining);
+	for_each_possible_cpu(cpu)
+		v += atomic_read(per_cpu_ptr(stock, cpu));
+
+	return v;
+}
+
+/**
+ * bus1_user_limits_read() - read remaining slices and handles
+ * @limits:		limits to operate on
+ * @n_slicesp:		output for the number of remaining slices
+ * @n_handlesp:		output for the number of remaining handles
+ *
+ * This returns the remaining quota of @limits, including the resources that
+ * are stocked on any CPU, but not in use. Unlike bus1_user_limits_drain(),
+ * this does not modify @limits, so it is suitable for statistics. The result
+ * is a snapshot, which might be stale by the time it is returned.
+ */
+void bus1_user_limits_read(struct bus1_user_limits *limits,
+			   int *n_slicesp,
+			   int *n_handlesp)
+{
+	if (limits->stock) {
+		*n_slicesp = bus1_user_stock_read(&limits->n_slices,
+						  &limits->stock->n_slices);
+		*n_handlesp = bus1_user_stock_read(&limits->n_handles,
+						   &limits->stock->n_handles);
+	} else {
+		*n_slicesp = atomic_read(&limits->n_slices);
+		*n_handlesp = atomic_read(&limits->n_handles);
+	}
+}
+
 static struct bus1_user_usage *
 bus1_user_limits_map(struct bus1_user_limits *limits, struct bus1_user *actor)
 {
@@ -189,6 +285,7 @@ bus1_user_limits_map(struct bus1_user_limits *limits, struct bus1_user *actor)
 static struct bus1_user *bus1_user_new(void)
 {
 	struct bus1_user *user;
+	int r;
 
 	user = kmalloc(sizeof(*user), GFP_KERNEL);
 	if (!user)
@@ -196,21 +293,29 @@ static struct bus1_user *bus1_user_new(void)
 
 	kref_init(&user->ref);
 	user->uid = INVALID_UID;
-	bus1_user_limits_init(&user->limits, NULL);
+	r = bus1_user_limits_init(&user->limits, NULL);
+	if (r < 0) {
+		bus1_user_limits_deinit(&user->limits);
+		kfree(user);
+		return ERR_PTR(r);
+	}
 
 	return user;
 }
 
+static void bus1_user_destroy(struct bus1_user *user)
+{
+	bus1_user_limits_deinit(&user->limits);
+	kfree_rcu(user, rcu);
+}
+
 static void bus1_user_free(struct kref *ref)
 {
 	struct bus1_user *user = container_of(ref, struct bus1_user, ref);
 
 	lockdep_assert_held(&bus1_user_lock);
 
-	if (likely(uid_valid(user->uid)))
-		idr_remove(&bus1_user_idr, __kuid_val(user->uid));
-	bus1_user_limits_deinit(&user->limits);
-	kfree_rcu(user, rcu);
+	idr_remove(&bus1_user_idr, __kuid_val(user->uid));
 }
 
 /**
@@ -220,11 +325,15 @@ static void bus1_user_free(struct kref *ref)
  * Find and return the user object for the uid if it exists, otherwise create
  * it first.
  *
+ * The lookup is lockless. bus1_user_lock is only taken if no live user object
+ * exists for @uid, and then only to insert a new object into the IDR. The new
+ * object is allocated before the lock is taken.
+ *
  * Return: A user object for the given uid, ERR_PTR on failure.
  */
 struct bus1_user *bus1_user_ref_by_uid(kuid_t uid)
 {
-	struct bus1_user *user;
+	struct bus1_user *user, *new;
 	int r;
 
 	if (WARN_ON(!uid_valid(uid)))
@@ -239,24 +348,36 @@ struct bus1_user *bus1_user_ref_by_uid(kuid_t uid)
 	if (user)
 		return user;
 
-	/* slow-path: try again with IDR locked */
+	/* slow-path: prepare a new object and insert it with the IDR locked */
+	new = bus1_user_new();
+	if (IS_ERR(new))
+		return new;
+
+	new->uid = uid;
+
+	/*
+	 * Users are removed from the IDR in the same critical section in which
+	 * their last reference is dropped (see bus1_user_unref()). Hence, any
+	 * entry found with the lock held is live and can be referenced.
+	 */
 	mutex_lock(&bus1_user_lock);
-	user = idr_find(&bus1_user_idr, __kuid_val(uid));
-	if (likely(!bus1_user_ref(user))) {
-		user = bus1_user_new();
-		if (!IS_ERR(user)) {
-			user->uid = uid;
-			r = idr_alloc(&bus1_user_idr, user, __kuid_val(uid),
-				      __kuid_val(uid) + 1, GFP_KERNEL);
-			if (r < 0) {
-				user->uid = INVALID_UID; /* couldn't insert */
-				kref_put(&user->ref, bus1_user_free);
-				user = ERR_PTR(r);
-			}
+	user = bus1_user_ref(idr_find(&bus1_user_idr, __kuid_val(uid)));
+	if (likely(!user)) {
+		r = idr_alloc(&bus1_user_idr, new, __kuid_val(uid),
+			      __kuid_val(uid) + 1, GFP_KERNEL);
+		if (r < 0) {
+			user = ERR_PTR(r);
+		} else {
+			user = new;
+			new = NULL;
 		}
 	}
 	mutex_unlock(&bus1_user_lock);
 
+	/* lost the race against a parallel lookup, or failed to insert */
+	if (new)
+		bus1_user_destroy(new);
+
 	return user;
 }
 
@@ -282,7 +403,8 @@ struct bus1_user *bus1_user_ref(struct bus1_user *user)
  * bus1_user_unref() - release reference
  * @user:	user to release, or NULL
  *
- * Release a reference to a user-object.
+ * Release a reference to a user-object. bus1_user_lock is only taken if this
+ * drops the last reference.
  *
  * If NULL is passed, this is a no-op.
  *
@@ -290,9 +412,15 @@ struct bus1_user *bus1_user_ref(struct bus1_user *user)
  */
 struct bus1_user *bus1_user_unref(struct bus1_user *user)
 {
-	if (user) {
-		if (kref_put_mutex(&user->ref, bus1_user_free, &bus1_user_lock))
-			mutex_unlock(&bus1_user_lock);
+	/*
+	 * Only the removal from the IDR must be serialized against lookups.
+	 * Drop the lock before tearing down the object, so concurrent peer
+	 * creations of other users do not wait for us.
+	 */
+	if (user && kref_put_mutex(&user->ref, bus1_user_free,
+				   &bus1_user_lock)) {
+		mutex_unlock(&bus1_user_lock);
+		bus1_user_destroy(user);
 	}
 
 	return NULL;
@@ -347,6 +475,139 @@ void bus1_user_discharge(atomic_t *global, atomic_t *local, int charge)
 	atomic_add(charge, global);
 }
 
+static int bus1_user_direct_charge(atomic_t *remaining, int charge)
+{
+	int v;
+
+	v = bus1_atomic_add_if_ge(remaining, -charge, charge);
+	return (v < charge) ? -EDQUOT : 0;
+}
+
+static int bus1_user_stock_charge(atomic_t *remaining,
+				  atomic_t __percpu *stock,
+				  int charge)
+{
+	int v;
+
+	/*
+	 * Fast-path: serve the charge from the stock of the local CPU. The
+	 * stock is only ever accessed atomically, so we do not care whether we
+	 * are migrated in between. The cacheline is simply not shared in the
+	 * common case.
+	 */
+	v = bus1_atomic_add_if_ge(raw_cpu_ptr(stock), -charge, charge);
+	if (v >= charge)
+		return 0;
+
+	/* stock is empty, charge a full batch on top and refill it */
+	if (charge <= INT_MAX - BUS1_USER_STOCK_BATCH) {
+		v = bus1_atomic_add_if_ge(remaining,
+					  -(charge + BUS1_USER_STOCK_BATCH),
+					  charge + BUS1_USER_STOCK_BATCH);
+		if (v >= charge + BUS1_USER_STOCK_BATCH) {
+			atomic_add(BUS1_USER_STOCK_BATCH, raw_cpu_ptr(stock));
+			return 0;
+		}
+	}
+
+	/* not enough left for a batch, charge exactly what is needed */
+	v = bus1_atomic_add_if_ge(remaining, -charge, charge);
+	if (v >= charge)
+		return 0;
+
+	/*
+	 * The counter is depleted, but other CPUs might still hold stocked
+	 * resources. Return them and retry, so the limit applies to what is
+	 * actually in use, rather than to what is stocked.
+	 */
+	bus1_user_stock_drain(remaining, stock);
+	v = bus1_atomic_add_if_ge(remaining, -charge, charge);
+	if (v >= charge)
+		return 0;
+
+	return -EDQUOT;
+}
+
+/**
+ * bus1_user_charge_limits() - charge slices and handles on resource limits
+ * @global:		global limits to charge on
+ * @local:		local limits to charge on
+ * @n_slices:		number of slices to charge
+ * @n_handles:		number of handles to charge
+ * @localp:		output flag whether @local was exhausted, or NULL
+ *
+ * This charges @n_slices and @n_handles on both @global and @local, just like
+ * bus1_user_charge() does for individual counters. However, the charges on
+ * @global are served from its per-CPU stocks, which are refilled from the
+ * shared counters in batches of BUS1_USER_STOCK_BATCH. Hence, the shared
+ * counters of a user are only touched once every couple of charges, rather than
+ * on every message. @local is charged directly, as it never has stocks.
+ * Resources charged via this function are discharged via bus1_user_discharge(),
+ * as usual.
+ *
+ * If the charge fails, @localp, if given, tells whether it failed on @local,
+ * rather than on @global. Callers use this to tell limits of the peer, which
+ * only the peer itself releases, from limits shared by all peers of a user.
+ *
+ * It is an error to call this with negative charges.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_user_charge_limits(struct bus1_user_limits *global,
+			    struct bus1_user_limits *local,
+			    int n_slices,
+			    int n_handles,
+			    bool *localp)
+{
+	int r;
+
+	WARN_ON(n_slices < 0 || n_handles < 0);
+	WARN_ON(!global->stock || local->stock);
+
+	if (localp)
+		*localp = false;
+
+	if (n_slices > 0) {
+		r = bus1_user_stock_charge(&global->n_slices,
+					   &global->stock->n_slices,
+					   n_slices);
+		if (r < 0)
+			return r;
+
+		r = bus1_user_direct_charge(&local->n_slices, n_slices);
+		if (r < 0) {
+			if (localp)
+				*localp = true;
+			goto error_global_slices;
+		}
+	}
+
+	if (n_handles > 0) {
+		r = bus1_user_stock_charge(&global->n_handles,
+					   &global->stock->n_handles,
+					   n_handles);
+		if (r < 0)
+			goto error_local_slices;
+
+		r = bus1_user_direct_charge(&local->n_handles, n_handles);
+		if (r < 0) {
+			if (localp)
+				*localp = true;
+			goto error_global_handles;
+		}
+	}
+
+	return 0;
+
+error_global_handles:
+	atomic_add(n_handles, &global->n_handles);
+error_local_slices:
+	atomic_add(n_slices, &local->n_slices);
+error_global_slices:
+	atomic_add(n_slices, &global->n_slices);
+	return r;
+}
+
 static int bus1_user_charge_quota_one(atomic_t *remaining,
 				      atomic_t *share,
 				      int users,
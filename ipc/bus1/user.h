@@ -39,6 +39,7 @@
 #include <linux/idr.h>
 #include <linux/kref.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
 #include <linux/types.h>
 #include <linux/uidgid.h>
 #include "util.h"
@@ -57,6 +58,16 @@ struct bus1_user_usage {
 	atomic_t n_fds;
 };
 
+/**
+ * struct bus1_user_stock - per-CPU stock of charged resources
+ * @n_slices:			number of slices charged, but not yet used
+ * @n_handles:			number of handles charged, but not yet used
+ */
+struct bus1_user_stock {
+	atomic_t n_slices;
+	atomic_t n_handles;
+};
+
 /**
  * struct bus1_user_limits - resource limit counters
  * @n_slices:			number of remaining quota for owned slices
@@ -69,6 +80,9 @@ struct bus1_user_usage {
  * @max_inflight_fds:		maximum number of inflight FDs
  * @lock:			object lock
  * @usages:			idr of usage entries per uid
+ * @n_usages:			number of usage entries
+ * @stock:			per-CPU stock of pre-charged slices and handles,
+ *				or NULL for limits of a single peer
  */
 struct bus1_user_limits {
 	atomic_t n_slices;
@@ -82,6 +96,7 @@ struct bus1_user_limits {
 	struct mutex lock;
 	struct idr usages;
 	atomic_t n_usages;
+	struct bus1_user_stock __percpu *stock;
 };
 
 /**
@@ -104,9 +119,13 @@ struct bus1_user {
 void bus1_user_modexit(void);
 
 /* limits */
-void bus1_user_limits_init(struct bus1_user_limits *limits,
-			   struct bus1_user *source);
+int bus1_user_limits_init(struct bus1_user_limits *limits,
+			  struct bus1_user *source);
 void bus1_user_limits_deinit(struct bus1_user_limits *limits);
+void bus1_user_limits_drain(struct bus1_user_limits *limits);
+void bus1_user_limits_read(struct bus1_user_limits *limits,
+			   int *n_slicesp,
+			   int *n_handlesp);
 
 /* users */
 struct bus1_user *bus1_user_ref_by_uid(kuid_t uid);
@@ -116,6 +135,11 @@ struct bus1_user *bus1_user_unref(struct bus1_user *user);
 /* charges */
 int bus1_user_charge(atomic_t *global, atomic_t *local, int charge);
 void bus1_user_discharge(atomic_t *global, atomic_t *local, int charge);
+int bus1_user_charge_limits(struct bus1_user_limits *global,
+			    struct bus1_user_limits *local,
+			    int n_slices,
+			    int n_handles,
+			    bool *localp);
 int bus1_user_charge_quota(struct bus1_user *user,
 			   struct bus1_user *actor,
 			   int n_slices,
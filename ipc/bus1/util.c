@@ -16,6 +16,7 @@
 #include <linux/fs.h>
 #include <linux/kernel.h>
 #include <linux/pagemap.h>
+#include <linux/percpu_counter.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
 #include <linux/uio.h>
@@ -211,4 +212,37 @@ struct dentry *bus1_debugfs_create_atomic_x(const char *name,
 					  &bus1_debugfs_atomic_x_ro);
 }
 
+static int bus1_debugfs_percpu_counter_get(void *data, u64 *val)
+{
+	*val = percpu_counter_sum((struct percpu_counter *)data);
+	return 0;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(bus1_debugfs_percpu_counter_ro,
+			 bus1_debugfs_percpu_counter_get,
+			 NULL,
+			 "%lld\n");
+
+/**
+ * bus1_debugfs_create_percpu_counter() - create debugfs file for counter
+ * @name:	file name to use
+ * @mode:	permissions for the file
+ * @parent:	parent directory
+ * @value:	counter to read from
+ *
+ * This creates a read-only debugfs file that prints the current sum of the
+ * per-cpu counter @value as signed decimal value.
+ *
+ * Return: Pointer to new dentry, NULL/ERR_PTR if disabled or on failure.
+ */
+struct dentry *
+bus1_debugfs_create_percpu_counter(const char *name,
+				   umode_t mode,
+				   struct dentry *parent,
+				   struct percpu_counter *value)
+{
+	return debugfs_create_file_unsafe(name, mode, parent, value,
+					  &bus1_debugfs_percpu_counter_ro);
+}
+
 #endif /* defined(CONFIG_DEBUG_FS) */
@@ -27,6 +27,7 @@
 
 struct dentry;
 struct iovec;
+struct percpu_counter;
 
 /**
  * BUS1_TAIL - tail pointer in singly-linked lists
@@ -51,6 +52,11 @@ bus1_debugfs_create_atomic_x(const char *name,
 			     umode_t mode,
 			     struct dentry *parent,
 			     atomic_t *value);
+struct dentry *
+bus1_debugfs_create_percpu_counter(const char *name,
+				   umode_t mode,
+				   struct dentry *parent,
+				   struct percpu_counter *value);
 
 #else
 
@@ -63,6 +69,15 @@ bus1_debugfs_create_atomic_x(const char *name,
 	return ERR_PTR(-ENODEV);
 }
 
+static inline struct dentry *
+bus1_debugfs_create_percpu_counter(const char *name,
+				   umode_t mode,
+				   struct dentry *parent,
+				   struct percpu_counter *value)
+{
+	return ERR_PTR(-ENODEV);
+}
+
 #endif
 
 /**
@@ -9,6 +9,7 @@
 
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 #include <linux/aio.h>
+#include <linux/cred.h>
 #include <linux/err.h>
 #include <linux/file.h>
 #include <linux/fs.h>
@@ -25,15 +26,33 @@
 #include <linux/uio.h>
 #include "pool.h"
 
-/* insert slice into the free tree */
+/* number of pages prefaulted between checks for rescheduling and signals */
+#define BUS1_POOL_FAULT_BATCH (64)
+
+static bool bus1_pool_free_is_small(size_t free)
+{
+	return free <= BUS1_POOL_CLASS_MAX;
+}
+
+/* insert slice into the free tree, or its size-class list */
 static void bus1_pool_slice_link_free(struct bus1_pool_slice *slice,
 					 struct bus1_pool *pool)
 {
 	struct rb_node **n, *prev = NULL;
 	struct bus1_pool_slice *ps;
+	unsigned int class;
 
 	WARN_ON(slice->free == 0);
 
+	++pool->n_free;
+
+	if (bus1_pool_free_is_small(slice->free)) {
+		class = slice->free >> BUS1_POOL_CLASS_SHIFT;
+		list_add(&slice->class_entry, &pool->slices_class[class]);
+		__set_bit(class, pool->class_map);
+		return;
+	}
+
 	n = &pool->slices_free.rb_node;
 	while (*n) {
 		prev = *n;
@@ -48,6 +67,26 @@ static void bus1_pool_slice_link_free(struct bus1_pool_slice *slice,
 	rb_insert_color(&slice->rb_free, &pool->slices_free);
 }
 
+/* remove slice from the free tree, or its size-class list */
+static void bus1_pool_slice_unlink_free(struct bus1_pool_slice *slice,
+					struct bus1_pool *pool)
+{
+	unsigned int class;
+
+	WARN_ON(slice->free == 0);
+
+	--pool->n_free;
+
+	if (bus1_pool_free_is_small(slice->free)) {
+		class = slice->free >> BUS1_POOL_CLASS_SHIFT;
+		list_del(&slice->class_entry);
+		if (list_empty(&pool->slices_class[class]))
+			__clear_bit(class, pool->class_map);
+	} else {
+		rb_erase(&slice->rb_free, &pool->slices_free);
+	}
+}
+
 /* insert slice into the offset tree */
 static void bus1_pool_slice_link_offset(struct bus1_pool_slice *slice,
 					struct bus1_pool *pool)
@@ -72,7 +111,25 @@ static void bus1_pool_slice_link_offset(struct bus1_pool_slice *slice,
 	rb_link_node(&slice->rb_offset, prev, n);
 	rb_insert_color(&slice->rb_offset, &pool->slices_offset);
 
-	pool->allocated_size += slice->size;
+	WRITE_ONCE(pool->allocated_size, pool->allocated_size + slice->size);
+	WRITE_ONCE(pool->n_slices, pool->n_slices + 1);
+}
+
+/*
+ * Update the counters that depend on the last slice, after slices were added
+ * or removed. The total free space follows from @pool->size and
+ * @pool->allocated_size, so everything but the trailing free space is a hole.
+ */
+static void bus1_pool_update_stats(struct bus1_pool *pool)
+{
+	struct bus1_pool_slice *last;
+
+	last = list_last_entry(&pool->slices, struct bus1_pool_slice, entry);
+
+	WRITE_ONCE(pool->extent, last->offset + last->size);
+	WRITE_ONCE(pool->n_holes, pool->n_free - !!last->free);
+	WRITE_ONCE(pool->hole_size,
+		   pool->size - pool->allocated_size - last->free);
 }
 
 void bus1_pool_slice_init(struct bus1_pool_slice *slice)
@@ -115,8 +172,24 @@ static struct bus1_pool_slice *
 bus1_pool_slice_find_free(struct bus1_pool *pool, size_t size)
 {
 	struct bus1_pool_slice *ps, *closest = NULL;
+	unsigned long class;
 	struct rb_node *n;
 
+	/*
+	 * A size-class covers 8 bytes of free space, and allocation sizes are
+	 * 8-byte aligned. Hence, any entry of a class is suitable for all
+	 * sizes up to the lower class bound, and the first non-empty class,
+	 * starting at the class of @size, is the best fit.
+	 */
+	if (bus1_pool_free_is_small(size)) {
+		class = find_next_bit(pool->class_map, BUS1_POOL_N_CLASSES,
+				      size >> BUS1_POOL_CLASS_SHIFT);
+		if (class < BUS1_POOL_N_CLASSES)
+			return list_first_entry(&pool->slices_class[class],
+						struct bus1_pool_slice,
+						class_entry);
+	}
+
 	n = pool->slices_free.rb_node;
 	while (n) {
 		ps = container_of(n, struct bus1_pool_slice, rb_free);
@@ -133,6 +206,17 @@ bus1_pool_slice_find_free(struct bus1_pool *pool, size_t size)
 	return closest;
 }
 
+/* find free space for @size bytes behind the most recent slice, or wrapped */
+static struct bus1_pool_slice *
+bus1_pool_slice_find_next(struct bus1_pool *pool, size_t size)
+{
+	if (pool->head->free >= size)
+		return pool->head;
+	if (pool->root_slice.free >= size)
+		return &pool->root_slice;
+	return NULL;
+}
+
 /**
  * bus1_pool_slice_find_published() - find published slice in pool
  * @pool:	pool to operate on
@@ -170,54 +254,53 @@ bus1_pool_slice_find_published(struct bus1_pool *pool, size_t offset)
  * bus1_pool_init() - create memory pool
  * @pool:	pool to operate on
  * @filename:	name to use for the shmem-file (only visible via /proc)
+ * @cred:	credentials of the pool owner
  *
- * Initialize a new pool object.
+ * Initialize a new pool object. The backing shmem-file is not created here,
+ * but on first access via bus1_pool_mmap() or one of the write helpers. Hence,
+ * @filename must stay valid for the lifetime of @pool. The pool pins @cred, so
+ * the file is always created as the pool owner, regardless of which task first
+ * accesses it.
  *
  * Return: 0 on success, negative error code on failure.
  */
-int bus1_pool_init(struct bus1_pool *pool, const char *filename)
+int bus1_pool_init(struct bus1_pool *pool,
+		   const char *filename,
+		   const struct cred *cred)
 {
-	struct page *p;
-	struct file *f;
+	unsigned int i;
 	int r;
 
 	BUILD_BUG_ON(BUS1_POOL_SLICE_SIZE_MAX > U32_MAX);
+	BUILD_BUG_ON(BUS1_POOL_CLASS_MAX % (1 << BUS1_POOL_CLASS_SHIFT));
 
-	f = shmem_file_setup(filename, ALIGN(BUS1_POOL_SLICE_SIZE_MAX, 8),
-			     VM_NORESERVE);
-	if (IS_ERR(f))
-		return PTR_ERR(f);
-
-	r = get_write_access(file_inode(f));
-	if (r < 0) {
-		fput(f);
-		return r;
-	}
-
-	pool->f = f;
+	pool->f = NULL;
+	pool->filename = NULL;
+	pool->cred = NULL;
+	pool->size = BUS1_POOL_SLICE_SIZE_MAX;
 	pool->allocated_size = 0;
+	pool->n_slices = 0;
+	pool->n_free = 0;
+	pool->extent = 0;
+	pool->n_holes = 0;
+	pool->hole_size = 0;
 	INIT_LIST_HEAD(&pool->slices);
 	pool->slices_free = RB_ROOT;
 	pool->slices_offset = RB_ROOT;
+	for (i = 0; i < BUS1_POOL_N_CLASSES; ++i)
+		INIT_LIST_HEAD(&pool->slices_class[i]);
+	bitmap_zero(pool->class_map, BUS1_POOL_N_CLASSES);
+	pool->head = &pool->root_slice;
+	pool->ring = false;
 
 	bus1_pool_slice_init(&pool->root_slice);
 	r = bus1_pool_slice_link(pool, &pool->root_slice, 0, 0,
 				 BUS1_POOL_SLICE_SIZE_MAX, &pool->slices);
-	if (r < 0) {
-		fput(f);
+	if (r < 0)
 		return r;
-	}
-
-	/*
-	 * Touch first page of client pool so the initial allocation overhead
-	 * is done during peer setup rather than a message transaction. This is
-	 * really just an optimization to avoid some random peaks in common
-	 * paths. It is not meant as ultimate protection.
-	 */
-	p = shmem_read_mapping_page(file_inode(f)->i_mapping, 0);
-	if (!IS_ERR(p))
-		put_page(p);
 
+	pool->filename = filename;
+	pool->cred = get_cred(cred);
 	return 0;
 }
 
@@ -227,14 +310,14 @@ int bus1_pool_init(struct bus1_pool *pool, const char *filename)
  *
  * This destroys a pool that was previously create via bus1_pool_init(). The
  * caller must flush the pool before calling this. If NULL is passed, or if
- * @pool->f is NULL (i.e., the pool was initialized to 0 but not created via
- * bus1_pool_init(), yet), then this is a no-op.
+ * @pool->filename is NULL (i.e., the pool was initialized to 0 but not created
+ * via bus1_pool_init(), yet), then this is a no-op.
  *
  * The caller must make sure that no kernel reference to any slice exists.
  */
 void bus1_pool_deinit(struct bus1_pool *pool)
 {
-	if (!pool || !pool->f)
+	if (!pool || !pool->filename)
 		return;
 
 	WARN_ON(!list_is_singular(&pool->slices));
@@ -243,12 +326,145 @@ void bus1_pool_deinit(struct bus1_pool *pool)
 	WARN_ON(pool->root_slice.rb_free.rb_left != NULL);
 	WARN_ON(pool->root_slice.rb_free.rb_right != NULL);
 	WARN_ON(pool->root_slice.size != 0);
-	WARN_ON(pool->root_slice.free != BUS1_POOL_SLICE_SIZE_MAX);
+	WARN_ON(pool->root_slice.free != pool->size);
+	WARN_ON(!bitmap_empty(pool->class_map, BUS1_POOL_N_CLASSES));
 	WARN_ON(pool->allocated_size != 0);
+	WARN_ON(pool->n_slices != 0);
 
-	put_write_access(file_inode(pool->f));
-	fput(pool->f);
-	pool->f = NULL;
+	if (pool->f) {
+		put_write_access(file_inode(pool->f));
+		fput(pool->f);
+		pool->f = NULL;
+	}
+	put_cred(pool->cred);
+	pool->cred = NULL;
+	pool->filename = NULL;
+}
+
+/*
+ * Return the backing shmem-file of @pool, creating it on first use. Unlike all
+ * other pool operations, this can be called without the pool being locked:
+ * mmap and writes to allocated slices do not hold the pool lock. Hence, the
+ * file is installed atomically, and a racing loser drops its own copy.
+ *
+ * The first access is usually a write by a sender. The file is still set up
+ * with the credentials of the pool owner, so it is owned, and labeled, like it
+ * would have been if the owner had created it up-front.
+ */
+static struct file *bus1_pool_get_file(struct bus1_pool *pool)
+{
+	const struct cred *old_cred;
+	struct file *f, *old;
+	int r;
+
+	f = lockless_dereference(pool->f);
+	if (likely(f))
+		return f;
+
+	old_cred = override_creds(pool->cred);
+	f = shmem_file_setup(pool->filename, ALIGN(BUS1_POOL_SLICE_SIZE_MAX, 8),
+			     VM_NORESERVE);
+	revert_creds(old_cred);
+	if (IS_ERR(f))
+		return f;
+
+	r = get_write_access(file_inode(f));
+	if (r < 0) {
+		fput(f);
+		return ERR_PTR(r);
+	}
+
+	old = cmpxchg(&pool->f, NULL, f);
+	if (old) {
+		put_write_access(file_inode(f));
+		fput(f);
+		return old;
+	}
+
+	return f;
+}
+
+/**
+ * bus1_pool_resize() - change the usable size of a pool
+ * @pool:	pool to operate on
+ * @size:	new size in bytes
+ *
+ * This changes the number of bytes of @pool that slices are allocated from.
+ * The backing shmem-file always spans BUS1_POOL_SLICE_SIZE_MAX bytes, but any
+ * slice is placed entirely below @size. @size must be a non-zero multiple of
+ * the page size.
+ *
+ * The pool must not have any slices allocated.
+ *
+ * Return: 0 on success, -EINVAL if @size is invalid, -EBUSY if the pool is in
+ *         use.
+ */
+int bus1_pool_resize(struct bus1_pool *pool, size_t size)
+{
+	if (size < PAGE_SIZE || !PAGE_ALIGNED(size) ||
+	    size > BUS1_POOL_SLICE_SIZE_MAX)
+		return -EINVAL;
+	if (!list_is_singular(&pool->slices))
+		return -EBUSY;
+
+	/* the root-slice tracks all free space of an empty pool */
+	bus1_pool_slice_unlink_free(&pool->root_slice, pool);
+	pool->root_slice.free = size;
+	bus1_pool_slice_link_free(&pool->root_slice, pool);
+	pool->size = size;
+	bus1_pool_update_stats(pool);
+
+	return 0;
+}
+
+/**
+ * bus1_pool_prefault() - populate the backing memory of a pool
+ * @pool:	pool to operate on
+ * @size:	maximum number of bytes to populate
+ *
+ * This allocates the shmem pages backing the first @size bytes of @pool, but
+ * never more than @pool->size, so neither writes to new slices, nor the first
+ * fault of a reader, have to allocate memory. Faults of a reader then only map
+ * existing pages, and can be served via fault-around. The caller is charged for
+ * all the memory, hence @size should be bounded by the resource limits of the
+ * pool owner. The pages are allocated on the node of the caller. This bails out
+ * early if the caller is killed.
+ *
+ * The caller must serialize this against bus1_pool_resize(), but no other pool
+ * operation.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int bus1_pool_prefault(struct bus1_pool *pool, size_t size)
+{
+	struct address_space *mapping;
+	struct page *page;
+	struct file *f;
+	pgoff_t i, n;
+
+	f = bus1_pool_get_file(pool);
+	if (IS_ERR(f))
+		return PTR_ERR(f);
+
+	mapping = file_inode(f)->i_mapping;
+	n = DIV_ROUND_UP(min(size, pool->size), PAGE_SIZE);
+
+	for (i = 0; i < n; ++i) {
+		if (!(i % BUS1_POOL_FAULT_BATCH)) {
+			if (fatal_signal_pending(current))
+				return -EINTR;
+
+			cond_resched();
+		}
+
+		page = shmem_read_mapping_page(mapping, i);
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+
+		put_page(page);
+	}
+
+	return 0;
 }
 
 /**
@@ -282,8 +498,16 @@ int bus1_pool_alloc(struct bus1_pool *pool, struct bus1_pool_slice *slice,
 	if (slice_size == 0 || slice_size > BUS1_POOL_SLICE_SIZE_MAX)
 		return -EMSGSIZE;
 
-	/* find slice with smallest suitable trailing free space */
-	ps = bus1_pool_slice_find_free(pool, slice_size);
+	/*
+	 * In ring mode, continue behind the most recent slice. Otherwise, or
+	 * if that fails, find the slice with the smallest suitable trailing
+	 * free space.
+	 */
+	ps = NULL;
+	if (pool->ring)
+		ps = bus1_pool_slice_find_next(pool, slice_size);
+	if (!ps)
+		ps = bus1_pool_slice_find_free(pool, slice_size);
 	if (!ps)
 		return -EXFULL;
 
@@ -294,10 +518,12 @@ int bus1_pool_alloc(struct bus1_pool *pool, struct bus1_pool_slice *slice,
 		return r;
 
 	/* remove @ps from free tree */
-	rb_erase(&ps->rb_free, &pool->slices_free);
+	bus1_pool_slice_unlink_free(ps, pool);
 	ps->free = 0;
 
 	slice->allocated = true;
+	pool->head = slice;
+	bus1_pool_update_stats(pool);
 
 	return 0;
 }
@@ -324,18 +550,25 @@ int bus1_pool_dealloc(struct bus1_pool *pool, struct bus1_pool_slice *slice)
 	rb_erase(&slice->rb_offset, &pool->slices_offset);
 
 	if (slice->free > 0)
-		rb_erase(&slice->rb_free, &pool->slices_free);
+		bus1_pool_slice_unlink_free(slice, pool);
 
 	if (!WARN_ON(slice->size > pool->allocated_size))
-		pool->allocated_size -= slice->size;
+		WRITE_ONCE(pool->allocated_size,
+			   pool->allocated_size - slice->size);
+	WRITE_ONCE(pool->n_slices, pool->n_slices - 1);
 
 	ps = container_of(slice->entry.prev, struct bus1_pool_slice, entry);
 	if (ps->free)
-		rb_erase(&ps->rb_free, &pool->slices_free);
+		bus1_pool_slice_unlink_free(ps, pool);
 	ps->free += slice->size + slice->free;
 	bus1_pool_slice_link_free(ps, pool);
 
+	/* @ps now owns the space behind the most recent allocation */
+	if (pool->head == slice)
+		pool->head = ps;
+
 	list_del(&slice->entry);
+	bus1_pool_update_stats(pool);
 
 	slice->allocated = false;
 
@@ -400,6 +633,66 @@ struct bus1_pool_slice *bus1_pool_flush(struct bus1_pool *pool)
 	return list;
 }
 
+/**
+ * bus1_pool_get_stats() - query pool statistics
+ * @pool:	pool to query
+ * @stats:	output storage for the statistics
+ *
+ * This collects usage and fragmentation data of @pool in @stats. Free space
+ * trailing the last slice is not considered a hole, as the pool can always
+ * grow into it.
+ *
+ * The counters are maintained by every allocation and release, so this does
+ * not require the pool to be locked. Unlocked callers might see the counters
+ * of slightly different points in time, so this is meant for debugging only.
+ */
+void bus1_pool_get_stats(struct bus1_pool *pool, struct bus1_pool_stats *stats)
+{
+	stats->allocated_size = READ_ONCE(pool->allocated_size);
+	stats->extent = READ_ONCE(pool->extent);
+	stats->n_slices = READ_ONCE(pool->n_slices);
+	stats->n_holes = READ_ONCE(pool->n_holes);
+	stats->hole_size = READ_ONCE(pool->hole_size);
+}
+
+/**
+ * bus1_pool_count_nodes() - count backing pages per NUMA node
+ * @pool:	pool to query
+ * @n_pages:	output array of nr_node_ids counters
+ *
+ * This walks the page-cache of @pool and counts the allocated backing pages
+ * per NUMA node in @n_pages, which must be zeroed by the caller. Pages that are
+ * swapped out are not counted.
+ *
+ * This is linear in the number of allocated pages, and meant for debugging
+ * only. It does not require any pool lock.
+ */
+void bus1_pool_count_nodes(struct bus1_pool *pool, unsigned long *n_pages)
+{
+	struct address_space *mapping;
+	struct page *pages[16];
+	unsigned int i, n;
+	pgoff_t index = 0;
+	struct file *f;
+
+	f = lockless_dereference(pool->f);
+	if (!f)
+		return;
+
+	mapping = file_inode(f)->i_mapping;
+
+	while ((n = find_get_pages(mapping, index, ARRAY_SIZE(pages),
+				   pages)) > 0) {
+		for (i = 0; i < n; ++i) {
+			++n_pages[page_to_nid(pages[i])];
+			index = pages[i]->index + 1;
+			put_page(pages[i]);
+		}
+
+		cond_resched();
+	}
+}
+
 /**
  * bus1_pool_mmap() - mmap the pool
  * @pool:		pool to operate on
@@ -412,17 +705,23 @@ struct bus1_pool_slice *bus1_pool_flush(struct bus1_pool *pool)
  */
 int bus1_pool_mmap(struct bus1_pool *pool, struct vm_area_struct *vma)
 {
+	struct file *f;
+
 	if (unlikely(vma->vm_flags & VM_WRITE))
 		return -EPERM; /* deny write-access to the pool */
 
+	f = bus1_pool_get_file(pool);
+	if (IS_ERR(f))
+		return PTR_ERR(f);
+
 	/* replace the connection file with our shmem file */
 	if (vma->vm_file)
 		fput(vma->vm_file);
-	vma->vm_file = get_file(pool->f);
+	vma->vm_file = get_file(f);
 	vma->vm_flags &= ~VM_MAYWRITE;
 
 	/* calls into shmem_mmap(), which simply sets vm_ops */
-	return pool->f->f_op->mmap(pool->f, vma);
+	return f->f_op->mmap(f, vma);
 }
 
 /**
@@ -447,6 +746,7 @@ ssize_t bus1_pool_write_iovec(struct bus1_pool *pool,
 			      size_t total_len)
 {
 	struct iov_iter iter;
+	struct file *f;
 	ssize_t len;
 
 	if (WARN_ON(offset + total_len < offset) ||
@@ -456,10 +756,14 @@ ssize_t bus1_pool_write_iovec(struct bus1_pool *pool,
 	if (total_len < 1)
 		return 0;
 
+	f = bus1_pool_get_file(pool);
+	if (IS_ERR(f))
+		return PTR_ERR(f);
+
 	offset += slice->offset;
 	iov_iter_init(&iter, WRITE, iov, n_iov, total_len);
 
-	len = vfs_iter_write(pool->f, &iter, &offset);
+	len = vfs_iter_write(f, &iter, &offset);
 
 	return (len >= 0 && len != total_len) ? -EFAULT : len;
 }
@@ -487,6 +791,7 @@ ssize_t bus1_pool_write_kvec(struct bus1_pool *pool,
 {
 	struct iov_iter iter;
 	mm_segment_t old_fs;
+	struct file *f;
 	ssize_t len;
 
 	if (WARN_ON(offset + total_len < offset) ||
@@ -496,12 +801,16 @@ ssize_t bus1_pool_write_kvec(struct bus1_pool *pool,
 	if (total_len < 1)
 		return 0;
 
+	f = bus1_pool_get_file(pool);
+	if (IS_ERR(f))
+		return PTR_ERR(f);
+
 	offset += slice->offset;
 	iov_iter_kvec(&iter, WRITE | ITER_KVEC, iov, n_iov, total_len);
 
 	old_fs = get_fs();
 	set_fs(get_ds());
-	len = vfs_iter_write(pool->f, &iter, &offset);
+	len = vfs_iter_write(f, &iter, &offset);
 	set_fs(old_fs);
 
 	return (len >= 0 && len != total_len) ? -EFAULT : len;
@@ -25,16 +25,27 @@
  * access, but published slices are not altered.
  */
 
+#include <linux/bitops.h>
 #include <linux/kernel.h>
+#include <linux/list.h>
 #include <linux/rbtree.h>
 #include <linux/types.h>
 
+struct cred;
 struct file;
 struct iovec;
 struct kvec;
 
 #define BUS1_POOL_SLICE_SIZE_MAX (U32_MAX)
 
+/*
+ * Free space of up to BUS1_POOL_CLASS_MAX bytes is kept in segregated
+ * size-class lists, rather than the free tree. Each class covers 8 bytes.
+ */
+#define BUS1_POOL_CLASS_SHIFT (3)
+#define BUS1_POOL_CLASS_MAX (512)
+#define BUS1_POOL_N_CLASSES ((BUS1_POOL_CLASS_MAX >> BUS1_POOL_CLASS_SHIFT) + 1)
+
 /**
  * struct bus1_pool_slice - pool slice
  * @offset:		relative offset in parent pool
@@ -44,6 +55,7 @@ struct kvec;
  * @entry:		link into linear list of slices
  * @rb_offset:		link to slice rb-tree, indexed by offset
  * @rb_free:		link to slice rb-tree, indexed by free size
+ * @class_entry:	link into size-class list, if free space is small
  * @next:		single-linked utility list
  *
  * Each chunk of memory in the pool is managed as a slice. A slice can be
@@ -64,7 +76,8 @@ struct kvec;
  * published several times does not increase the reference count.
  *
  * Each slice keeps track of the amount of free space after it in the pool, so
- * the free space can be reused in case of fragmentation.
+ * the free space can be reused in case of fragmentation. Small amounts of free
+ * space are linked into a size-class list, larger ones into the free tree.
  */
 struct bus1_pool_slice {
 	u32 offset;
@@ -76,19 +89,34 @@ struct bus1_pool_slice {
 
 	struct list_head entry;
 	struct rb_node rb_offset;
-	struct rb_node rb_free;
+	union {
+		struct rb_node rb_free;
+		struct list_head class_entry;
+	};
 
 	struct bus1_pool_slice *next;
 };
 
 /**
  * struct bus1_pool - client pool
- * @f:			backing shmem file
+ * @f:			backing shmem file, or NULL if not created, yet
+ * @filename:		name of the shmem file, NULL if not initialized
+ * @cred:		credentials used to create the shmem file
+ * @size:		number of bytes available for slices
  * @allocated_size:	currently allocated memory in bytes
+ * @n_slices:		number of allocated slices
+ * @n_free:		number of slices with free space behind them
+ * @extent:		end offset of the last allocated slice
+ * @n_holes:		number of free extents in front of the last slice
+ * @hole_size:		total size of those free extents in bytes
  * @slices:		all slices sorted by address
  * @slices_offset:	tree of slices, by offset
  * @slices_free:	tree of slices, by free size
+ * @slices_class:	lists of slices with small free space, by size-class
+ * @class_map:		bitmap of non-empty size-class lists
  * @root_slice:		slice tracking free space of the empty pool
+ * @head:		most recently allocated slice, or @root_slice
+ * @ring:		whether to allocate next-fit, in ring order
  *
  * A pool is used to allocate memory slices that can be shared between
  * kernel-space and user-space. A pool is always backed by a shmem-file and puts
@@ -100,23 +128,83 @@ struct bus1_pool_slice {
  * Instead, the kernel simply allocates slices in the pool and tells user-space
  * where it put the data.
  *
+ * Allocations are best-fit. Free space larger than BUS1_POOL_CLASS_MAX is
+ * tracked in a tree, ordered by size. Smaller free space is kept in one list
+ * per 8-byte size-class, and a bitmap of non-empty classes is used to find the
+ * smallest suitable class. Hence, for the common case of small messages,
+ * allocation and release do not require any tree walks on the free space.
+ *
+ * If @ring is set, allocations are placed right behind the most recent one,
+ * wrapping around to the start of the pool once the end is reached. For
+ * receivers that release slices in the order they were received, this places
+ * all payloads contiguously, and in order, and avoids fragmentation with mixed
+ * sizes. Holes left by out-of-order releases are skipped, as long as the space
+ * behind the most recent slice suffices. Only if neither that space, nor the
+ * space at the start of the pool is large enough, best-fit is used as fallback.
+ *
+ * Slices are only placed in the first @size bytes of the pool, which can be
+ * changed via bus1_pool_resize() while the pool is empty.
+ *
+ * Backing pages are allocated on first write, usually by the sender, and thus
+ * on the node of the sending CPU. A receiver can prefault the pool to have the
+ * pages allocated, and charged, on its own node instead.
+ *
+ * The backing shmem file is only created once the pool is written to, or
+ * mapped, for the first time. Peers that never receive a message never pay
+ * for it. It is always created with @cred, the credentials of the pool owner,
+ * even if a sender triggers its creation.
+ *
  * All pool operations must be serialized by the caller. No internal lock is
  * provided. Slices can be queried/modified unlocked. But any pool operation
- * (allocation, release, flush, ...) must be serialized.
+ * (allocation, release, flush, ...) must be serialized. The usage counters
+ * are updated by every allocation and release, so bus1_pool_get_stats() can
+ * read them without serialization.
  */
 struct bus1_pool {
 	struct file *f;
+	const char *filename;
+	const struct cred *cred;
+	size_t size;
 	size_t allocated_size;
+	size_t n_slices;
+	size_t n_free;
+	size_t extent;
+	size_t n_holes;
+	size_t hole_size;
 	struct list_head slices;
 	struct rb_root slices_offset;
 	struct rb_root slices_free;
+	struct list_head slices_class[BUS1_POOL_N_CLASSES];
+	DECLARE_BITMAP(class_map, BUS1_POOL_N_CLASSES);
 	struct bus1_pool_slice root_slice;
+	struct bus1_pool_slice *head;
+	bool ring;
 };
 
 #define BUS1_POOL_NULL ((struct bus1_pool){})
 
-int bus1_pool_init(struct bus1_pool *pool, const char *filename);
+/**
+ * struct bus1_pool_stats - pool statistics
+ * @allocated_size:	currently allocated memory in bytes
+ * @extent:		end offset of the last allocated slice
+ * @n_slices:		number of allocated slices
+ * @n_holes:		number of free extents in front of the last slice
+ * @hole_size:		total size of those free extents in bytes
+ */
+struct bus1_pool_stats {
+	size_t allocated_size;
+	size_t extent;
+	size_t n_slices;
+	size_t n_holes;
+	size_t hole_size;
+};
+
+int bus1_pool_init(struct bus1_pool *pool,
+		   const char *filename,
+		   const struct cred *cred);
 void bus1_pool_deinit(struct bus1_pool *pool);
+int bus1_pool_resize(struct bus1_pool *pool, size_t size);
+int bus1_pool_prefault(struct bus1_pool *pool, size_t size);
 
 void bus1_pool_slice_init(struct bus1_pool_slice *slice);
 
@@ -131,6 +219,8 @@ struct bus1_pool_slice *
 bus1_pool_slice_find_published(struct bus1_pool *pool, size_t offset);
 
 struct bus1_pool_slice *bus1_pool_flush(struct bus1_pool *pool);
+void bus1_pool_get_stats(struct bus1_pool *pool, struct bus1_pool_stats *stats);
+void bus1_pool_count_nodes(struct bus1_pool *pool, unsigned long *n_pages);
 
 int bus1_pool_mmap(struct bus1_pool *pool, struct vm_area_struct *vma);
 ssize_t bus1_pool_write_iovec(struct bus1_pool *pool,
@@ -9,6 +9,7 @@
 
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 #include <linux/kernel.h>
+#include <linux/poll.h>
 #include <linux/rbtree.h>
 #include <linux/rcupdate.h>
 #include <linux/sched.h>
@@ -52,8 +53,11 @@ void bus1_queue_init(struct bus1_queue *queue)
 	queue->clock = 0;
 	queue->flush = 0;
 	queue->leftmost = NULL;
+	queue->rightmost = NULL;
 	rcu_assign_pointer(queue->front, NULL);
 	queue->messages = RB_ROOT;
+	queue->n_committed = 0;
+	queue->n_staged = 0;
 }
 
 /**
@@ -73,7 +77,10 @@ void bus1_queue_deinit(struct bus1_queue *queue)
 {
 	WARN_ON(!RB_EMPTY_ROOT(&queue->messages));
 	WARN_ON(queue->leftmost);
+	WARN_ON(queue->rightmost);
 	WARN_ON(rcu_access_pointer(queue->front));
+	WARN_ON(queue->n_committed);
+	WARN_ON(queue->n_staged);
 }
 
 /**
@@ -95,6 +102,7 @@ void bus1_queue_deinit(struct bus1_queue *queue)
 struct bus1_queue_node *bus1_queue_flush(struct bus1_queue *queue, u64 ts)
 {
 	struct bus1_queue_node *node, *list = NULL;
+	size_t n_flushed = 0;
 	struct rb_node *n;
 
 	/*
@@ -115,6 +123,7 @@ struct bus1_queue_node *bus1_queue_flush(struct bus1_queue *queue, u64 ts)
 
 	rcu_assign_pointer(queue->front, NULL);
 	queue->leftmost = NULL;
+	queue->rightmost = NULL;
 	queue->flush = ts;
 
 	n = rb_first(&queue->messages);
@@ -128,22 +137,26 @@ struct bus1_queue_node *bus1_queue_flush(struct bus1_queue *queue, u64 ts)
 			RB_CLEAR_NODE(&node->rb);
 			node->next = list;
 			list = node;
-		} else if (!queue->leftmost) {
-			queue->leftmost = &node->rb;
+			++n_flushed;
+		} else {
+			if (!queue->leftmost)
+				queue->leftmost = &node->rb;
+			queue->rightmost = &node->rb;
 		}
 	}
 
+	WRITE_ONCE(queue->n_committed, queue->n_committed - n_flushed);
+
 	return list;
 }
 
-static void bus1_queue_add(struct bus1_queue *queue,
-			   wait_queue_head_t *waitq,
+static bool bus1_queue_add(struct bus1_queue *queue,
 			   struct bus1_queue_node *node,
 			   u64 timestamp)
 {
 	struct rb_node *front, *n, **slot;
 	struct bus1_queue_node *iter;
-	bool is_leftmost, readable;
+	bool is_leftmost, is_rightmost, readable;
 	u64 ts;
 	int r;
 
@@ -152,16 +165,16 @@ static void bus1_queue_add(struct bus1_queue *queue,
 
 	/* provided timestamp must be valid */
 	if (WARN_ON(timestamp == 0 || timestamp > queue->clock + 1))
-		return;
+		return false;
 	/* if unstamped, it must be unlinked, and vice versa */
 	if (WARN_ON(!ts == !RB_EMPTY_NODE(&node->rb)))
-		return;
+		return false;
 	/* if stamped, it must be a valid staging timestamp from earlier */
 	if (WARN_ON(ts != 0 && (!(ts & 1) || timestamp < ts)))
-		return;
+		return false;
 	/* nothing to do? */
 	if (ts == timestamp)
-		return;
+		return false;
 
 	/*
 	 * We update the timestamp of @node *before* erasing it. This
@@ -207,28 +220,63 @@ static void bus1_queue_add(struct bus1_queue *queue,
 	}
 
 	/* must be staging, so it cannot be pointed to by queue->front */
-	if (!RB_EMPTY_NODE(&node->rb))
+	if (!RB_EMPTY_NODE(&node->rb)) {
+		if (&node->rb == queue->rightmost)
+			queue->rightmost = rb_prev(&node->rb);
 		rb_erase(&node->rb, &queue->messages);
+		WRITE_ONCE(queue->n_staged, queue->n_staged - 1);
+	}
 
-	/* re-insert into sorted rb-tree with new timestamp */
-	slot = &queue->messages.rb_node;
-	n = NULL;
+	/*
+	 * Re-insert into sorted rb-tree with new timestamp. Commits almost
+	 * always order after all other entries, so check the right-most entry
+	 * first. If we order after it, we can link ourselves as its right
+	 * child directly, without walking the tree. Otherwise, fall back to
+	 * the regular lookup.
+	 *
+	 * A separate FIFO list of committed entries would avoid the tree for
+	 * appends entirely. It is not used, since the rb-linkage is the only
+	 * record of whether a node is queued, which bus1_queue_node_is_queued()
+	 * and its RCU readers rely on, and a node embedded in a message or
+	 * handle cannot sit in two orders at once. With the cached right-most
+	 * entry, an append costs only the rebalancing in rb_insert_color(),
+	 * which is amortized O(1).
+	 */
+	n = queue->rightmost;
 	is_leftmost = true;
-	while (*slot) {
-		n = *slot;
-		iter = container_of(n, struct bus1_queue_node, rb);
-		r = bus1_queue_node_order(node, iter);
-		if (r < 0) {
-			slot = &n->rb_left;
-		} else /* if (r >= 0) */ {
-			slot = &n->rb_right;
-			is_leftmost = false;
+	is_rightmost = true;
+	if (n && bus1_queue_node_order(node, container_of(n,
+						struct bus1_queue_node,
+						rb)) > 0) {
+		slot = &n->rb_right;
+		is_leftmost = false;
+	} else {
+		slot = &queue->messages.rb_node;
+		n = NULL;
+		while (*slot) {
+			n = *slot;
+			iter = container_of(n, struct bus1_queue_node, rb);
+			r = bus1_queue_node_order(node, iter);
+			if (r < 0) {
+				slot = &n->rb_left;
+				is_rightmost = false;
+			} else /* if (r >= 0) */ {
+				slot = &n->rb_right;
+				is_leftmost = false;
+			}
 		}
 	}
 
 	rb_link_node(&node->rb, n, slot);
 	rb_insert_color(&node->rb, &queue->messages);
 
+	if (timestamp & 1)
+		WRITE_ONCE(queue->n_staged, queue->n_staged + 1);
+	else
+		WRITE_ONCE(queue->n_committed, queue->n_committed + 1);
+
+	if (is_rightmost)
+		queue->rightmost = &node->rb;
 	if (is_leftmost) {
 		queue->leftmost = &node->rb;
 		if (!(timestamp & 1))
@@ -237,8 +285,7 @@ static void bus1_queue_add(struct bus1_queue *queue,
 			WARN_ON(readable);
 	}
 
-	if (waitq && !readable && rcu_access_pointer(queue->front))
-		wake_up_interruptible(waitq);
+	return !readable && rcu_access_pointer(queue->front);
 }
 
 /**
@@ -265,7 +312,7 @@ u64 bus1_queue_stage(struct bus1_queue *queue,
 	WARN_ON(bus1_queue_node_is_queued(node));
 
 	timestamp = bus1_queue_sync(queue, timestamp);
-	bus1_queue_add(queue, NULL, node, timestamp + 1);
+	bus1_queue_add(queue, node, timestamp + 1);
 	WARN_ON(rcu_access_pointer(queue->front) == &node->rb);
 
 	return timestamp;
@@ -274,7 +321,6 @@ u64 bus1_queue_stage(struct bus1_queue *queue,
 /**
  * bus1_queue_commit_staged() - commit staged queue entry with new timestamp
  * @queue:			queue to operate on
- * @waitq:			wait-queue to wake up on change, or NULL
  * @node:			queue entry to commit
  * @timestamp:			new timestamp for @node
  *
@@ -284,37 +330,78 @@ u64 bus1_queue_stage(struct bus1_queue *queue,
  * Furthermore, the queue clock must be synced with the new timestamp *before*
  * staging an entry. Similarly, the timestamp of an entry can only be
  * increased, never decreased.
+ *
+ * No wake-up is done by this function. If the queue became readable, the
+ * caller is expected to wake up any waiters, preferably after it dropped its
+ * locks. This allows waking up each destination just once per transaction,
+ * and keeps the wake-up out of the critical section.
+ *
+ * Return: True if @queue became readable, false if not.
  */
-void bus1_queue_commit_staged(struct bus1_queue *queue,
-			      wait_queue_head_t *waitq,
+bool bus1_queue_commit_staged(struct bus1_queue *queue,
 			      struct bus1_queue_node *node,
 			      u64 timestamp)
 {
 	WARN_ON(timestamp & 1);
 	WARN_ON(!bus1_queue_node_is_queued(node));
 
-	bus1_queue_add(queue, waitq, node, timestamp);
+	return bus1_queue_add(queue, node, timestamp);
 }
 
 /**
  * bus1_queue_commit_unstaged() - commit unstaged queue entry with new timestamp
  * @queue:			queue to operate on
- * @waitq:			wait-queue to wake up on change, or NULL
  * @node:			queue entry to commit
  *
  * Directly commit an unstaged queue entry to the destination queue. The entry
  * must not be queued, yet.
  *
  * The destination queue is ticked and the resulting timestamp is used to commit
- * the queue entry.
+ * the queue entry. Like bus1_queue_commit_staged(), this leaves the wake-up to
+ * the caller.
+ *
+ * Return: True if @queue became readable, false if not.
  */
-void bus1_queue_commit_unstaged(struct bus1_queue *queue,
-				wait_queue_head_t *waitq,
+bool bus1_queue_commit_unstaged(struct bus1_queue *queue,
 				struct bus1_queue_node *node)
 {
 	WARN_ON(bus1_queue_node_is_queued(node));
 
-	bus1_queue_add(queue, waitq, node, bus1_queue_tick(queue));
+	return bus1_queue_add(queue, node, bus1_queue_tick(queue));
+}
+
+/**
+ * bus1_queue_commit_grouped() - commit unstaged queue entry into last group
+ * @queue:			queue to operate on
+ * @node:			queue entry to commit
+ *
+ * This is like bus1_queue_commit_unstaged(), but if the right-most entry of
+ * @queue is a committed entry of the same type and group as @node, and was
+ * committed with the current queue clock, @node is committed with that very
+ * same timestamp instead of ticking the clock. Both entries then form a
+ * single group, which is reported as one block to the reader. Since the clock
+ * was not touched in between, no-one can have ordered anything between both
+ * entries, so this is indistinguishable from committing both at once.
+ *
+ * Return: True if @queue became readable, false if not.
+ */
+bool bus1_queue_commit_grouped(struct bus1_queue *queue,
+			       struct bus1_queue_node *node)
+{
+	struct bus1_queue_node *t;
+	u64 ts;
+
+	WARN_ON(bus1_queue_node_is_queued(node));
+
+	if (queue->rightmost) {
+		t = container_of(queue->rightmost, struct bus1_queue_node, rb);
+		ts = bus1_queue_node_get_timestamp(t);
+		if (!(ts & 1) && ts == queue->clock && t->group == node->group &&
+		    bus1_queue_node_get_type(t) == bus1_queue_node_get_type(node))
+			return bus1_queue_add(queue, node, ts);
+	}
+
+	return bus1_queue_add(queue, node, bus1_queue_tick(queue));
 }
 
 /**
@@ -348,7 +435,7 @@ bool bus1_queue_commit_synthetic(struct bus1_queue *queue,
 		r = bus1_queue_compare(bus1_queue_node_get_timestamp(t),
 				       t->group, timestamp, node->group);
 		if (r < 0 || (r == 0 && node < t)) {
-			bus1_queue_add(queue, NULL, node, timestamp);
+			bus1_queue_add(queue, node, timestamp);
 			WARN_ON(rcu_access_pointer(queue->front) == &node->rb);
 			queued = true;
 		}
@@ -366,6 +453,10 @@ bool bus1_queue_commit_synthetic(struct bus1_queue *queue,
  * This unlinks @node and fully removes it from the queue @queue. If you want
  * to re-insert the node into a queue, you must re-initialize it first.
  *
+ * Removing an entry only makes the queue readable if it was a staging entry
+ * blocking the queue, which is rare. Hence, unlike the commit helpers, this
+ * wakes up @waitq directly in that case.
+ *
  * It is an error to call this on an unlinked entry.
  */
 void bus1_queue_remove(struct bus1_queue *queue,
@@ -397,11 +488,35 @@ void bus1_queue_remove(struct bus1_queue *queue,
 			rcu_assign_pointer(queue->front, NULL);
 	}
 
+	if (queue->rightmost == &node->rb)
+		queue->rightmost = rb_prev(queue->rightmost);
+
 	rb_erase(&node->rb, &queue->messages);
 	RB_CLEAR_NODE(&node->rb);
 
+	if (bus1_queue_node_is_staging(node))
+		WRITE_ONCE(queue->n_staged, queue->n_staged - 1);
+	else
+		WRITE_ONCE(queue->n_committed, queue->n_committed - 1);
+
 	if (waitq && !readable && rcu_access_pointer(queue->front))
-		wake_up_interruptible(waitq);
+		wake_up_interruptible_poll(waitq, POLLIN | POLLRDNORM);
+}
+
+static bool bus1_queue_node_has_more(struct bus1_queue_node *node)
+{
+	struct bus1_queue_node *t;
+	struct rb_node *n;
+
+	n = rb_next(&node->rb);
+	if (!n)
+		return false;
+
+	t = container_of(n, struct bus1_queue_node, rb);
+	return !bus1_queue_compare(bus1_queue_node_get_timestamp(node),
+				   node->group,
+				   bus1_queue_node_get_timestamp(t),
+				   t->group);
 }
 
 /**
@@ -425,7 +540,7 @@ void bus1_queue_remove(struct bus1_queue *queue,
  */
 struct bus1_queue_node *bus1_queue_peek(struct bus1_queue *queue, bool *morep)
 {
-	struct bus1_queue_node *node, *t;
+	struct bus1_queue_node *node;
 	struct rb_node *n;
 
 	n = rcu_dereference_raw(queue->front);
@@ -433,13 +548,61 @@ struct bus1_queue_node *bus1_queue_peek(struct bus1_queue *queue, bool *morep)
 		return NULL;
 
 	node = container_of(n, struct bus1_queue_node, rb);
-	n = rb_next(n);
-	if (n)
-		t = container_of(n, struct bus1_queue_node, rb);
-
-	*morep = n && !bus1_queue_compare(bus1_queue_node_get_timestamp(node),
-					  node->group,
-					  bus1_queue_node_get_timestamp(t),
-					  t->group);
+	*morep = bus1_queue_node_has_more(node);
+	return node;
+}
+
+/**
+ * bus1_queue_peek_next() - peek available entry following another one
+ * @queue:			queue to operate on
+ * @node:			available entry to start at
+ * @morep:			where to store group-state
+ *
+ * This is like bus1_queue_peek(), but rather than the front of the queue, it
+ * returns the available entry that follows @node. @node must have been
+ * returned by bus1_queue_peek() or bus1_queue_peek_next() before, without the
+ * queue being modified in between. This allows the caller to pick entries
+ * from the middle of the queue.
+ *
+ * A staging entry blocks everything ordered after it, so the walk stops at the
+ * first staging entry.
+ *
+ * Return: Pointer to next available entry, NULL if none available.
+ */
+struct bus1_queue_node *bus1_queue_peek_next(struct bus1_queue *queue,
+					     struct bus1_queue_node *node,
+					     bool *morep)
+{
+	struct rb_node *n;
+
+	n = rb_next(&node->rb);
+	if (!n)
+		return NULL;
+
+	node = container_of(n, struct bus1_queue_node, rb);
+	if (bus1_queue_node_is_staging(node))
+		return NULL;
+
+	*morep = bus1_queue_node_has_more(node);
 	return node;
 }
+
+/**
+ * bus1_queue_count() - count queued entries
+ * @queue:			queue to operate on
+ * @n_committedp:		output storage for number of committed entries
+ * @n_stagedp:			output storage for number of staging entries
+ *
+ * This returns the number of committed and staging entries of @queue. The
+ * counters are maintained whenever entries are linked or unlinked, so this
+ * does not require the queue to be locked. Unlocked callers might see the two
+ * counters of slightly different points in time, so this is meant for
+ * debugging only.
+ */
+void bus1_queue_count(struct bus1_queue *queue,
+		      size_t *n_committedp,
+		      size_t *n_stagedp)
+{
+	*n_committedp = READ_ONCE(queue->n_committed);
+	*n_stagedp = READ_ONCE(queue->n_staged);
+}
@@ -75,7 +75,9 @@
  *       conflicting tasks.
  *
  * The queue implementation uses an rb-tree (ordered by timestamps and sender),
- * with a cached pointer to the front of the queue.
+ * with a cached pointer to the front of the queue. The right-most entry is
+ * cached as well: commits almost always carry the highest timestamp of a
+ * queue, so they are appended without walking the tree.
  */
 
 #include <linux/kernel.h>
@@ -113,15 +115,21 @@ struct bus1_queue_node {
  * @clock:			local clock (used for Lamport Timestamps)
  * @flush:			last flush timestamp
  * @leftmost:			cached left-most entry
+ * @rightmost:			cached right-most entry
  * @front:			cached front entry
  * @messages:			queued messages
+ * @n_committed:		number of committed entries
+ * @n_staged:			number of staging entries
  */
 struct bus1_queue {
 	u64 clock;
 	u64 flush;
 	struct rb_node *leftmost;
+	struct rb_node *rightmost;
 	struct rb_node __rcu *front;
 	struct rb_root messages;
+	size_t n_committed;
+	size_t n_staged;
 };
 
 void bus1_queue_init(struct bus1_queue *queue);
@@ -130,13 +138,13 @@ struct bus1_queue_node *bus1_queue_flush(struct bus1_queue *queue, u64 ts);
 u64 bus1_queue_stage(struct bus1_queue *queue,
 		     struct bus1_queue_node *node,
 		     u64 timestamp);
-void bus1_queue_commit_staged(struct bus1_queue *queue,
-			      wait_queue_head_t *waitq,
+bool bus1_queue_commit_staged(struct bus1_queue *queue,
 			      struct bus1_queue_node *node,
 			      u64 timestamp);
-void bus1_queue_commit_unstaged(struct bus1_queue *queue,
-				wait_queue_head_t *waitq,
+bool bus1_queue_commit_unstaged(struct bus1_queue *queue,
 				struct bus1_queue_node *node);
+bool bus1_queue_commit_grouped(struct bus1_queue *queue,
+			       struct bus1_queue_node *node);
 bool bus1_queue_commit_synthetic(struct bus1_queue *queue,
 				 struct bus1_queue_node *node,
 				 u64 timestamp);
@@ -144,6 +152,12 @@ void bus1_queue_remove(struct bus1_queue *queue,
 		       wait_queue_head_t *waitq,
 		       struct bus1_queue_node *node);
 struct bus1_queue_node *bus1_queue_peek(struct bus1_queue *queue, bool *morep);
+struct bus1_queue_node *bus1_queue_peek_next(struct bus1_queue *queue,
+					     struct bus1_queue_node *node,
+					     bool *morep);
+void bus1_queue_count(struct bus1_queue *queue,
+		      size_t *n_committedp,
+		      size_t *n_stagedp);
 
 /**
  * bus1_queue_node_init() - initialize queue node
@@ -70,6 +70,24 @@ bus1_ioctl_handle_transfer(int fd, struct bus1_cmd_handle_transfer *cmd)
 	return bus1_ioctl(fd, BUS1_CMD_HANDLE_TRANSFER, cmd);
 }
 
+static inline int
+bus1_ioctl_handles_release(int fd, struct bus1_cmd_handles_release *cmd)
+{
+	static_assert(_IOC_SIZE(BUS1_CMD_HANDLES_RELEASE) == sizeof(*cmd),
+		      "ioctl is called with invalid argument size");
+
+	return bus1_ioctl(fd, BUS1_CMD_HANDLES_RELEASE, cmd);
+}
+
+static inline int
+bus1_ioctl_handles_transfer(int fd, struct bus1_cmd_handles_transfer *cmd)
+{
+	static_assert(_IOC_SIZE(BUS1_CMD_HANDLES_TRANSFER) == sizeof(*cmd),
+		      "ioctl is called with invalid argument size");
+
+	return bus1_ioctl(fd, BUS1_CMD_HANDLES_TRANSFER, cmd);
+}
+
 static inline int
 bus1_ioctl_nodes_destroy(int fd, struct bus1_cmd_nodes_destroy *cmd)
 {
@@ -88,6 +106,24 @@ bus1_ioctl_slice_release(int fd, uint64_t *cmd)
 	return bus1_ioctl(fd, BUS1_CMD_SLICE_RELEASE, cmd);
 }
 
+static inline int
+bus1_ioctl_slices_release(int fd, struct bus1_cmd_slices_release *cmd)
+{
+	static_assert(_IOC_SIZE(BUS1_CMD_SLICES_RELEASE) == sizeof(*cmd),
+		      "ioctl is called with invalid argument size");
+
+	return bus1_ioctl(fd, BUS1_CMD_SLICES_RELEASE, cmd);
+}
+
+static inline int
+bus1_ioctl_slice_install_fds(int fd, struct bus1_cmd_slice_install_fds *cmd)
+{
+	static_assert(_IOC_SIZE(BUS1_CMD_SLICE_INSTALL_FDS) == sizeof(*cmd),
+		      "ioctl is called with invalid argument size");
+
+	return bus1_ioctl(fd, BUS1_CMD_SLICE_INSTALL_FDS, cmd);
+}
+
 static inline int
 bus1_ioctl_send(int fd, struct bus1_cmd_send *cmd)
 {
@@ -97,6 +133,24 @@ bus1_ioctl_send(int fd, struct bus1_cmd_send *cmd)
 	return bus1_ioctl(fd, BUS1_CMD_SEND, cmd);
 }
 
+static inline int
+bus1_ioctl_set_register(int fd, struct bus1_cmd_set_register *cmd)
+{
+	static_assert(_IOC_SIZE(BUS1_CMD_SET_REGISTER) == sizeof(*cmd),
+		      "ioctl is called with invalid argument size");
+
+	return bus1_ioctl(fd, BUS1_CMD_SET_REGISTER, cmd);
+}
+
+static inline int
+bus1_ioctl_set_unregister(int fd, uint64_t *cmd)
+{
+	static_assert(_IOC_SIZE(BUS1_CMD_SET_UNREGISTER) == sizeof(*cmd),
+		      "ioctl is called with invalid argument size");
+
+	return bus1_ioctl(fd, BUS1_CMD_SET_UNREGISTER, cmd);
+}
+
 static inline int
 bus1_ioctl_recv(int fd, struct bus1_cmd_recv *cmd)
 {
@@ -106,6 +160,15 @@ bus1_ioctl_recv(int fd, struct bus1_cmd_recv *cmd)
 	return bus1_ioctl(fd, BUS1_CMD_RECV, cmd);
 }
 
+static inline int
+bus1_ioctl_recv_many(int fd, struct bus1_cmd_recv_many *cmd)
+{
+	static_assert(_IOC_SIZE(BUS1_CMD_RECV_MANY) == sizeof(*cmd),
+		      "ioctl is called with invalid argument size");
+
+	return bus1_ioctl(fd, BUS1_CMD_RECV_MANY, cmd);
+}
+
 #ifdef __cplusplus
 }
 #endif
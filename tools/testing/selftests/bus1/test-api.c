@@ -8,7 +8,9 @@
  */
 
 #define _GNU_SOURCE
+#include <poll.h>
 #include <stdlib.h>
+#include <time.h>
 #include "test.h"
 
 /* make sure /dev/busX exists, is a cdev and accessible */
@@ -44,6 +46,10 @@ static void test_api_connect(void)
 		.max_handles		= -1,
 		.max_inflight_bytes	= -1,
 		.max_inflight_fds	= -1,
+		.recv_timeout_ns	= -1,
+		.recv_busy_poll_ns	= -1,
+		.pool_size		= -1,
+		.send_timeout_ns	= -1,
 	};
 	const uint8_t *map1;
 	size_t n_map1;
@@ -109,6 +115,79 @@ static void test_api_transfer(void)
 	test_close(fd1, map1, n_map1);
 }
 
+/* transfer and release several handles with a single call each */
+static void test_api_handles_batch(void)
+{
+	struct bus1_cmd_handles_transfer cmd_transfer;
+	struct bus1_cmd_handles_release cmd_release;
+	uint64_t src[] = { 0x100, 0x200, BUS1_HANDLE_FLAG_MANAGED | 0x300 };
+	uint64_t dst[3], ids[4], errors[4];
+	const uint8_t *map1, *map2;
+	size_t n_map1, n_map2;
+	int r, fd1, fd2;
+
+	/* setup */
+
+	fd1 = test_open(&map1, &n_map1);
+	fd2 = test_open(&map2, &n_map2);
+
+	/* import two handles from @fd1 into @fd2, plus an invalid one */
+
+	memset(errors, 0xff, sizeof(errors));
+	cmd_transfer = (struct bus1_cmd_handles_transfer){
+		.flags			= 0,
+		.dst_fd			= fd2,
+		.ptr_src_handles	= (unsigned long)src,
+		.ptr_dst_handles	= (unsigned long)dst,
+		.ptr_errors		= (unsigned long)errors,
+		.n_handles		= sizeof(src) / sizeof(*src),
+	};
+	r = bus1_ioctl_handles_transfer(fd1, &cmd_transfer);
+	assert(r >= 0);
+	assert(cmd_transfer.n_handles == 3);
+	assert(errors[0] == 0);
+	assert(errors[1] == 0);
+	assert(errors[2] == ENXIO);
+	assert(dst[0] & BUS1_HANDLE_FLAG_MANAGED);
+	assert(dst[0] & BUS1_HANDLE_FLAG_REMOTE);
+	assert(dst[1] & BUS1_HANDLE_FLAG_MANAGED);
+	assert(dst[1] & BUS1_HANDLE_FLAG_REMOTE);
+	assert(dst[0] != dst[1]);
+	assert(dst[2] == BUS1_HANDLE_INVALID);
+
+	/* release both, plus a duplicate and an invalid handle */
+
+	ids[0] = dst[0];
+	ids[1] = dst[1];
+	ids[2] = dst[0];
+	ids[3] = BUS1_HANDLE_INVALID;
+	memset(errors, 0xff, sizeof(errors));
+
+	cmd_release = (struct bus1_cmd_handles_release){
+		.flags			= 0,
+		.ptr_handles		= (unsigned long)ids,
+		.ptr_errors		= (unsigned long)errors,
+		.n_handles		= sizeof(ids) / sizeof(*ids),
+	};
+	r = bus1_ioctl_handles_release(fd2, &cmd_release);
+	assert(r >= 0);
+	assert(cmd_release.n_handles == 4);
+	assert(errors[0] == 0);
+	assert(errors[1] == 0);
+	assert(errors[2] == ENXIO);
+	assert(errors[3] == ENXIO);
+
+	/* the handles are gone now */
+
+	r = bus1_ioctl_handle_release(fd2, &dst[0]);
+	assert(r == -ENXIO);
+
+	/* cleanup */
+
+	test_close(fd2, map2, n_map2);
+	test_close(fd1, map1, n_map1);
+}
+
 /* test release notification */
 static void test_api_notify_release(void)
 {
@@ -216,6 +295,132 @@ static void test_api_notify_release(void)
 	test_close(fd1, map1, n_map1);
 }
 
+/* test coalesced release notifications */
+static void test_api_notify_coalesce(void)
+{
+	struct bus1_cmd_handles_transfer cmd_transfer;
+	struct bus1_cmd_peer_reset cmd_reset;
+	struct bus1_cmd_recv cmd_recv;
+	uint64_t src[] = { 0x100, 0x200, 0x300 };
+	uint64_t dst[3], errors[3], offset;
+	const uint64_t *ids;
+	const uint8_t *map1, *map2, *map3;
+	size_t i, n_map1, n_map2, n_map3;
+	int r, fd1, fd2, fd3;
+
+	/* setup */
+
+	fd1 = test_open(&map1, &n_map1);
+	fd2 = test_open(&map2, &n_map2);
+
+	cmd_reset = (struct bus1_cmd_peer_reset){
+		.flags			= 0,
+		.peer_flags		= BUS1_PEER_FLAG_NOTIFY_COALESCE,
+		.max_slices		= -1,
+		.max_handles		= -1,
+		.max_inflight_bytes	= -1,
+		.max_inflight_fds	= -1,
+		.recv_timeout_ns	= -1,
+		.recv_busy_poll_ns	= -1,
+		.pool_size		= -1,
+		.send_timeout_ns	= -1,
+	};
+	r = bus1_ioctl_peer_reset(fd1, &cmd_reset);
+	assert(r >= 0);
+
+	/* import three nodes of @fd1 into @fd2 */
+
+	cmd_transfer = (struct bus1_cmd_handles_transfer){
+		.flags			= 0,
+		.dst_fd			= fd2,
+		.ptr_src_handles	= (unsigned long)src,
+		.ptr_dst_handles	= (unsigned long)dst,
+		.ptr_errors		= (unsigned long)errors,
+		.n_handles		= sizeof(src) / sizeof(*src),
+	};
+	r = bus1_ioctl_handles_transfer(fd1, &cmd_transfer);
+	assert(r >= 0);
+	assert(cmd_transfer.n_handles == 3);
+
+	/* disconnecting @fd2 releases all nodes, reported in one message */
+
+	r = bus1_ioctl_peer_disconnect(fd2);
+	assert(r >= 0);
+
+	cmd_recv = (struct bus1_cmd_recv){
+		.flags = 0,
+		.max_offset = n_map1,
+	};
+	r = bus1_ioctl_recv(fd1, &cmd_recv);
+	assert(r >= 0);
+	assert(cmd_recv.msg.type == BUS1_MSG_NODE_RELEASE);
+	assert(cmd_recv.msg.flags & BUS1_MSG_FLAG_COALESCED);
+	assert(cmd_recv.msg.destination == BUS1_HANDLE_INVALID);
+	assert(cmd_recv.msg.n_bytes == sizeof(src));
+
+	/* the IDs are in release order, which is not defined */
+
+	ids = (const uint64_t *)(map1 + cmd_recv.msg.offset);
+	for (i = 0; i < 3; ++i)
+		assert(ids[i] == src[0] || ids[i] == src[1] ||
+		       ids[i] == src[2]);
+	assert(ids[0] != ids[1] && ids[0] != ids[2] && ids[1] != ids[2]);
+
+	offset = cmd_recv.msg.offset;
+	r = bus1_ioctl_slice_release(fd1, &offset);
+	assert(r >= 0);
+
+	cmd_recv = (struct bus1_cmd_recv){
+		.flags = 0,
+		.max_offset = n_map1,
+	};
+	r = bus1_ioctl_recv(fd1, &cmd_recv);
+	assert(r == -EAGAIN);
+
+	/* a single release has nothing to be coalesced with */
+
+	fd3 = test_open(&map3, &n_map3);
+
+	cmd_transfer = (struct bus1_cmd_handles_transfer){
+		.flags			= 0,
+		.dst_fd			= fd3,
+		.ptr_src_handles	= (unsigned long)src,
+		.ptr_dst_handles	= (unsigned long)dst,
+		.ptr_errors		= (unsigned long)errors,
+		.n_handles		= 1,
+	};
+	r = bus1_ioctl_handles_transfer(fd1, &cmd_transfer);
+	assert(r >= 0);
+	assert(cmd_transfer.n_handles == 1);
+
+	r = bus1_ioctl_handle_release(fd3, &dst[0]);
+	assert(r >= 0);
+
+	cmd_recv = (struct bus1_cmd_recv){
+		.flags = 0,
+		.max_offset = n_map1,
+	};
+	r = bus1_ioctl_recv(fd1, &cmd_recv);
+	assert(r >= 0);
+	assert(cmd_recv.msg.type == BUS1_MSG_NODE_RELEASE);
+	assert(!(cmd_recv.msg.flags & BUS1_MSG_FLAG_COALESCED));
+	assert(cmd_recv.msg.destination == src[0]);
+	assert(cmd_recv.msg.offset == BUS1_OFFSET_INVALID);
+
+	cmd_recv = (struct bus1_cmd_recv){
+		.flags = 0,
+		.max_offset = n_map1,
+	};
+	r = bus1_ioctl_recv(fd1, &cmd_recv);
+	assert(r == -EAGAIN);
+
+	/* cleanup */
+
+	test_close(fd3, map3, n_map3);
+	test_close(fd2, map2, n_map2);
+	test_close(fd1, map1, n_map1);
+}
+
 /* test destroy notification */
 static void test_api_notify_destroy(void)
 {
@@ -575,6 +780,1207 @@ static void test_api_handle(void)
 	test_close(fd1, map1, n_map1);
 }
 
+/* make sure batched receives work */
+static void test_api_recv_many(void)
+{
+	struct bus1_cmd_recv_many cmd_recv_many;
+	struct bus1_cmd_send cmd_send;
+	uint64_t ids[] = { 0x100, 0x200 };
+	uint64_t data[] = { 0, 1, 2, 3 };
+	struct iovec vec = { data, sizeof(data) };
+	struct bus1_msg msgs[4];
+	const uint8_t *map1;
+	size_t n_map1;
+	int r, fd1;
+
+	/* setup */
+
+	fd1 = test_open(&map1, &n_map1);
+
+	/* queue one multicast and one unicast */
+
+	cmd_send = (struct bus1_cmd_send){
+		.flags			= 0,
+		.ptr_destinations	= (unsigned long)ids,
+		.ptr_errors		= 0,
+		.n_destinations		= sizeof(ids) / sizeof(*ids),
+		.ptr_vecs		= (unsigned long)&vec,
+		.n_vecs			= 1,
+		.ptr_handles		= 0,
+		.n_handles		= 0,
+		.ptr_fds		= 0,
+		.n_fds			= 0,
+	};
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+
+	cmd_send.n_destinations = 1;
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+
+	/* retrieve all of them in a single call */
+
+	cmd_recv_many = (struct bus1_cmd_recv_many){
+		.flags = 0,
+		.max_offset = n_map1,
+		.ptr_msgs = (unsigned long)msgs,
+		.n_msgs = sizeof(msgs) / sizeof(*msgs),
+	};
+	r = bus1_ioctl_recv_many(fd1, &cmd_recv_many);
+	assert(r >= 0);
+	assert(cmd_recv_many.n_msgs == 3);
+
+	assert(msgs[0].type == BUS1_MSG_DATA);
+	assert(msgs[0].flags == BUS1_MSG_FLAG_CONTINUE);
+	assert(msgs[1].type == BUS1_MSG_DATA);
+	assert(msgs[1].flags == 0);
+	assert(msgs[0].destination != msgs[1].destination);
+	assert(msgs[2].type == BUS1_MSG_DATA);
+	assert(msgs[2].flags == 0);
+	assert(msgs[2].destination == ids[0]);
+
+	assert(msgs[0].n_bytes == sizeof(data));
+	assert(!memcmp(map1 + msgs[0].offset, data, sizeof(data)));
+	assert(msgs[2].n_bytes == sizeof(data));
+	assert(!memcmp(map1 + msgs[2].offset, data, sizeof(data)));
+
+	/* queue must be empty now */
+
+	cmd_recv_many.n_msgs = sizeof(msgs) / sizeof(*msgs);
+	r = bus1_ioctl_recv_many(fd1, &cmd_recv_many);
+	assert(r == -EAGAIN);
+
+	/* an empty batch is a no-op */
+
+	cmd_recv_many.n_msgs = 0;
+	r = bus1_ioctl_recv_many(fd1, &cmd_recv_many);
+	assert(r >= 0);
+	assert(cmd_recv_many.n_msgs == 0);
+
+	/* cleanup */
+
+	test_close(fd1, map1, n_map1);
+}
+
+/* make sure batched slice releases work */
+static void test_api_slices_release(void)
+{
+	struct bus1_cmd_slices_release cmd_release;
+	struct bus1_cmd_recv_many cmd_recv_many;
+	struct bus1_cmd_send cmd_send;
+	uint64_t ids[] = { 0x100, 0x200 };
+	uint64_t data[] = { 0, 1, 2, 3 };
+	struct iovec vec = { data, sizeof(data) };
+	uint64_t offsets[4], errors[4];
+	struct bus1_msg msgs[2];
+	const uint8_t *map1;
+	size_t n_map1;
+	int r, fd1;
+
+	/* setup */
+
+	fd1 = test_open(&map1, &n_map1);
+
+	/* receive two messages, so two slices are published */
+
+	cmd_send = (struct bus1_cmd_send){
+		.flags			= 0,
+		.ptr_destinations	= (unsigned long)ids,
+		.ptr_errors		= 0,
+		.n_destinations		= sizeof(ids) / sizeof(*ids),
+		.ptr_vecs		= (unsigned long)&vec,
+		.n_vecs			= 1,
+		.ptr_handles		= 0,
+		.n_handles		= 0,
+		.ptr_fds		= 0,
+		.n_fds			= 0,
+	};
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+
+	cmd_recv_many = (struct bus1_cmd_recv_many){
+		.flags = 0,
+		.max_offset = n_map1,
+		.ptr_msgs = (unsigned long)msgs,
+		.n_msgs = sizeof(msgs) / sizeof(*msgs),
+	};
+	r = bus1_ioctl_recv_many(fd1, &cmd_recv_many);
+	assert(r >= 0);
+	assert(cmd_recv_many.n_msgs == 2);
+
+	/* release both, plus a duplicate and an invalid offset */
+
+	offsets[0] = msgs[0].offset;
+	offsets[1] = msgs[1].offset;
+	offsets[2] = msgs[0].offset;
+	offsets[3] = BUS1_OFFSET_INVALID;
+	memset(errors, 0xff, sizeof(errors));
+
+	cmd_release = (struct bus1_cmd_slices_release){
+		.flags = 0,
+		.ptr_offsets = (unsigned long)offsets,
+		.ptr_errors = (unsigned long)errors,
+		.n_offsets = sizeof(offsets) / sizeof(*offsets),
+	};
+	r = bus1_ioctl_slices_release(fd1, &cmd_release);
+	assert(r >= 0);
+	assert(cmd_release.n_offsets == 4);
+	assert(errors[0] == 0);
+	assert(errors[1] == 0);
+	assert(errors[2] == ENXIO);
+	assert(errors[3] == ENXIO);
+
+	/* the slices are gone now */
+
+	r = bus1_ioctl_slice_release(fd1, &offsets[0]);
+	assert(r == -ENXIO);
+
+	/* cleanup */
+
+	test_close(fd1, map1, n_map1);
+}
+
+/* release the previous slice as part of the next receive */
+static void test_api_recv_release(void)
+{
+	struct bus1_cmd_recv cmd_recv;
+	struct bus1_cmd_send cmd_send;
+	uint64_t data[] = { 0, 1, 2, 3 };
+	struct iovec vec = { data, sizeof(data) };
+	uint64_t id = 0x100, offset;
+	const uint8_t *map1;
+	size_t n_map1;
+	int r, fd1;
+
+	/* setup */
+
+	fd1 = test_open(&map1, &n_map1);
+
+	cmd_send = (struct bus1_cmd_send){
+		.flags			= 0,
+		.ptr_destinations	= (unsigned long)&id,
+		.ptr_errors		= 0,
+		.n_destinations		= 1,
+		.ptr_vecs		= (unsigned long)&vec,
+		.n_vecs			= 1,
+		.ptr_handles		= 0,
+		.n_handles		= 0,
+		.ptr_fds		= 0,
+		.n_fds			= 0,
+	};
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+
+	/* nothing to release on the first receive */
+
+	cmd_recv = (struct bus1_cmd_recv){
+		.flags = BUS1_RECV_FLAG_RELEASE,
+		.max_offset = n_map1,
+		.msg.offset = BUS1_OFFSET_INVALID,
+	};
+	r = bus1_ioctl_recv(fd1, &cmd_recv);
+	assert(r >= 0);
+	assert(cmd_recv.msg.type == BUS1_MSG_DATA);
+	offset = cmd_recv.msg.offset;
+
+	/* re-using the descriptor releases the previous slice */
+
+	r = bus1_ioctl_recv(fd1, &cmd_recv);
+	assert(r >= 0);
+	assert(cmd_recv.msg.type == BUS1_MSG_DATA);
+
+	r = bus1_ioctl_slice_release(fd1, &offset);
+	assert(r == -ENXIO);
+
+	/* the release sticks, even if the queue is empty */
+
+	offset = cmd_recv.msg.offset;
+	r = bus1_ioctl_recv(fd1, &cmd_recv);
+	assert(r == -EAGAIN);
+	assert(cmd_recv.msg.offset == BUS1_OFFSET_INVALID);
+
+	r = bus1_ioctl_slice_release(fd1, &offset);
+	assert(r == -ENXIO);
+
+	/* stale offsets are refused */
+
+	cmd_recv.msg.offset = offset;
+	r = bus1_ioctl_recv(fd1, &cmd_recv);
+	assert(r == -ENXIO);
+
+	/* cleanup */
+
+	test_close(fd1, map1, n_map1);
+}
+
+/* make sure receives can be limited to a single destination */
+static void test_api_recv_destination(void)
+{
+	struct bus1_cmd_send cmd_send;
+	struct bus1_cmd_recv cmd_recv;
+	uint64_t ids[] = { 0x100, 0x200 };
+	const uint8_t *map1;
+	size_t n_map1;
+	int r, fd1;
+
+	/* setup */
+
+	fd1 = test_open(&map1, &n_map1);
+
+	/* queue messages to 0x100, 0x200, and 0x100 again */
+
+	cmd_send = (struct bus1_cmd_send){
+		.flags			= 0,
+		.ptr_destinations	= (unsigned long)ids,
+		.ptr_errors		= 0,
+		.n_destinations		= 2,
+		.ptr_vecs		= 0,
+		.n_vecs			= 0,
+		.ptr_handles		= 0,
+		.n_handles		= 0,
+		.ptr_fds		= 0,
+		.n_fds			= 0,
+	};
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+
+	cmd_send.n_destinations = 1;
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+
+	/* filtering cannot be combined with blocking */
+
+	cmd_recv = (struct bus1_cmd_recv){
+		.flags = BUS1_RECV_FLAG_DESTINATION | BUS1_RECV_FLAG_WAIT,
+		.max_offset = n_map1,
+		.msg.destination = 0x200,
+	};
+	r = bus1_ioctl_recv(fd1, &cmd_recv);
+	assert(r == -EINVAL);
+
+	/* pick the message to 0x200 from the middle of the queue */
+
+	cmd_recv = (struct bus1_cmd_recv){
+		.flags = BUS1_RECV_FLAG_DESTINATION,
+		.max_offset = n_map1,
+		.msg.destination = 0x200,
+	};
+	r = bus1_ioctl_recv(fd1, &cmd_recv);
+	assert(r >= 0);
+	assert(cmd_recv.msg.type == BUS1_MSG_DATA);
+	assert(cmd_recv.msg.flags == 0);
+	assert(cmd_recv.msg.destination == 0x200);
+
+	cmd_recv = (struct bus1_cmd_recv){
+		.flags = BUS1_RECV_FLAG_DESTINATION,
+		.max_offset = n_map1,
+		.msg.destination = 0x200,
+	};
+	r = bus1_ioctl_recv(fd1, &cmd_recv);
+	assert(r == -EAGAIN);
+
+	/* the messages to 0x100 are still queued, in order */
+
+	cmd_recv = (struct bus1_cmd_recv){
+		.flags = BUS1_RECV_FLAG_DESTINATION,
+		.max_offset = n_map1,
+		.msg.destination = 0x100,
+	};
+	r = bus1_ioctl_recv(fd1, &cmd_recv);
+	assert(r >= 0);
+	assert(cmd_recv.msg.destination == 0x100);
+
+	cmd_recv = (struct bus1_cmd_recv){
+		.flags = 0,
+		.max_offset = n_map1,
+	};
+	r = bus1_ioctl_recv(fd1, &cmd_recv);
+	assert(r >= 0);
+	assert(cmd_recv.msg.destination == 0x100);
+	assert(cmd_recv.msg.flags == 0);
+
+	r = bus1_ioctl_recv(fd1, &cmd_recv);
+	assert(r == -EAGAIN);
+
+	/* cleanup */
+
+	test_close(fd1, map1, n_map1);
+}
+
+/* make sure pinned files can be installed lazily and forwarded */
+static void test_api_keep_fds(void)
+{
+	struct bus1_cmd_slice_install_fds cmd_install;
+	struct bus1_slice_fd slice_fd;
+	struct bus1_cmd_send cmd_send;
+	struct bus1_cmd_recv cmd_recv;
+	uint64_t id = 0x100, offset, indices[2];
+	const uint8_t *map1;
+	int r, fd1, fds[2], p[2];
+	size_t n_map1;
+	char c;
+
+	/* setup */
+
+	fd1 = test_open(&map1, &n_map1);
+
+	r = pipe2(p, O_CLOEXEC | O_NONBLOCK);
+	assert(r >= 0);
+
+	/* send the write end of the pipe to ourselves */
+
+	cmd_send = (struct bus1_cmd_send){
+		.flags			= 0,
+		.ptr_destinations	= (unsigned long)&id,
+		.ptr_errors		= 0,
+		.n_destinations		= 1,
+		.ptr_vecs		= 0,
+		.n_vecs			= 0,
+		.ptr_handles		= 0,
+		.n_handles		= 0,
+		.ptr_fds		= (unsigned long)&p[1],
+		.n_fds			= 1,
+	};
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+
+	/* receive it without installing, but keep the file */
+
+	cmd_recv = (struct bus1_cmd_recv){
+		.flags = BUS1_RECV_FLAG_KEEP_FDS,
+		.max_offset = n_map1,
+	};
+	r = bus1_ioctl_recv(fd1, &cmd_recv);
+	assert(r >= 0);
+	assert(cmd_recv.msg.type == BUS1_MSG_DATA);
+	assert(cmd_recv.msg.n_fds == 1);
+	offset = cmd_recv.msg.offset;
+
+	/* out-of-range indices are refused */
+
+	indices[0] = 0;
+	indices[1] = 1;
+	cmd_install = (struct bus1_cmd_slice_install_fds){
+		.flags = 0,
+		.offset = offset,
+		.ptr_indices = (unsigned long)indices,
+		.ptr_fds = (unsigned long)fds,
+		.n_fds = 2,
+	};
+	r = bus1_ioctl_slice_install_fds(fd1, &cmd_install);
+	assert(r == -EBADF);
+
+	/* install it on demand */
+
+	cmd_install.n_fds = 1;
+	r = bus1_ioctl_slice_install_fds(fd1, &cmd_install);
+	assert(r >= 0);
+	assert(fds[0] >= 0);
+
+	r = write(fds[0], "a", 1);
+	assert(r == 1);
+	r = read(p[0], &c, 1);
+	assert(r == 1 && c == 'a');
+	close(fds[0]);
+
+	/* forward it without an FD number */
+
+	slice_fd = (struct bus1_slice_fd){
+		.offset = offset,
+		.index = 0,
+	};
+	cmd_send.flags = BUS1_SEND_FLAG_SLICE_FDS;
+	cmd_send.ptr_fds = (unsigned long)&slice_fd;
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+
+	/* the pinned file is gone with its slice */
+
+	r = bus1_ioctl_slice_release(fd1, &offset);
+	assert(r >= 0);
+	r = bus1_ioctl_slice_install_fds(fd1, &cmd_install);
+	assert(r == -ENXIO);
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r == -ENXIO);
+
+	/* the forwarded file is still installed as usual */
+
+	cmd_recv = (struct bus1_cmd_recv){
+		.flags = BUS1_RECV_FLAG_INSTALL_FDS,
+		.max_offset = n_map1,
+	};
+	r = bus1_ioctl_recv(fd1, &cmd_recv);
+	assert(r >= 0);
+	assert(cmd_recv.msg.n_fds == 1);
+	memcpy(&fds[0], map1 + cmd_recv.msg.offset, sizeof(int));
+
+	r = write(fds[0], "b", 1);
+	assert(r == 1);
+	r = read(p[0], &c, 1);
+	assert(r == 1 && c == 'b');
+	close(fds[0]);
+
+	/* files of slices received without the flag are not kept */
+
+	offset = cmd_recv.msg.offset;
+	cmd_install.offset = offset;
+	r = bus1_ioctl_slice_install_fds(fd1, &cmd_install);
+	assert(r == -EBADF);
+
+	/* cleanup */
+
+	close(p[1]);
+	close(p[0]);
+	test_close(fd1, map1, n_map1);
+}
+
+static uint64_t test_now_ns(void)
+{
+	struct timespec ts;
+	int r;
+
+	r = clock_gettime(CLOCK_MONOTONIC, &ts);
+	assert(r >= 0);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/* make sure blocking receives wait for messages, timeouts and disconnects */
+static void test_api_recv_wait(void)
+{
+	struct bus1_cmd_peer_reset cmd_reset;
+	struct bus1_cmd_recv_many cmd_recv_many;
+	struct bus1_cmd_send cmd_send;
+	struct bus1_cmd_recv cmd_recv;
+	struct bus1_msg msgs[2];
+	const uint8_t *map1;
+	uint64_t id = 0x100, ts;
+	size_t n_map1;
+	int r, fd1, status;
+	pid_t pid;
+
+	/* setup */
+
+	fd1 = test_open(&map1, &n_map1);
+
+	cmd_send = (struct bus1_cmd_send){
+		.flags			= 0,
+		.ptr_destinations	= (unsigned long)&id,
+		.ptr_errors		= 0,
+		.n_destinations		= 1,
+		.ptr_vecs		= 0,
+		.n_vecs			= 0,
+		.ptr_handles		= 0,
+		.n_handles		= 0,
+		.ptr_fds		= 0,
+		.n_fds			= 0,
+	};
+
+	/* busy-poll periods are bounded */
+
+	cmd_reset = (struct bus1_cmd_peer_reset){
+		.flags			= 0,
+		.peer_flags		= -1,
+		.max_slices		= -1,
+		.max_handles		= -1,
+		.max_inflight_bytes	= -1,
+		.max_inflight_fds	= -1,
+		.recv_timeout_ns	= -1,
+		.recv_busy_poll_ns	= UINT64_C(1000000000),
+		.pool_size		= -1,
+		.send_timeout_ns	= -1,
+	};
+	r = bus1_ioctl_peer_reset(fd1, &cmd_reset);
+	assert(r == -EINVAL);
+
+	/* set a timeout of 10ms and a busy-poll period of 50us */
+
+	cmd_reset.recv_timeout_ns = UINT64_C(10000000);
+	cmd_reset.recv_busy_poll_ns = UINT64_C(50000);
+	r = bus1_ioctl_peer_reset(fd1, &cmd_reset);
+	assert(r >= 0);
+
+	cmd_reset = (struct bus1_cmd_peer_reset){ .flags = 0 };
+	r = bus1_ioctl_peer_query(fd1, &cmd_reset);
+	assert(r >= 0);
+	assert(cmd_reset.recv_timeout_ns == UINT64_C(10000000));
+	assert(cmd_reset.recv_busy_poll_ns == UINT64_C(50000));
+
+	/* a blocking receive on an empty queue times out */
+
+	ts = test_now_ns();
+	cmd_recv = (struct bus1_cmd_recv){
+		.flags = BUS1_RECV_FLAG_WAIT,
+		.max_offset = n_map1,
+	};
+	r = bus1_ioctl_recv(fd1, &cmd_recv);
+	assert(r == -EAGAIN);
+	assert(test_now_ns() - ts >= UINT64_C(10000000));
+
+	/* queued messages are returned right away */
+
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+
+	cmd_recv = (struct bus1_cmd_recv){
+		.flags = BUS1_RECV_FLAG_WAIT,
+		.max_offset = n_map1,
+	};
+	r = bus1_ioctl_recv(fd1, &cmd_recv);
+	assert(r >= 0);
+	assert(cmd_recv.msg.type == BUS1_MSG_DATA);
+	assert(cmd_recv.msg.destination == id);
+
+	/* a message sent while blocking wakes up the receiver */
+
+	cmd_reset = (struct bus1_cmd_peer_reset){
+		.flags			= 0,
+		.peer_flags		= -1,
+		.max_slices		= -1,
+		.max_handles		= -1,
+		.max_inflight_bytes	= -1,
+		.max_inflight_fds	= -1,
+		.recv_timeout_ns	= UINT64_C(5000000000),
+		.recv_busy_poll_ns	= -1,
+		.pool_size		= -1,
+		.send_timeout_ns	= -1,
+	};
+	r = bus1_ioctl_peer_reset(fd1, &cmd_reset);
+	assert(r >= 0);
+
+	pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		usleep(20000);
+		r = bus1_ioctl_send(fd1, &cmd_send);
+		_exit(r < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	cmd_recv_many = (struct bus1_cmd_recv_many){
+		.flags = BUS1_RECV_FLAG_WAIT,
+		.max_offset = n_map1,
+		.ptr_msgs = (unsigned long)msgs,
+		.n_msgs = sizeof(msgs) / sizeof(*msgs),
+	};
+	r = bus1_ioctl_recv_many(fd1, &cmd_recv_many);
+	assert(r >= 0);
+	assert(cmd_recv_many.n_msgs == 1);
+	assert(msgs[0].type == BUS1_MSG_DATA);
+
+	r = waitpid(pid, &status, 0);
+	assert(r == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+	/* a disconnect wakes up the receiver */
+
+	pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		usleep(20000);
+		r = bus1_ioctl_peer_disconnect(fd1);
+		_exit(r < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	cmd_recv = (struct bus1_cmd_recv){
+		.flags = BUS1_RECV_FLAG_WAIT,
+		.max_offset = n_map1,
+	};
+	r = bus1_ioctl_recv(fd1, &cmd_recv);
+	assert(r == -ESHUTDOWN);
+
+	r = waitpid(pid, &status, 0);
+	assert(r == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+	/* cleanup */
+
+	test_close(fd1, map1, n_map1);
+}
+
+/* make sure senders can wait for a destination to have room again */
+static void test_api_send_wait(void)
+{
+	struct bus1_cmd_peer_reset cmd_reset;
+	struct bus1_cmd_send cmd_send;
+	struct bus1_cmd_recv cmd_recv;
+	uint64_t id = 0x100, page_size, ts;
+	struct pollfd pfd;
+	const uint8_t *map1;
+	struct iovec vec;
+	size_t n_map1;
+	int r, fd1, status;
+	char *payload;
+	pid_t pid;
+
+	/* setup */
+
+	fd1 = test_open(&map1, &n_map1);
+
+	page_size = sysconf(_SC_PAGESIZE);
+	payload = calloc(1, page_size);
+	assert(payload);
+
+	vec = (struct iovec){ payload, page_size };
+	cmd_send = (struct bus1_cmd_send){
+		.flags			= 0,
+		.ptr_destinations	= (unsigned long)&id,
+		.ptr_errors		= 0,
+		.n_destinations		= 1,
+		.ptr_vecs		= (unsigned long)&vec,
+		.n_vecs			= 1,
+		.ptr_handles		= 0,
+		.n_handles		= 0,
+		.ptr_fds		= 0,
+		.n_fds			= 0,
+	};
+	pfd = (struct pollfd){ .fd = fd1, .events = POLLOUT };
+
+	/* shrink the pool to one page, ask for POLLOUT and a 10ms timeout */
+
+	cmd_reset = (struct bus1_cmd_peer_reset){
+		.flags			= 0,
+		.peer_flags		= BUS1_PEER_FLAG_POLLOUT,
+		.max_slices		= -1,
+		.max_handles		= -1,
+		.max_inflight_bytes	= -1,
+		.max_inflight_fds	= -1,
+		.recv_timeout_ns	= -1,
+		.recv_busy_poll_ns	= -1,
+		.pool_size		= page_size,
+		.send_timeout_ns	= UINT64_C(10000000),
+	};
+	r = bus1_ioctl_peer_reset(fd1, &cmd_reset);
+	assert(r >= 0);
+
+	cmd_reset = (struct bus1_cmd_peer_reset){ .flags = 0 };
+	r = bus1_ioctl_peer_query(fd1, &cmd_reset);
+	assert(r >= 0);
+	assert(cmd_reset.send_timeout_ns == UINT64_C(10000000));
+
+	/* a full pool clears POLLOUT, and blocking sends time out */
+
+	r = poll(&pfd, 1, 0);
+	assert(r == 1 && (pfd.revents & POLLOUT));
+
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r == -EXFULL);
+
+	r = poll(&pfd, 1, 0);
+	assert(r == 0);
+
+	ts = test_now_ns();
+	cmd_send.flags = BUS1_SEND_FLAG_WAIT;
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r == -EXFULL);
+	assert(test_now_ns() - ts >= UINT64_C(10000000));
+
+	/* releasing the slice wakes up the sender */
+
+	cmd_reset = (struct bus1_cmd_peer_reset){
+		.flags			= 0,
+		.peer_flags		= -1,
+		.max_slices		= -1,
+		.max_handles		= -1,
+		.max_inflight_bytes	= -1,
+		.max_inflight_fds	= -1,
+		.recv_timeout_ns	= -1,
+		.recv_busy_poll_ns	= -1,
+		.pool_size		= -1,
+		.send_timeout_ns	= UINT64_C(5000000000),
+	};
+	r = bus1_ioctl_peer_reset(fd1, &cmd_reset);
+	assert(r >= 0);
+
+	pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		usleep(20000);
+		cmd_recv = (struct bus1_cmd_recv){
+			.flags = 0,
+			.max_offset = n_map1,
+		};
+		r = bus1_ioctl_recv(fd1, &cmd_recv);
+		if (r >= 0)
+			r = bus1_ioctl_slice_release(fd1,
+					(uint64_t *)&cmd_recv.msg.offset);
+		_exit(r < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+
+	r = waitpid(pid, &status, 0);
+	assert(r == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+	r = poll(&pfd, 1, 0);
+	assert(r == 1 && (pfd.revents & POLLOUT));
+
+	/* a disconnect wakes up the sender */
+
+	pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		usleep(20000);
+		r = bus1_ioctl_peer_disconnect(fd1);
+		_exit(r < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r == -ESHUTDOWN);
+
+	r = waitpid(pid, &status, 0);
+	assert(r == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+	/* cleanup */
+
+	free(payload);
+	test_close(fd1, map1, n_map1);
+}
+
+/* make sure the pool size, backing and allocation policy can be changed */
+static void test_api_pool(void)
+{
+	struct bus1_cmd_peer_reset cmd_reset;
+	struct bus1_cmd_send cmd_send;
+	struct bus1_cmd_recv cmd_recv;
+	uint64_t id = 0x100, page_size, offsets[3];
+	const uint8_t *map1;
+	struct iovec vec;
+	size_t n_map1;
+	unsigned int i;
+	char *payload;
+	int r, fd1;
+
+	/* setup */
+
+	fd1 = test_open(&map1, &n_map1);
+
+	page_size = sysconf(_SC_PAGESIZE);
+	payload = calloc(1, 2 * page_size);
+	assert(payload);
+
+	vec = (struct iovec){ payload, 1 };
+	cmd_send = (struct bus1_cmd_send){
+		.flags			= 0,
+		.ptr_destinations	= (unsigned long)&id,
+		.ptr_errors		= 0,
+		.n_destinations		= 1,
+		.ptr_vecs		= (unsigned long)&vec,
+		.n_vecs			= 1,
+		.ptr_handles		= 0,
+		.n_handles		= 0,
+		.ptr_fds		= 0,
+		.n_fds			= 0,
+	};
+
+	/* by default, the pool spans the maximum size and has no flags */
+
+	cmd_reset = (struct bus1_cmd_peer_reset){ .flags = 0 };
+	r = bus1_ioctl_peer_query(fd1, &cmd_reset);
+	assert(r >= 0);
+	assert(cmd_reset.peer_flags == 0);
+	assert(cmd_reset.pool_size > 2 * page_size);
+
+	/* pool sizes must be page-aligned, and unknown flags are refused */
+
+	cmd_reset = (struct bus1_cmd_peer_reset){
+		.flags			= 0,
+		.peer_flags		= -1,
+		.max_slices		= -1,
+		.max_handles		= -1,
+		.max_inflight_bytes	= -1,
+		.max_inflight_fds	= -1,
+		.recv_timeout_ns	= -1,
+		.recv_busy_poll_ns	= -1,
+		.pool_size		= page_size + 8,
+		.send_timeout_ns	= -1,
+	};
+	r = bus1_ioctl_peer_reset(fd1, &cmd_reset);
+	assert(r == -EINVAL);
+
+	cmd_reset.pool_size = -1;
+	cmd_reset.peer_flags = 1ULL << 63;
+	r = bus1_ioctl_peer_reset(fd1, &cmd_reset);
+	assert(r == -EINVAL);
+
+	/* a pool in use cannot be resized, unless it is flushed */
+
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+
+	cmd_reset.peer_flags = -1;
+	cmd_reset.pool_size = page_size;
+	r = bus1_ioctl_peer_reset(fd1, &cmd_reset);
+	assert(r == -EBUSY);
+
+	cmd_reset.flags = BUS1_PEER_RESET_FLAG_FLUSH;
+	r = bus1_ioctl_peer_reset(fd1, &cmd_reset);
+	assert(r >= 0);
+
+	cmd_reset = (struct bus1_cmd_peer_reset){ .flags = 0 };
+	r = bus1_ioctl_peer_query(fd1, &cmd_reset);
+	assert(r >= 0);
+	assert(cmd_reset.pool_size == page_size);
+
+	/* messages must fit into the resized pool */
+
+	vec.iov_len = 2 * page_size;
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r == -EXFULL);
+
+	vec.iov_len = 1;
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+
+	/* prefault the pool and ask for huge pages */
+
+	cmd_reset = (struct bus1_cmd_peer_reset){
+		.flags			= BUS1_PEER_RESET_FLAG_PREFAULT,
+		.peer_flags		= BUS1_PEER_FLAG_POOL_HUGEPAGE,
+		.max_slices		= -1,
+		.max_handles		= -1,
+		.max_inflight_bytes	= -1,
+		.max_inflight_fds	= -1,
+		.recv_timeout_ns	= -1,
+		.recv_busy_poll_ns	= -1,
+		.pool_size		= -1,
+		.send_timeout_ns	= -1,
+	};
+	r = bus1_ioctl_peer_reset(fd1, &cmd_reset);
+	assert(r >= 0);
+
+	cmd_reset = (struct bus1_cmd_peer_reset){ .flags = 0 };
+	r = bus1_ioctl_peer_query(fd1, &cmd_reset);
+	assert(r >= 0);
+	assert(cmd_reset.peer_flags == BUS1_PEER_FLAG_POOL_HUGEPAGE);
+
+	/* in ring mode, slices are placed in order, even behind holes */
+
+	cmd_reset = (struct bus1_cmd_peer_reset){
+		.flags			= BUS1_PEER_RESET_FLAG_FLUSH,
+		.peer_flags		= BUS1_PEER_FLAG_POOL_RING,
+		.max_slices		= -1,
+		.max_handles		= -1,
+		.max_inflight_bytes	= -1,
+		.max_inflight_fds	= -1,
+		.recv_timeout_ns	= -1,
+		.recv_busy_poll_ns	= -1,
+		.pool_size		= -1,
+		.send_timeout_ns	= -1,
+	};
+	r = bus1_ioctl_peer_reset(fd1, &cmd_reset);
+	assert(r >= 0);
+
+	for (i = 0; i < 3; ++i) {
+		r = bus1_ioctl_send(fd1, &cmd_send);
+		assert(r >= 0);
+
+		cmd_recv = (struct bus1_cmd_recv){
+			.flags = 0,
+			.max_offset = n_map1,
+		};
+		r = bus1_ioctl_recv(fd1, &cmd_recv);
+		assert(r >= 0);
+		offsets[i] = cmd_recv.msg.offset;
+
+		/* punch a hole in front of the second slice */
+		if (i == 1) {
+			r = bus1_ioctl_slice_release(fd1, &offsets[0]);
+			assert(r >= 0);
+		}
+	}
+	assert(offsets[1] > offsets[0]);
+	assert(offsets[2] > offsets[1]);
+
+	/* cleanup */
+
+	free(payload);
+	test_close(fd1, map1, n_map1);
+}
+
+/* tiny messages can be delivered inline, without a pool slice */
+static void test_api_inline(void)
+{
+	uint8_t data[2 * BUS1_MSG_INLINE_MAX], payload[BUS1_MSG_INLINE_MAX + 1];
+	struct bus1_cmd_recv_many cmd_recv_many;
+	struct bus1_cmd_peer_reset cmd_reset;
+	struct bus1_cmd_recv cmd_recv;
+	struct bus1_cmd_send cmd_send;
+	struct bus1_msg msgs[2];
+	struct iovec vec;
+	uint64_t id = 0x100;
+	const uint8_t *map1;
+	size_t i, n_map1;
+	int r, fd1;
+
+	/* setup */
+
+	fd1 = test_open(&map1, &n_map1);
+
+	memset(payload, 0xaa, sizeof(payload));
+	vec = (struct iovec){ payload, BUS1_MSG_INLINE_MAX };
+	cmd_send = (struct bus1_cmd_send){
+		.flags			= 0,
+		.ptr_destinations	= (unsigned long)&id,
+		.ptr_errors		= 0,
+		.n_destinations		= 1,
+		.ptr_vecs		= (unsigned long)&vec,
+		.n_vecs			= 1,
+		.ptr_handles		= 0,
+		.n_handles		= 0,
+		.ptr_fds		= 0,
+		.n_fds			= 0,
+	};
+
+	cmd_reset = (struct bus1_cmd_peer_reset){
+		.flags			= 0,
+		.peer_flags		= BUS1_PEER_FLAG_RECV_INLINE,
+		.max_slices		= -1,
+		.max_handles		= -1,
+		.max_inflight_bytes	= -1,
+		.max_inflight_fds	= -1,
+		.recv_timeout_ns	= -1,
+		.recv_busy_poll_ns	= -1,
+		.pool_size		= -1,
+		.send_timeout_ns	= -1,
+	};
+	r = bus1_ioctl_peer_reset(fd1, &cmd_reset);
+	assert(r >= 0);
+
+	/* a plain receive moves a tiny message into the pool */
+
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+
+	cmd_recv = (struct bus1_cmd_recv){
+		.flags = 0,
+		.max_offset = n_map1,
+	};
+	r = bus1_ioctl_recv(fd1, &cmd_recv);
+	assert(r >= 0);
+	assert(cmd_recv.msg.type == BUS1_MSG_DATA);
+	assert(!(cmd_recv.msg.flags & BUS1_MSG_FLAG_INLINE));
+	assert(cmd_recv.msg.offset != BUS1_OFFSET_INVALID);
+	assert(cmd_recv.msg.n_bytes == BUS1_MSG_INLINE_MAX);
+	assert(!memcmp(map1 + cmd_recv.msg.offset, payload,
+		       BUS1_MSG_INLINE_MAX));
+
+	r = bus1_ioctl_slice_release(fd1, (uint64_t *)&cmd_recv.msg.offset);
+	assert(r >= 0);
+
+	/* so do batched receives without a data buffer */
+
+	vec.iov_len = 8;
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+
+	cmd_recv_many = (struct bus1_cmd_recv_many){
+		.flags = 0,
+		.max_offset = n_map1,
+		.ptr_msgs = (unsigned long)msgs,
+		.n_msgs = sizeof(msgs) / sizeof(*msgs),
+		.ptr_data = 0,
+	};
+	r = bus1_ioctl_recv_many(fd1, &cmd_recv_many);
+	assert(r >= 0);
+	assert(cmd_recv_many.n_msgs == 2);
+	for (i = 0; i < 2; ++i) {
+		assert(!(msgs[i].flags & BUS1_MSG_FLAG_INLINE));
+		assert(msgs[i].offset != BUS1_OFFSET_INVALID);
+		assert(!memcmp(map1 + msgs[i].offset, payload, 8));
+		r = bus1_ioctl_slice_release(fd1, (uint64_t *)&msgs[i].offset);
+		assert(r >= 0);
+	}
+
+	/* with a data buffer, tiny messages never touch the pool */
+
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+
+	memset(data, 0, sizeof(data));
+	cmd_recv_many.n_msgs = sizeof(msgs) / sizeof(*msgs);
+	cmd_recv_many.ptr_data = (unsigned long)data;
+	r = bus1_ioctl_recv_many(fd1, &cmd_recv_many);
+	assert(r >= 0);
+	assert(cmd_recv_many.n_msgs == 2);
+	assert(msgs[0].flags & BUS1_MSG_FLAG_INLINE);
+	assert(msgs[1].flags & BUS1_MSG_FLAG_INLINE);
+	assert(!memcmp(data, payload, 8));
+	assert(!memcmp(data + BUS1_MSG_INLINE_MAX, payload, 8));
+
+	/* anything bigger still uses the pool */
+
+	vec.iov_len = BUS1_MSG_INLINE_MAX + 1;
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+
+	cmd_recv_many.n_msgs = 1;
+	r = bus1_ioctl_recv_many(fd1, &cmd_recv_many);
+	assert(r >= 0);
+	assert(cmd_recv_many.n_msgs == 1);
+	assert(!(msgs[0].flags & BUS1_MSG_FLAG_INLINE));
+	assert(msgs[0].offset != BUS1_OFFSET_INVALID);
+
+	r = bus1_ioctl_slice_release(fd1, (uint64_t *)&msgs[0].offset);
+	assert(r >= 0);
+
+	/* cleanup */
+
+	test_close(fd1, map1, n_map1);
+}
+
+/* make sure sends to registered destination sets work */
+static void test_api_send_set(void)
+{
+	struct bus1_cmd_set_register cmd_register;
+	struct bus1_cmd_send cmd_send;
+	struct bus1_cmd_recv cmd_recv;
+	uint64_t ids[] = { 0x100, 0x200 }, dups[] = { 0x100, 0x100 };
+	uint64_t data[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12 };
+	struct iovec vec = { data, sizeof(data) };
+	uint64_t set_data, set_dsts;
+	const uint8_t *map1;
+	size_t i, n_map1;
+	int r, fd1;
+
+	/* setup */
+
+	fd1 = test_open(&map1, &n_map1);
+
+	/* sets only refer to existing nodes, so create them first */
+
+	cmd_register = (struct bus1_cmd_set_register){
+		.flags			= 0,
+		.ptr_destinations	= (unsigned long)ids,
+		.n_destinations		= sizeof(ids) / sizeof(*ids),
+		.ptr_vecs		= (unsigned long)&vec,
+		.n_vecs			= 1,
+		.set_id			= 0,
+	};
+	r = bus1_ioctl_set_register(fd1, &cmd_register);
+	assert(r == -ENXIO);
+
+	cmd_send = (struct bus1_cmd_send){
+		.flags			= 0,
+		.ptr_destinations	= (unsigned long)ids,
+		.ptr_errors		= 0,
+		.n_destinations		= sizeof(ids) / sizeof(*ids),
+		.ptr_vecs		= 0,
+		.n_vecs			= 0,
+		.ptr_handles		= 0,
+		.n_handles		= 0,
+		.ptr_fds		= 0,
+		.n_fds			= 0,
+	};
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+
+	for (i = 0; i < 2; ++i) {
+		cmd_recv = (struct bus1_cmd_recv){
+			.flags = 0,
+			.max_offset = n_map1,
+		};
+		r = bus1_ioctl_recv(fd1, &cmd_recv);
+		assert(r >= 0);
+		r = bus1_ioctl_slice_release(fd1,
+					     (uint64_t *)&cmd_recv.msg.offset);
+		assert(r >= 0);
+	}
+
+	/* register a set with payload, one without, and a duplicate */
+
+	r = bus1_ioctl_set_register(fd1, &cmd_register);
+	assert(r >= 0);
+	assert(cmd_register.set_id != 0);
+	set_data = cmd_register.set_id;
+
+	cmd_register.ptr_vecs = 0;
+	cmd_register.n_vecs = 0;
+	r = bus1_ioctl_set_register(fd1, &cmd_register);
+	assert(r >= 0);
+	assert(cmd_register.set_id != set_data);
+	set_dsts = cmd_register.set_id;
+
+	cmd_register.ptr_destinations = (unsigned long)dups;
+	r = bus1_ioctl_set_register(fd1, &cmd_register);
+	assert(r == -ENOTUNIQ);
+
+	/* send to both sets, the first one provides the payload itself */
+
+	cmd_send = (struct bus1_cmd_send){
+		.flags			= BUS1_SEND_FLAG_SET,
+		.ptr_destinations	= set_data,
+		.ptr_errors		= 0,
+		.n_destinations		= 0,
+		.ptr_vecs		= 0,
+		.n_vecs			= 0,
+		.ptr_handles		= 0,
+		.n_handles		= 0,
+		.ptr_fds		= 0,
+		.n_fds			= 0,
+	};
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+
+	cmd_send.ptr_vecs = (unsigned long)&vec;
+	cmd_send.n_vecs = 1;
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r == -EINVAL);
+
+	cmd_send.ptr_destinations = set_dsts;
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r >= 0);
+
+	cmd_send.n_destinations = 1;
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r == -EINVAL);
+
+	for (i = 0; i < 4; ++i) {
+		cmd_recv = (struct bus1_cmd_recv){
+			.flags = 0,
+			.max_offset = n_map1,
+		};
+		r = bus1_ioctl_recv(fd1, &cmd_recv);
+		assert(r >= 0);
+		assert(cmd_recv.msg.type == BUS1_MSG_DATA);
+		assert(cmd_recv.msg.destination == ids[0] ||
+		       cmd_recv.msg.destination == ids[1]);
+		assert(cmd_recv.msg.n_bytes == sizeof(data));
+		assert(!memcmp(map1 + cmd_recv.msg.offset, data,
+			       sizeof(data)));
+		r = bus1_ioctl_slice_release(fd1,
+					     (uint64_t *)&cmd_recv.msg.offset);
+		assert(r >= 0);
+	}
+
+	/* unregistered sets are gone */
+
+	r = bus1_ioctl_set_unregister(fd1, &set_data);
+	assert(r >= 0);
+	r = bus1_ioctl_set_unregister(fd1, &set_data);
+	assert(r == -ENXIO);
+
+	cmd_send.ptr_destinations = set_data;
+	cmd_send.n_destinations = 0;
+	cmd_send.ptr_vecs = 0;
+	cmd_send.n_vecs = 0;
+	r = bus1_ioctl_send(fd1, &cmd_send);
+	assert(r == -ENXIO);
+
+	/* cleanup, this also drops the remaining set */
+
+	test_close(fd1, map1, n_map1);
+}
+
 int main(int argc, char **argv)
 {
 	int r;
@@ -584,12 +1990,24 @@ int main(int argc, char **argv)
 		test_api_cdev();
 		test_api_connect();
 		test_api_transfer();
+		test_api_handles_batch();
 		test_api_notify_release();
 		test_api_notify_destroy();
+		test_api_notify_coalesce();
 		test_api_unicast();
 		test_api_unicast_remote();
 		test_api_multicast();
 		test_api_handle();
+		test_api_recv_many();
+		test_api_send_set();
+		test_api_slices_release();
+		test_api_recv_release();
+		test_api_recv_wait();
+		test_api_send_wait();
+		test_api_recv_destination();
+		test_api_keep_fds();
+		test_api_pool();
+		test_api_inline();
 	}
 
 	return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
@@ -0,0 +1,805 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ */
+
+/*
+ * Benchmark suite for bus1. Unlike test-io, which reports the average CPU
+ * time of a single-threaded send/recv loop, this runs a set of workloads
+ * across threads and processes, and reports wall-clock numbers. Each run
+ * emits one record, either as CSV (default) or as JSON, so results can be
+ * compared across kernels:
+ *
+ *     ./test-bench --format=json --iterations=100000
+ */
+
+#define _GNU_SOURCE
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include "test.h"
+
+#define BENCH_MAP_SIZE (64UL * 1024UL * 1024UL)
+#define BENCH_MAX_PEERS (64)
+#define BENCH_MAX_ITEMS (16)
+#define BENCH_NODE(_i) (0x100ULL * ((_i) + 1))
+
+enum {
+	BENCH_FORMAT_CSV,
+	BENCH_FORMAT_JSON,
+};
+
+static int bench_format = BENCH_FORMAT_CSV;
+static unsigned int bench_iterations = 20000;
+static unsigned int bench_n_records;
+
+struct bench_peer {
+	int fd;
+	const uint8_t *map;
+};
+
+struct bench_result {
+	const char *name;
+	unsigned int n_peers;
+	size_t n_bytes;
+	unsigned int n_handles;
+	unsigned int n_fds;
+	unsigned int n_pinned;
+	uint64_t n_ops;
+	uint64_t n_errors;
+	uint64_t ns;
+	uint64_t *samples;
+	size_t n_samples;
+};
+
+static inline uint64_t nsec_from_clock(clockid_t clock)
+{
+	struct timespec ts;
+	int r;
+
+	r = clock_gettime(clock, &ts);
+	assert(r >= 0);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static int bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint64_t bench_percentile(const uint64_t *samples, size_t n, double p)
+{
+	size_t i;
+
+	if (!n)
+		return 0;
+
+	i = (size_t)(p * (n - 1) + 0.5);
+	return samples[i < n ? i : n - 1];
+}
+
+static void bench_report(struct bench_result *res)
+{
+	uint64_t p50, p99, p999, ns_per_op, ops_per_sec;
+
+	if (res->samples)
+		qsort(res->samples, res->n_samples, sizeof(*res->samples),
+		      bench_cmp_u64);
+
+	p50 = bench_percentile(res->samples, res->n_samples, 0.5);
+	p99 = bench_percentile(res->samples, res->n_samples, 0.99);
+	p999 = bench_percentile(res->samples, res->n_samples, 0.999);
+	ns_per_op = res->n_ops ? res->ns / res->n_ops : 0;
+	ops_per_sec = res->ns ? res->n_ops * UINT64_C(1000000000) / res->ns : 0;
+
+	if (bench_format == BENCH_FORMAT_JSON) {
+		printf("%s\n  { \"name\": \"%s\", \"peers\": %u, \"bytes\": %zu, \"handles\": %u, \"fds\": %u, \"pinned\": %u, \"ops\": %" PRIu64 ", \"errors\": %" PRIu64 ", \"ns_per_op\": %" PRIu64 ", \"ops_per_sec\": %" PRIu64 ", \"p50_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64 ", \"p999_ns\": %" PRIu64 " }",
+		       bench_n_records ? "," : "[",
+		       res->name, res->n_peers, res->n_bytes, res->n_handles,
+		       res->n_fds, res->n_pinned, res->n_ops, res->n_errors,
+		       ns_per_op, ops_per_sec, p50, p99, p999);
+	} else {
+		if (!bench_n_records)
+			printf("name,peers,bytes,handles,fds,pinned,ops,errors,ns_per_op,ops_per_sec,p50_ns,p99_ns,p999_ns\n");
+		printf("%s,%u,%zu,%u,%u,%u,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+		       res->name, res->n_peers, res->n_bytes, res->n_handles,
+		       res->n_fds, res->n_pinned, res->n_ops, res->n_errors,
+		       ns_per_op, ops_per_sec, p50, p99, p999);
+	}
+
+	fflush(stdout);
+	free(res->samples);
+	res->samples = NULL;
+	++bench_n_records;
+}
+
+static void bench_open(struct bench_peer *peer)
+{
+	peer->fd = open(test_path, O_RDWR | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	assert(peer->fd >= 0);
+
+	peer->map = mmap(NULL, BENCH_MAP_SIZE, PROT_READ, MAP_SHARED,
+			 peer->fd, 0);
+	assert(peer->map != MAP_FAILED);
+}
+
+static void bench_close(struct bench_peer *peer)
+{
+	munmap((void *)peer->map, BENCH_MAP_SIZE);
+	close(peer->fd);
+}
+
+/* make @to own a node, and return a handle to it in the namespace of @from */
+static uint64_t bench_connect(struct bench_peer *from, struct bench_peer *to)
+{
+	struct bus1_cmd_handle_transfer cmd = {
+		.flags			= 0,
+		.src_handle		= BENCH_NODE(0),
+		.dst_fd			= from->fd,
+		.dst_handle		= BUS1_HANDLE_INVALID,
+	};
+	int r;
+
+	r = bus1_ioctl_handle_transfer(to->fd, &cmd);
+	assert(r >= 0);
+	return cmd.dst_handle;
+}
+
+static int bench_send(struct bench_peer *peer,
+		      uint64_t *dsts,
+		      size_t n_dsts,
+		      void *payload,
+		      size_t n_bytes,
+		      uint64_t *handles,
+		      size_t n_handles,
+		      int *fds,
+		      size_t n_fds)
+{
+	struct iovec vec = { payload, n_bytes };
+	struct bus1_cmd_send cmd = {
+		.flags			= 0,
+		.ptr_destinations	= (unsigned long)dsts,
+		.ptr_errors		= 0,
+		.n_destinations		= n_dsts,
+		.ptr_vecs		= (unsigned long)&vec,
+		.n_vecs			= 1,
+		.ptr_handles		= (unsigned long)handles,
+		.n_handles		= n_handles,
+		.ptr_fds		= (unsigned long)fds,
+		.n_fds			= n_fds,
+	};
+
+	return bus1_ioctl_send(peer->fd, &cmd);
+}
+
+/* send, but retry as long as the destinations are out of quota */
+static void bench_send_retry(struct bench_peer *peer,
+			     uint64_t *dsts,
+			     size_t n_dsts,
+			     void *payload,
+			     size_t n_bytes,
+			     uint64_t *handles,
+			     size_t n_handles,
+			     uint64_t *n_errorsp)
+{
+	int r;
+
+	while ((r = bench_send(peer, dsts, n_dsts, payload, n_bytes,
+			       handles, n_handles, NULL, 0)) < 0) {
+		assert(r == -EDQUOT || r == -EXFULL || r == -ENOMEM);
+		if (n_errorsp)
+			++*n_errorsp;
+		sched_yield();
+	}
+}
+
+/* receive one data message, release all its resources, and return its size */
+static size_t bench_recv(struct bench_peer *peer, bool wait)
+{
+	struct bus1_cmd_recv cmd;
+	struct pollfd pfd;
+	const uint64_t *ids;
+	uint64_t i;
+	int r;
+
+	for (;;) {
+		cmd = (struct bus1_cmd_recv){
+			.flags = 0,
+			.max_offset = BENCH_MAP_SIZE,
+		};
+		r = bus1_ioctl_recv(peer->fd, &cmd);
+		if (r == -EAGAIN && wait) {
+			pfd = (struct pollfd){ .fd = peer->fd, .events = POLLIN };
+			r = poll(&pfd, 1, -1);
+			assert(r >= 0);
+			continue;
+		}
+		assert(r >= 0);
+
+		if (cmd.msg.type == BUS1_MSG_DATA)
+			break;
+	}
+
+	ids = (const void *)(peer->map + cmd.msg.offset +
+			     c_align_to(cmd.msg.n_bytes, 8));
+	for (i = 0; i < cmd.msg.n_handles; ++i) {
+		uint64_t id = ids[i];
+
+		r = bus1_ioctl_handle_release(peer->fd, &id);
+		assert(r >= 0);
+	}
+
+	r = bus1_ioctl_slice_release(peer->fd, (uint64_t *)&cmd.msg.offset);
+	assert(r >= 0);
+
+	return cmd.msg.n_bytes;
+}
+
+/* round-trip latency between two processes, for fixed or mixed sizes */
+static void bench_pingpong(const char *name,
+			   const size_t *sizes,
+			   size_t n_sizes)
+{
+	struct bench_result res = { .name = name, .n_peers = 2 };
+	struct bench_peer a, b;
+	uint64_t ha, hb, t, start;
+	unsigned int i, n;
+	size_t max = 0;
+	char *payload;
+	pid_t pid;
+	int r;
+
+	for (i = 0; i < n_sizes; ++i)
+		max = sizes[i] > max ? sizes[i] : max;
+
+	payload = calloc(1, max ?: 1);
+	assert(payload);
+
+	n = bench_iterations;
+	res.n_bytes = n_sizes > 1 ? 0 : sizes[0];
+	res.samples = calloc(n, sizeof(*res.samples));
+	assert(res.samples);
+
+	bench_open(&a);
+	bench_open(&b);
+	hb = bench_connect(&a, &b);
+	ha = bench_connect(&b, &a);
+
+	pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		/* echo every message back, with the same size */
+		for (i = 0; i < n; ++i) {
+			size_t size = bench_recv(&b, true);
+
+			bench_send_retry(&b, &ha, 1, payload, size, NULL, 0,
+					 NULL);
+		}
+		_exit(0);
+	}
+
+	start = nsec_from_clock(CLOCK_MONOTONIC);
+	for (i = 0; i < n; ++i) {
+		t = nsec_from_clock(CLOCK_MONOTONIC);
+		bench_send_retry(&a, &hb, 1, payload, sizes[i % n_sizes],
+				 NULL, 0, &res.n_errors);
+		bench_recv(&a, true);
+		res.samples[res.n_samples++] = nsec_from_clock(CLOCK_MONOTONIC) - t;
+	}
+	res.ns = nsec_from_clock(CLOCK_MONOTONIC) - start;
+	res.n_ops = n;
+
+	r = waitpid(pid, NULL, 0);
+	assert(r == pid);
+
+	bench_close(&b);
+	bench_close(&a);
+	free(payload);
+
+	bench_report(&res);
+}
+
+/*
+ * One sender multicasts to @n_peers receiving processes, passing @n_handles
+ * handles to its own nodes with every message.
+ */
+static void bench_fanout(unsigned int n_peers,
+			 size_t n_bytes,
+			 unsigned int n_handles)
+{
+	struct bench_result res = {
+		.name = "fanout-process",
+		.n_peers = n_peers + 1,
+		.n_bytes = n_bytes,
+		.n_handles = n_handles,
+	};
+	uint64_t handles[BENCH_MAX_PEERS], nodes[BENCH_MAX_ITEMS], start;
+	struct bench_peer src, dst[BENCH_MAX_PEERS];
+	pid_t pids[BENCH_MAX_PEERS];
+	char payload[n_bytes ?: 1];
+	unsigned int i, j, n;
+	int r;
+
+	assert(n_peers <= BENCH_MAX_PEERS && n_handles <= BENCH_MAX_ITEMS);
+
+	n = bench_iterations / n_peers ?: 1;
+	memset(payload, 0, sizeof(payload));
+
+	bench_open(&src);
+	for (i = 0; i < n_peers; ++i) {
+		bench_open(&dst[i]);
+		handles[i] = bench_connect(&src, &dst[i]);
+	}
+
+	/* the first send allocates the nodes, later ones reuse them */
+	for (i = 0; i < n_handles; ++i)
+		nodes[i] = BENCH_NODE(i);
+	if (n_handles > 0) {
+		bench_send_retry(&src, handles, n_peers, payload, n_bytes,
+				 nodes, n_handles, NULL);
+		for (i = 0; i < n_peers; ++i)
+			bench_recv(&dst[i], false);
+	}
+
+	for (i = 0; i < n_peers; ++i) {
+		pids[i] = fork();
+		assert(pids[i] >= 0);
+		if (pids[i] == 0) {
+			for (j = 0; j < n; ++j)
+				bench_recv(&dst[i], true);
+			_exit(0);
+		}
+	}
+
+	start = nsec_from_clock(CLOCK_MONOTONIC);
+	for (j = 0; j < n; ++j)
+		bench_send_retry(&src, handles, n_peers, payload, n_bytes,
+				 nodes, n_handles, &res.n_errors);
+	for (i = 0; i < n_peers; ++i) {
+		r = waitpid(pids[i], NULL, 0);
+		assert(r == pids[i]);
+	}
+	res.ns = nsec_from_clock(CLOCK_MONOTONIC) - start;
+	res.n_ops = (uint64_t)n * n_peers;
+
+	for (i = 0; i < n_peers; ++i)
+		bench_close(&dst[i]);
+	bench_close(&src);
+
+	bench_report(&res);
+}
+
+struct bench_fanin_thread {
+	pthread_t tid;
+	struct bench_peer peer;
+	uint64_t handle;
+	size_t n_bytes;
+	unsigned int n;
+	uint64_t n_errors;
+};
+
+static void *bench_fanin_fn(void *userdata)
+{
+	struct bench_fanin_thread *t = userdata;
+	char payload[t->n_bytes ?: 1];
+	unsigned int i;
+
+	memset(payload, 0, sizeof(payload));
+	for (i = 0; i < t->n; ++i)
+		bench_send_retry(&t->peer, &t->handle, 1, payload, t->n_bytes,
+				 NULL, 0, &t->n_errors);
+
+	return NULL;
+}
+
+/* @n_peers sending threads unicast to one receiver */
+static void bench_fanin(unsigned int n_peers, size_t n_bytes)
+{
+	struct bench_result res = {
+		.name = "fanin-thread",
+		.n_peers = n_peers + 1,
+		.n_bytes = n_bytes,
+	};
+	struct bench_fanin_thread threads[BENCH_MAX_PEERS];
+	struct bench_peer dst;
+	uint64_t i, n, start;
+	int r;
+
+	assert(n_peers <= BENCH_MAX_PEERS);
+
+	n = bench_iterations / n_peers ?: 1;
+
+	bench_open(&dst);
+	for (i = 0; i < n_peers; ++i) {
+		threads[i] = (struct bench_fanin_thread){
+			.n_bytes = n_bytes,
+			.n = n,
+		};
+		bench_open(&threads[i].peer);
+		threads[i].handle = bench_connect(&threads[i].peer, &dst);
+	}
+
+	start = nsec_from_clock(CLOCK_MONOTONIC);
+	for (i = 0; i < n_peers; ++i) {
+		r = pthread_create(&threads[i].tid, NULL, bench_fanin_fn,
+				   &threads[i]);
+		assert(r == 0);
+	}
+	for (i = 0; i < n * n_peers; ++i)
+		bench_recv(&dst, true);
+	res.ns = nsec_from_clock(CLOCK_MONOTONIC) - start;
+	res.n_ops = n * n_peers;
+
+	for (i = 0; i < n_peers; ++i) {
+		r = pthread_join(threads[i].tid, NULL);
+		assert(r == 0);
+		res.n_errors += threads[i].n_errors;
+		bench_close(&threads[i].peer);
+	}
+	bench_close(&dst);
+
+	bench_report(&res);
+}
+
+/* sustained throughput against a consumer that sleeps after each message */
+static void bench_slow_consumer(unsigned int delay_us, size_t n_bytes)
+{
+	struct bench_result res = {
+		.name = "slow-consumer",
+		.n_peers = 2,
+		.n_bytes = n_bytes,
+	};
+	struct timespec delay = { 0, delay_us * 1000L };
+	struct bench_peer src, dst;
+	char payload[n_bytes ?: 1];
+	uint64_t handle, start;
+	unsigned int i, n;
+	pid_t pid;
+	int r;
+
+	n = bench_iterations;
+	memset(payload, 0, sizeof(payload));
+
+	bench_open(&src);
+	bench_open(&dst);
+	handle = bench_connect(&src, &dst);
+
+	pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		for (i = 0; i < n; ++i) {
+			bench_recv(&dst, true);
+			if (delay_us)
+				nanosleep(&delay, NULL);
+		}
+		_exit(0);
+	}
+
+	/* time the producer only, errors count how often it was throttled */
+	start = nsec_from_clock(CLOCK_MONOTONIC);
+	for (i = 0; i < n; ++i)
+		bench_send_retry(&src, &handle, 1, payload, n_bytes,
+				 NULL, 0, &res.n_errors);
+	res.ns = nsec_from_clock(CLOCK_MONOTONIC) - start;
+	res.n_ops = n;
+
+	r = waitpid(pid, NULL, 0);
+	assert(r == pid);
+
+	bench_close(&dst);
+	bench_close(&src);
+
+	bench_report(&res);
+}
+
+/* unicast carrying handles and fds, received and released in-process */
+static void bench_transfer(unsigned int n_handles, unsigned int n_fds)
+{
+	struct bench_result res = {
+		.name = "transfer",
+		.n_peers = 2,
+		.n_bytes = 64,
+		.n_handles = n_handles,
+		.n_fds = n_fds,
+	};
+	uint64_t handles[BENCH_MAX_ITEMS], handle, start;
+	int r, fds[BENCH_MAX_ITEMS];
+	struct bench_peer src, dst;
+	char payload[64] = {};
+	unsigned int i, n;
+
+	assert(n_handles <= BENCH_MAX_ITEMS && n_fds <= BENCH_MAX_ITEMS);
+
+	n = bench_iterations;
+
+	bench_open(&src);
+	bench_open(&dst);
+	handle = bench_connect(&src, &dst);
+
+	/* the first transfer allocates the nodes, later ones reuse them */
+	for (i = 0; i < n_handles; ++i)
+		handles[i] = BENCH_NODE(i);
+	for (i = 0; i < n_fds; ++i) {
+		fds[i] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+		assert(fds[i] >= 0);
+	}
+
+	r = bench_send(&src, &handle, 1, payload, sizeof(payload),
+		       handles, n_handles, fds, n_fds);
+	assert(r >= 0);
+	bench_recv(&dst, false);
+
+	start = nsec_from_clock(CLOCK_MONOTONIC);
+	for (i = 0; i < n; ++i) {
+		r = bench_send(&src, &handle, 1, payload, sizeof(payload),
+			       handles, n_handles, fds, n_fds);
+		assert(r >= 0);
+		bench_recv(&dst, false);
+	}
+	res.ns = nsec_from_clock(CLOCK_MONOTONIC) - start;
+	res.n_ops = n;
+
+	for (i = 0; i < n_fds; ++i)
+		close(fds[i]);
+	bench_close(&dst);
+	bench_close(&src);
+
+	bench_report(&res);
+}
+
+/*
+ * Unicast of mixed sizes while the receiver keeps @n_pinned slices alive.
+ * Every other pinned slice is released upfront, so the pool is fragmented.
+ */
+static void bench_pool_pressure(unsigned int n_pinned)
+{
+	static const size_t sizes[] = { 64, 512, 4096, 256, 16384, 1024 };
+	struct bench_result res = {
+		.name = "pool-pressure",
+		.n_peers = 2,
+		.n_pinned = n_pinned,
+	};
+	struct bench_peer src, dst;
+	struct bus1_cmd_recv cmd;
+	uint64_t handle, start;
+	char payload[16384] = {};
+	unsigned int i, n;
+	int r;
+
+	n = bench_iterations;
+
+	bench_open(&src);
+	bench_open(&dst);
+	handle = bench_connect(&src, &dst);
+
+	for (i = 0; i < n_pinned; ++i) {
+		r = bench_send(&src, &handle, 1, payload, 4096,
+			       NULL, 0, NULL, 0);
+		assert(r >= 0);
+
+		cmd = (struct bus1_cmd_recv){
+			.flags = 0,
+			.max_offset = BENCH_MAP_SIZE,
+		};
+		r = bus1_ioctl_recv(dst.fd, &cmd);
+		assert(r >= 0);
+
+		if (i & 1) {
+			r = bus1_ioctl_slice_release(dst.fd,
+						(uint64_t *)&cmd.msg.offset);
+			assert(r >= 0);
+		}
+	}
+
+	start = nsec_from_clock(CLOCK_MONOTONIC);
+	for (i = 0; i < n; ++i) {
+		r = bench_send(&src, &handle, 1, payload,
+			       sizes[i % (sizeof(sizes) / sizeof(*sizes))],
+			       NULL, 0, NULL, 0);
+		assert(r >= 0);
+		bench_recv(&dst, false);
+	}
+	res.ns = nsec_from_clock(CLOCK_MONOTONIC) - start;
+	res.n_ops = n;
+
+	/* closing the receiver drops all pinned slices */
+	bench_close(&dst);
+	bench_close(&src);
+
+	bench_report(&res);
+}
+
+struct bench_open_thread {
+	pthread_t tid;
+	unsigned int n;
+	uint64_t *samples;
+};
+
+static void *bench_open_fn(void *userdata)
+{
+	struct bench_open_thread *t = userdata;
+	struct bench_peer peer;
+	uint64_t start;
+	unsigned int i;
+
+	for (i = 0; i < t->n; ++i) {
+		start = nsec_from_clock(CLOCK_MONOTONIC);
+		bench_open(&peer);
+		bench_close(&peer);
+		t->samples[i] = nsec_from_clock(CLOCK_MONOTONIC) - start;
+	}
+
+	return NULL;
+}
+
+/* @n_threads threads creating and destroying short-lived peers */
+static void bench_open_close(unsigned int n_threads)
+{
+	struct bench_result res = {
+		.name = "open-close",
+		.n_peers = n_threads,
+	};
+	struct bench_open_thread threads[BENCH_MAX_PEERS];
+	uint64_t i, n, start;
+	int r;
+
+	assert(n_threads <= BENCH_MAX_PEERS);
+
+	n = bench_iterations / n_threads ?: 1;
+
+	res.n_samples = n * n_threads;
+	res.samples = calloc(res.n_samples, sizeof(*res.samples));
+	assert(res.samples);
+
+	start = nsec_from_clock(CLOCK_MONOTONIC);
+	for (i = 0; i < n_threads; ++i) {
+		threads[i] = (struct bench_open_thread){
+			.n = n,
+			.samples = res.samples + i * n,
+		};
+		r = pthread_create(&threads[i].tid, NULL, bench_open_fn,
+				   &threads[i]);
+		assert(r == 0);
+	}
+	for (i = 0; i < n_threads; ++i) {
+		r = pthread_join(threads[i].tid, NULL);
+		assert(r == 0);
+	}
+	res.ns = nsec_from_clock(CLOCK_MONOTONIC) - start;
+	res.n_ops = n * n_threads;
+
+	bench_report(&res);
+}
+
+static void bench_run(void)
+{
+	static const size_t mixed[] = { 8, 256, 4096, 64, 65536, 1024 };
+	static const size_t small[] = { 0 };
+	static const size_t medium[] = { 1024 };
+	static const size_t large[] = { 65536 };
+	unsigned int i;
+
+	bench_pingpong("pingpong", small, 1);
+	bench_pingpong("pingpong", medium, 1);
+	bench_pingpong("pingpong", large, 1);
+	bench_pingpong("pingpong-mixed", mixed,
+		       sizeof(mixed) / sizeof(*mixed));
+
+	for (i = 1; i <= 16; i <<= 2) {
+		bench_fanout(i, 1024, 0);
+		bench_fanout(i, 1024, 16);
+		bench_fanin(i, 1024);
+	}
+
+	bench_slow_consumer(0, 1024);
+	bench_slow_consumer(10, 1024);
+	bench_slow_consumer(100, 1024);
+
+	bench_transfer(0, 0);
+	bench_transfer(16, 0);
+	bench_transfer(0, 16);
+	bench_transfer(16, 16);
+
+	bench_pool_pressure(0);
+	bench_pool_pressure(256);
+	bench_pool_pressure(4096);
+
+	for (i = 1; i <= 16; i <<= 2)
+		bench_open_close(i);
+
+	if (bench_format == BENCH_FORMAT_JSON)
+		printf("%s\n]\n", bench_n_records ? "" : "[");
+}
+
+static int bench_parse_argv(int argc, char **argv)
+{
+	enum {
+		ARG_MODULE = 0x100,
+		ARG_FORMAT,
+		ARG_ITERATIONS,
+	};
+	static const struct option options[] = {
+		{ "help",	no_argument,		NULL, 'h' },
+		{ "module",	required_argument,	NULL, ARG_MODULE },
+		{ "format",	required_argument,	NULL, ARG_FORMAT },
+		{ "iterations",	required_argument,	NULL, ARG_ITERATIONS },
+		{}
+	};
+	char *t;
+	int c;
+
+	t = getenv("BUS1EXT");
+	if (t) {
+		test_arg_module = malloc(strlen(t) + 4);
+		assert(test_arg_module);
+		strcpy(test_arg_module, "bus");
+		strcpy(test_arg_module + 3, t);
+	}
+
+	while ((c = getopt_long(argc, argv, "h", options, NULL)) >= 0) {
+		switch (c) {
+		case 'h':
+			fprintf(stderr,
+				"Usage: %s [OPTIONS...] ...\n\n"
+				"Run bus1 benchmarks.\n\n"
+				"\t-h, --help             Print this help\n"
+				"\t    --module=bus1      Module to use\n"
+				"\t    --format=csv|json  Output format\n"
+				"\t    --iterations=N     Operations per run\n"
+				, program_invocation_short_name);
+
+			return 0;
+
+		case ARG_MODULE:
+			test_arg_module = optarg;
+			break;
+
+		case ARG_FORMAT:
+			if (!strcmp(optarg, "csv"))
+				bench_format = BENCH_FORMAT_CSV;
+			else if (!strcmp(optarg, "json"))
+				bench_format = BENCH_FORMAT_JSON;
+			else
+				return -EINVAL;
+			break;
+
+		case ARG_ITERATIONS:
+			bench_iterations = strtoul(optarg, NULL, 10);
+			if (!bench_iterations)
+				return -EINVAL;
+			break;
+
+		case '?':
+			/* fallthrough */
+		default:
+			return -EINVAL;
+		}
+	}
+
+	/* store cdev-path for benchmarks to access ("/dev/<module>") */
+	free(test_path);
+	test_path = malloc(strlen(test_arg_module) + 6);
+	assert(test_path);
+	strcpy(test_path, "/dev/");
+	strcpy(test_path + 5, test_arg_module);
+
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	int r;
+
+	r = bench_parse_argv(argc, argv);
+	if (r > 0)
+		bench_run();
+
+	return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
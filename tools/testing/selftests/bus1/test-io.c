@@ -176,6 +176,10 @@ static void test_io(void)
 		base, test_iterate(100000, 1, 0) - base);
 	fprintf(stderr, "it took %lu ns + %lu ns for one destination\n", base,
 		test_iterate(100000, 1, 1024) - base);
+	fprintf(stderr,
+		"unicast took %lu ns, multicast took %lu ns per destination\n",
+		test_iterate(100000, 1, 1024) - base,
+		(test_iterate(50000, 2, 1024) - base) / 2);
 
 	for (i = 1; i < 9; ++i) {
 		unsigned int dests = 1UL << i;